@@ -0,0 +1,485 @@
+/* =============================================================================
+ *
+ * Title:         Benchmarks for the IPC modules
+ * Author:        Felix Niederwanger
+ * License:       Copyright (c), 2019 Felix Niederwanger
+ *                MIT license (http://opensource.org/licenses/MIT)
+ *
+ * Measures ping-pong round-trip latency (p50/p99/p999), one-way throughput
+ * across message sizes, scaling over the number of processes and the cost of
+ * attaching/detaching shared memory. Results are printed as CSV (default) or
+ * JSON, so that they can be compared between versions.
+ *
+ * Usage: benchmark [--json] [--iterations N] [--procs N] [--no-pin]
+ *
+ * =============================================================================
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#include "ipc.hpp"
+
+// Keys used by the benchmark. Check `ipcs` that they are free
+#define IPC_KEY_PING 0x8b0
+#define IPC_KEY_PONG 0x8b1
+#define IPC_KEY_SHM  0x8b2
+#define IPC_KEY_SYNC 0x8b3
+#define IPC_KEY_LOCK 0x8b4
+#define IPC_KEY_RPC  0x8b5
+#define IPC_KEY_COUNT 0x8b6
+
+
+using namespace std;
+
+/** Benchmark settings */
+static int iterations = 100000;
+static int max_procs = 0;
+static bool pin = true;
+static int ncpus = 1;
+
+/** Single result row */
+struct Result {
+	string benchmark;
+	string mechanism;
+	size_t size;
+	int procs;
+	long count;
+	double mean_ns;
+	double p50_ns;
+	double p99_ns;
+	double p999_ns;
+	double ops_per_sec;
+	double mb_per_sec;
+
+	Result(const string &benchmark, const string &mechanism) : benchmark(benchmark), mechanism(mechanism),
+		size(0), procs(1), count(0), mean_ns(0), p50_ns(0), p99_ns(0), p999_ns(0), ops_per_sec(0), mb_per_sec(0) {}
+};
+
+/** Shared synchronization area for multi-process benchmarks */
+struct SyncArea {
+	alignas(IPC_CACHELINE_SIZE) std::atomic<uint32_t> ready;
+	alignas(IPC_CACHELINE_SIZE) std::atomic<uint32_t> go;
+	alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> ping;
+	alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> pong;
+};
+
+static inline uint64_t now_ns(void) {
+	return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** Pin the calling process to the given CPU (modulo the number of CPUs) */
+static void pin_cpu(int cpu) {
+	if(!pin) return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % ncpus, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+/** Fork a child that runs the given function and exits */
+template<class Func>
+static pid_t spawn(Func func) {
+	cout.flush();
+	pid_t pid = fork();
+	if (pid < 0) {
+		cerr << "Fork failed" << endl;
+		exit(EXIT_FAILURE);
+	} else if(pid == 0) {
+		func();
+		_exit(EXIT_SUCCESS);
+	}
+	return pid;
+}
+
+static void wait_all(const vector<pid_t> &pids) {
+	for(size_t i=0;i<pids.size();i++) {
+		int status;
+		waitpid(pids[i], &status, 0);
+		if (status != 0)
+			cerr << "Child " << pids[i] << " terminated with status " << status << endl;
+	}
+}
+
+/** Fill mean and percentiles from latency samples in nanoseconds */
+static void percentiles(Result &result, vector<uint64_t> &samples) {
+	if(samples.empty()) return;
+	sort(samples.begin(), samples.end());
+	double sum = 0;
+	for(size_t i=0;i<samples.size();i++) sum += samples[i];
+	const size_t n = samples.size();
+	result.count = (long)n;
+	result.mean_ns = sum / n;
+	result.p50_ns = samples[n * 50 / 100];
+	result.p99_ns = samples[min(n - 1, n * 99 / 100)];
+	result.p999_ns = samples[min(n - 1, n * 999 / 1000)];
+	result.ops_per_sec = 1e9 / result.mean_ns;
+}
+
+/** Spin on an atomic until it has the expected value. Yields occasionally so that oversubscribed systems progress */
+static inline void spin_until(std::atomic<uint64_t> &var, uint64_t value) {
+	unsigned spins = 0;
+	while(var.load(std::memory_order_acquire) != value) {
+		ipc_cpu_relax();
+		if(++spins % 1024 == 0) sched_yield();
+	}
+}
+
+
+/* ==== Ping-pong latency ================================================== */
+
+/** Round trip between two processes using a pair of semaphores */
+template<class Sem>
+static Result bench_pingpong(const string &name) {
+	Result result("pingpong", name);
+	Sem ping(IPC_KEY_PING);
+	Sem pong(IPC_KEY_PONG);
+	ping.setValue(0);
+	pong.setValue(0);
+
+	pid_t pid = spawn([]() {
+		pin_cpu(1);
+		Sem ping(IPC_KEY_PING);
+		Sem pong(IPC_KEY_PONG);
+		for(int i=0;i<iterations;i++) {
+			ping.aquire();
+			pong.release();
+		}
+	});
+
+	pin_cpu(0);
+	vector<uint64_t> samples(iterations);
+	for(int i=0;i<iterations;i++) {
+		const uint64_t start = now_ns();
+		ping.release();
+		pong.aquire();
+		samples[i] = now_ns() - start;
+	}
+	wait_all(vector<pid_t>(1, pid));
+	ping.destroy();
+	pong.destroy();
+	percentiles(result, samples);
+	return result;
+}
+
+/** Round trip between two processes spinning on shared flags */
+static Result bench_pingpong_spin(void) {
+	Result result("pingpong", "spin");
+	SharedMemory shm(IPC_KEY_SYNC, sizeof(SyncArea));
+	SyncArea *sync = (SyncArea*)shm.get();
+	sync->ping.store(0);
+	sync->pong.store(0);
+
+	pid_t pid = spawn([]() {
+		pin_cpu(1);
+		SharedMemory shm(IPC_KEY_SYNC, sizeof(SyncArea));
+		SyncArea *sync = (SyncArea*)shm.get();
+		for(int i=1;i<=iterations;i++) {
+			spin_until(sync->ping, i);
+			sync->pong.store(i, std::memory_order_release);
+		}
+	});
+
+	pin_cpu(0);
+	vector<uint64_t> samples(iterations);
+	for(int i=1;i<=iterations;i++) {
+		const uint64_t start = now_ns();
+		sync->ping.store(i, std::memory_order_release);
+		spin_until(sync->pong, i);
+		samples[i-1] = now_ns() - start;
+	}
+	wait_all(vector<pid_t>(1, pid));
+	percentiles(result, samples);
+	return result;
+}
+
+/** Round trip of synchronous calls through an RPC channel, sleeping or polling */
+static Result bench_pingpong_rpc(const bool polling) {
+	typedef ShmRpc<uint64_t, uint64_t> Rpc;
+	Result result("pingpong", polling ? "ShmRpc-polling" : "ShmRpc");
+	Rpc rpc(IPC_KEY_RPC, 1, 16);
+	rpc.setPolling(polling);
+
+	pid_t pid = spawn([polling]() {
+		pin_cpu(1);
+		Rpc rpc(IPC_KEY_RPC, 1, 16);
+		rpc.setPolling(polling);
+		Rpc::Incoming in[16];
+		for(int i=0;i<iterations;) {
+			rpc.waitRequests();
+			const size_t n = rpc.receive(in, 16);
+			for(size_t j=0;j<n;j++) rpc.complete(in[j].client, in[j].id, in[j].request + 1);
+			rpc.flush();
+			i += (int)n;
+		}
+	});
+
+	pin_cpu(0);
+	const int client = rpc.connect();
+	vector<uint64_t> samples(iterations);
+	for(int i=0;i<iterations;i++) {
+		const uint64_t start = now_ns();
+		rpc.call(client, (uint64_t)i);
+		samples[i] = now_ns() - start;
+	}
+	wait_all(vector<pid_t>(1, pid));
+	percentiles(result, samples);
+	return result;
+}
+
+/* ==== One-way throughput ================================================= */
+
+/** Stream bytes from a producer to a consumer process through a ring buffer */
+static Result bench_throughput(const size_t msgsize) {
+	Result result("throughput", "ShmRingBuffer");
+	const size_t capacity = max((size_t)1 << 20, msgsize * 4);
+	const long messages = max(1L, (long)iterations * 64 / (long)max((size_t)64, msgsize));
+	ShmRingBuffer<char> ring(IPC_KEY_SHM, capacity);
+	SharedMemory shm(IPC_KEY_SYNC, sizeof(SyncArea));
+	SyncArea *sync = (SyncArea*)shm.get();
+	sync->ready.store(0);
+
+	pid_t pid = spawn([=]() {
+		pin_cpu(1);
+		ShmRingBuffer<char> ring(IPC_KEY_SHM, capacity);
+		vector<char> buf(msgsize);
+		for(long i=0;i<messages;i++) {
+			size_t received = 0;
+			while(received < msgsize) {
+				const size_t n = ring.pop(&buf[received], msgsize - received);
+				if(n == 0) sched_yield();
+				received += n;
+			}
+		}
+	});
+
+	pin_cpu(0);
+	vector<char> buf(msgsize, 'x');
+	const uint64_t start = now_ns();
+	for(long i=0;i<messages;i++) {
+		size_t sent = 0;
+		while(sent < msgsize) {
+			const size_t n = ring.push(&buf[sent], msgsize - sent);
+			if(n == 0) sched_yield();
+			sent += n;
+		}
+	}
+	wait_all(vector<pid_t>(1, pid));
+	const double elapsed = (now_ns() - start) * 1e-9;
+
+	result.size = msgsize;
+	result.count = messages;
+	result.mean_ns = elapsed * 1e9 / messages;
+	result.ops_per_sec = messages / elapsed;
+	result.mb_per_sec = messages * (double)msgsize / elapsed / 1e6;
+	return result;
+}
+
+
+/* ==== Scaling over processes ============================================= */
+
+/** Start signal of run_scaling(). Workers call wait() once they are set up */
+struct StartGate {
+	SyncArea *sync;
+
+	explicit StartGate(SyncArea *sync) : sync(sync) {}
+
+	void wait(void) const {
+		sync->ready.fetch_add(1);
+		while(sync->go.load(std::memory_order_acquire) == 0) sched_yield();
+	}
+};
+
+/**
+ * Run body(p, gate) in procs processes, process p pinned to CPU p. Each body attaches its
+ * objects, calls gate.wait() and then does `iterations` operations. Only the time from the
+ * start signal until all processes exited is measured
+ */
+template<class Body>
+static Result run_scaling(Result result, const int procs, Body body) {
+	SharedMemory shm(IPC_KEY_SYNC, sizeof(SyncArea));
+	SyncArea *sync = (SyncArea*)shm.get();
+	sync->ready.store(0);
+	sync->go.store(0);
+
+	vector<pid_t> pids;
+	for(int p=0;p<procs;p++) {
+		pids.push_back(spawn([=]() {
+			pin_cpu(p);
+			body(p, StartGate(sync));
+		}));
+	}
+	while(sync->ready.load() != (uint32_t)procs) sched_yield();
+	const uint64_t start = now_ns();
+	sync->go.store(1, std::memory_order_release);
+	wait_all(pids);
+	const double elapsed = (now_ns() - start) * 1e-9;
+
+	result.procs = procs;
+	result.count = (long)iterations * procs;
+	result.ops_per_sec = result.count / elapsed;
+	result.mean_ns = elapsed * 1e9 / result.count;
+	return result;
+}
+
+/** N processes doing acquire/release pairs on one semaphore */
+template<class Sem>
+static Result bench_scaling(const string &name, const int procs) {
+	Sem sem(IPC_KEY_PING);
+	sem.setValue(1);
+	const Result result = run_scaling(Result("scaling", name), procs, [](int, const StartGate &gate) {
+		Sem sem(IPC_KEY_PING);
+		gate.wait();
+		for(int i=0;i<iterations;i++) {
+			sem.aquire();
+			sem.release();
+		}
+	});
+	sem.destroy();
+	return result;
+}
+
+/** N processes locking and unlocking the mutex of one shared memory segment */
+static Result bench_scaling_mutex(const int procs) {
+	SharedMemory shm(IPC_KEY_SHM, sizeof(uint64_t));
+	return run_scaling(Result("scaling", "ShmMutex"), procs, [](int, const StartGate &gate) {
+		SharedMemory shm(IPC_KEY_SHM, sizeof(uint64_t));
+		gate.wait();
+		for(int i=0;i<iterations;i++) {
+			shm.lock();
+			shm.unlock();
+		}
+	});
+}
+
+/** N processes counting events, either in a ShmCounterSet or in adjacent slots of one array */
+static Result bench_scaling_counters(const int procs, const bool sharded) {
+	ShmCounterSet set(IPC_KEY_COUNT, 1);
+	SharedMemory shm(IPC_KEY_SHM, sizeof(uint64_t) * procs);
+	std::atomic<uint64_t> *slots = (std::atomic<uint64_t>*)shm.get();
+	for(int p=0;p<procs;p++) slots[p].store(0);
+	return run_scaling(Result("scaling", sharded ? "ShmCounterSet" : "array[proc]"), procs, [=](int p, const StartGate &gate) {
+		ShmCounterSet set(IPC_KEY_COUNT, 1);
+		gate.wait();
+		for(int i=0;i<iterations;i++) {
+			if(sharded) set.count(0);
+			else slots[p].fetch_add(1, std::memory_order_relaxed);
+		}
+	});
+}
+
+/** N processes taking and releasing the shared side of one reader-writer lock */
+static Result bench_scaling_rwlock(const int procs) {
+	ShmRWLock lock(IPC_KEY_LOCK);
+	lock.memory().setDeleteOnDispose(true);
+	return run_scaling(Result("scaling", "ShmRWLock(shared)"), procs, [](int, const StartGate &gate) {
+		ShmRWLock lock(IPC_KEY_LOCK);
+		gate.wait();
+		for(int i=0;i<iterations;i++) {
+			lock.lock_shared();
+			lock.unlock_shared();
+		}
+	});
+}
+
+
+/* ==== Attach / detach ==================================================== */
+
+/** Every iteration creates a fresh IPC_PRIVATE segment, so each sample pays the full
+ * shmget/shmat/shmctl(IPC_RMID)/shmdt cycle instead of hitting the attachment registry */
+static Result bench_attach(const size_t size) {
+	Result result("attach_detach", "SharedMemory");
+	const int n = max(1, iterations / 10);
+	vector<uint64_t> samples(n);
+	for(int i=0;i<n;i++) {
+		const uint64_t start = now_ns();
+		SharedMemory shm(IPC_PRIVATE, size);
+		shm.destroy();
+		samples[i] = now_ns() - start;
+	}
+	percentiles(result, samples);
+	result.size = size;
+	return result;
+}
+
+
+/* ==== Output ============================================================= */
+
+static void print_csv(const vector<Result> &results) {
+	cout << "benchmark,mechanism,size,procs,count,mean_ns,p50_ns,p99_ns,p999_ns,ops_per_sec,mb_per_sec" << endl;
+	for(size_t i=0;i<results.size();i++) {
+		const Result &r = results[i];
+		cout << r.benchmark << "," << r.mechanism << "," << r.size << "," << r.procs << "," << r.count << ","
+			<< r.mean_ns << "," << r.p50_ns << "," << r.p99_ns << "," << r.p999_ns << ","
+			<< r.ops_per_sec << "," << r.mb_per_sec << endl;
+	}
+}
+
+static void print_json(const vector<Result> &results) {
+	cout << "[" << endl;
+	for(size_t i=0;i<results.size();i++) {
+		const Result &r = results[i];
+		cout << "  {\"benchmark\": \"" << r.benchmark << "\", \"mechanism\": \"" << r.mechanism << "\", \"size\": " << r.size
+			<< ", \"procs\": " << r.procs << ", \"count\": " << r.count << ", \"mean_ns\": " << r.mean_ns
+			<< ", \"p50_ns\": " << r.p50_ns << ", \"p99_ns\": " << r.p99_ns << ", \"p999_ns\": " << r.p999_ns
+			<< ", \"ops_per_sec\": " << r.ops_per_sec << ", \"mb_per_sec\": " << r.mb_per_sec << "}"
+			<< (i + 1 < results.size() ? "," : "") << endl;
+	}
+	cout << "]" << endl;
+}
+
+static void usage(const char *prog) {
+	cerr << "Usage: " << prog << " [--json] [--iterations N] [--procs N] [--no-pin]" << endl;
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+	bool json = false;
+	for(int i=1;i<argc;i++) {
+		const string arg = argv[i];
+		if(arg == "--json") json = true;
+		else if(arg == "--no-pin") pin = false;
+		else if(arg == "--iterations" && i + 1 < argc) iterations = atoi(argv[++i]);
+		else if(arg == "--procs" && i + 1 < argc) max_procs = atoi(argv[++i]);
+		else usage(argv[0]);
+	}
+	if(iterations <= 0) usage(argv[0]);
+	ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpus <= 0) ncpus = 1;
+	if(max_procs <= 0) max_procs = ncpus;
+
+	vector<Result> results;
+	results.push_back(bench_pingpong<Semaphore>("Semaphore"));
+	results.push_back(bench_pingpong<FastSemaphore>("FastSemaphore"));
+	results.push_back(bench_pingpong_spin());
+	results.push_back(bench_pingpong_rpc(false));
+	if(ncpus > 1) results.push_back(bench_pingpong_rpc(true));
+
+	const size_t sizes[] = { 8, 64, 512, 4096, 65536 };
+	for(size_t i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++)
+		results.push_back(bench_throughput(sizes[i]));
+
+	for(int procs=1;procs<=max_procs;procs*=2) {
+		results.push_back(bench_scaling<Semaphore>("Semaphore", procs));
+		results.push_back(bench_scaling<FastSemaphore>("FastSemaphore", procs));
+		results.push_back(bench_scaling_mutex(procs));
+		results.push_back(bench_scaling_rwlock(procs));
+		results.push_back(bench_scaling_counters(procs, false));
+		results.push_back(bench_scaling_counters(procs, true));
+	}
+
+	results.push_back(bench_attach(4096));
+	results.push_back(bench_attach(16 << 20));
+
+	if(json) print_json(results);
+	else print_csv(results);
+	return EXIT_SUCCESS;
+}
@@ -76,22 +76,14 @@ int main() { //int argc, char** argv) {
     
     
     /* ==== Example section for shared memory =============================== */
-    SharedMemory shm(IPC_KEY, sizeof(double)*CHILDREN);
+    SharedMemory shm(IPC_KEY, sizeof(double)*(CHILDREN+1));
+    ShmBarrier barrier(IPC_KEY+1, CHILDREN+1);		// Parent and all children take part
     double *array = (double*)shm.get();			// *operator is also fine
     array[child_id] = child_id;
     
-    // Periodically check memory until everyone has set it's values
-    bool shm_ok = false;
-    do {
-    	shm_ok = true;
-    	for(int i=0;i<CHILDREN;i++) {
-    		if(array[i] != i) {
-    			shm_ok = false;
-    			break;
-    		}
-    	}
-    } while(!shm_ok);
-    cout << "Child " << child_id << " array sum (shm) = " << sum(array, CHILDREN) << endl;
+    // Wait until everyone has set it's values
+    barrier.wait();
+    cout << "Child " << child_id << " array sum (shm) = " << sum(array, CHILDREN+1) << endl;
     
     
     // Parent waits for children
@@ -8,8 +8,10 @@
  */
 
 #include <string>
-#include <sstream>
 #include <fstream>
+#include <thread>
+#include <map>
+#include <mutex>
 
 #include <signal.h>
 #include <stdio.h>
@@ -20,17 +22,651 @@
 #include <signal.h>
 #include <errno.h>
 
+#include <time.h>
+#include <limits.h>
+
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 
 #include "ipc.hpp"
 
 using namespace std;
 
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be a plain 32-bit integer");
+
+/** Sleep on the given futex word as long as it contains the expected value */
+static int futex_wait(std::atomic<uint32_t> *addr, uint32_t expected, const struct timespec *timeout = NULL) {
+	return (int)::syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+/** Wake up to n waiters sleeping on the given futex word */
+static int futex_wake(std::atomic<uint32_t> *addr, int n) {
+	return (int)::syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+/** Compute the absolute CLOCK_MONOTONIC deadline for the given timeout */
+static struct timespec deadline_after(long timeout_us) {
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	if(timeout_us < 0) timeout_us = 0;
+	ts.tv_sec += timeout_us / 1000000L;
+	ts.tv_nsec += (timeout_us % 1000000L) * 1000L;
+	if(ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return ts;
+}
+
+/** Compute the time remaining until the deadline
+  * @returns false if the deadline has already passed */
+static bool time_remaining(const struct timespec &deadline, struct timespec *remaining) {
+	struct timespec now;
+	::clock_gettime(CLOCK_MONOTONIC, &now);
+	remaining->tv_sec = deadline.tv_sec - now.tv_sec;
+	remaining->tv_nsec = deadline.tv_nsec - now.tv_nsec;
+	if(remaining->tv_nsec < 0) {
+		remaining->tv_sec--;
+		remaining->tv_nsec += 1000000000L;
+	}
+	return remaining->tv_sec >= 0;
+}
+
+/** Magic value marking an initialized stats segment */
+#define IPC_STATS_MAGIC 0x53544154
+/** Layout version of the stats segment, bumped whenever counters or histograms change */
+#define IPC_STATS_VERSION 1
+
+/** Histogram in the stats segment */
+struct IPCStatsHistogramData {
+	std::atomic<uint64_t> samples;
+	std::atomic<uint64_t> total_ns;
+	std::atomic<uint64_t> buckets[IPC_STATS_BUCKETS];
+};
+
+/** Values updated by the processes running on a set of CPUs */
+struct IPCStatsShard {
+	alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> counters[IPC_STATS_COUNTERS];
+	IPCStatsHistogramData histograms[IPC_STATS_HISTOGRAMS];
+};
+
+/** Layout of the stats segment */
+struct IPCStatsSegment {
+	alignas(IPC_CACHELINE_SIZE) std::atomic<uint32_t> ready;
+	uint32_t version;
+	uint32_t shards;
+	IPCStatsShard shard[IPC_STATS_SHARDS];
+};
+
+/** Number of yields between two checks whether the creator of a segment is still alive */
+#define IPC_READY_CHECK_ROUNDS 256
+
+static bool owner_alive(uint32_t pid, uint64_t start);
+
+/**
+ * Wait until the creator of a segment stores the magic value into its ready field
+ * @param creator Pid of the process that created the segment
+ * @returns false if the creator exited without storing it
+ */
+static bool ready_wait(const std::atomic<uint32_t> &ready, uint32_t magic, pid_t creator) {
+	for(unsigned round = 1; ready.load(std::memory_order_acquire) != magic; round++) {
+		// The creator may have stored the value right before exiting
+		if(round % IPC_READY_CHECK_ROUNDS == 0 && !owner_alive((uint32_t)creator, 0))
+			return ready.load(std::memory_order_acquire) == magic;
+		sched_yield();
+	}
+	return true;
+}
+
+/** Attach to the stats segment of the given key. Creates it if requested
+  * @returns the segment, or NULL if it does not exist */
+static IPCStatsSegment *stats_attach(int key, bool create) {
+	const int shmid = ::shmget(key, sizeof(IPCStatsSegment), create ? (IPC_CREAT | IPC_EXCL | 0600) : 0);
+	if(shmid >= 0 && create) {
+		// Fresh segment is zeroed, which is a valid state for all values
+		IPCStatsSegment *segment = (IPCStatsSegment*)::shmat(shmid, NULL, 0);
+		if(segment == (void*)-1) return NULL;
+		segment->version = IPC_STATS_VERSION;
+		segment->shards = IPC_STATS_SHARDS;
+		segment->ready.store(IPC_STATS_MAGIC, std::memory_order_release);
+		return segment;
+	}
+	const int id = ::shmget(key, 0, 0);
+	if(id < 0) return NULL;
+	IPCStatsSegment *segment = (IPCStatsSegment*)::shmat(id, NULL, 0);
+	if(segment == (void*)-1) return NULL;
+	struct ::shmid_ds buf;
+	if(::shmctl(id, IPC_STAT, &buf) < 0 || buf.shm_segsz < sizeof(IPCStatsSegment)) {
+		::shmdt(segment);
+		return NULL;
+	}
+	if(!ready_wait(segment->ready, IPC_STATS_MAGIC, buf.shm_cpid) ||
+			segment->version != IPC_STATS_VERSION || segment->shards != IPC_STATS_SHARDS) {
+		::shmdt(segment);
+		return NULL;
+	}
+	return segment;
+}
+
+/** @returns the shard of the calling process in the stats segment, or NULL if stats are unavailable */
+static IPCStatsShard *stats_shard(void) {
+	// Attached once and kept for the lifetime of the process. Stats are best effort,
+	// if the segment cannot be created the instrumentation stays silent
+	static IPCStatsSegment *segment = stats_attach(IPC_STATS_KEY, true);
+	if(segment == NULL) return NULL;
+	const int cpu = ::sched_getcpu();
+	return &segment->shard[(cpu < 0 ? 0 : cpu) % IPC_STATS_SHARDS];
+}
+
+uint64_t IPCStats::now(void) {
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void IPCStats::count(IPCStatsCounter counter, uint64_t n) {
+	IPCStatsShard *shard = stats_shard();
+	if(shard == NULL) return;
+	shard->counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void IPCStats::record(IPCStatsHistogram histogram, uint64_t ns) {
+	IPCStatsShard *shard = stats_shard();
+	if(shard == NULL) return;
+	int bucket = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+	if(bucket >= IPC_STATS_BUCKETS) bucket = IPC_STATS_BUCKETS - 1;
+	IPCStatsHistogramData &data = shard->histograms[histogram];
+	data.samples.fetch_add(1, std::memory_order_relaxed);
+	data.total_ns.fetch_add(ns, std::memory_order_relaxed);
+	data.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+bool IPCStats::snapshot(Snapshot &snapshot, int key) {
+	IPCStatsSegment *segment = stats_attach(key, false);
+	if(segment == NULL) return false;
+	::memset(&snapshot, 0, sizeof(Snapshot));
+	for(int s = 0; s < IPC_STATS_SHARDS; s++) {
+		const IPCStatsShard &shard = segment->shard[s];
+		for(int i = 0; i < IPC_STATS_COUNTERS; i++)
+			snapshot.counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+		for(int h = 0; h < IPC_STATS_HISTOGRAMS; h++) {
+			snapshot.samples[h] += shard.histograms[h].samples.load(std::memory_order_relaxed);
+			snapshot.total_ns[h] += shard.histograms[h].total_ns.load(std::memory_order_relaxed);
+			for(int b = 0; b < IPC_STATS_BUCKETS; b++)
+				snapshot.buckets[h][b] += shard.histograms[h].buckets[b].load(std::memory_order_relaxed);
+		}
+	}
+	::shmdt(segment);
+	return true;
+}
+
+bool IPCStats::reset(int key) {
+	IPCStatsSegment *segment = stats_attach(key, false);
+	if(segment == NULL) return false;
+	for(int s = 0; s < IPC_STATS_SHARDS; s++) {
+		IPCStatsShard &shard = segment->shard[s];
+		for(int i = 0; i < IPC_STATS_COUNTERS; i++)
+			shard.counters[i].store(0, std::memory_order_relaxed);
+		for(int h = 0; h < IPC_STATS_HISTOGRAMS; h++) {
+			shard.histograms[h].samples.store(0, std::memory_order_relaxed);
+			shard.histograms[h].total_ns.store(0, std::memory_order_relaxed);
+			for(int b = 0; b < IPC_STATS_BUCKETS; b++)
+				shard.histograms[h].buckets[b].store(0, std::memory_order_relaxed);
+		}
+	}
+	::shmdt(segment);
+	return true;
+}
+
+uint64_t IPCStats::percentile(const Snapshot &snapshot, IPCStatsHistogram histogram, double p) {
+	const uint64_t samples = snapshot.samples[histogram];
+	if(samples == 0) return 0;
+	uint64_t rank = (uint64_t)(p * samples);
+	if(rank >= samples) rank = samples - 1;
+	uint64_t seen = 0;
+	for(int b = 0; b < IPC_STATS_BUCKETS; b++) {
+		seen += snapshot.buckets[histogram][b];
+		if(seen > rank) return (b == 0) ? 1 : (1ULL << b);
+	}
+	return 1ULL << (IPC_STATS_BUCKETS - 1);
+}
+
+const char *IPCStats::name(IPCStatsCounter counter) {
+	switch(counter) {
+		case IPC_STATS_SEM_ACQUIRES: return "sem_acquires";
+		case IPC_STATS_SEM_CONTENDED: return "sem_contended";
+		case IPC_STATS_SHM_ATTACHES: return "shm_attaches";
+		case IPC_STATS_SHM_ATTACH_EEXIST: return "shm_attach_eexist";
+		case IPC_STATS_SHM_ATTACH_CACHED: return "shm_attach_cached";
+		default: return "unknown";
+	}
+}
+
+const char *IPCStats::name(IPCStatsHistogram histogram) {
+	switch(histogram) {
+		case IPC_STATS_SEM_WAIT: return "sem_wait";
+		case IPC_STATS_SHM_ATTACH: return "shm_attach";
+		case IPC_STATS_SHM_SHMAT: return "shm_shmat";
+		default: return "unknown";
+	}
+}
+
+/** Upper bound for the adaptive spinning of ShmMutex */
+#define SHM_MUTEX_MAX_SPIN 1000
+
+/** Flag in the ShmMutex word indicating that there may be waiters */
+#define SHM_MUTEX_WAITERS 0x80000000U
+
+/** Interval in nanoseconds after which a sleeping ShmMutex waiter first checks whether the owner is alive */
+#define SHM_MUTEX_OWNER_CHECK_NS 10000000L
+
+/** Upper bound of the check interval, which doubles while the owner stays alive */
+#define SHM_MUTEX_OWNER_CHECK_MAX_NS 640000000L
+
+/**
+ * Read state and start time (clock ticks since boot) of the given process from /proc
+ * @returns false if the process does not exist or /proc is not readable
+ */
+static bool process_stat(pid_t pid, char *state, uint64_t *start) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return false;
+	char buf[1024];
+	const ssize_t len = ::read(fd, buf, sizeof(buf) - 1);
+	::close(fd);
+	if(len <= 0) return false;
+	buf[len] = '\0';
+	// The command name may contain spaces and parentheses, fields continue after the last ')'
+	const char *p = strrchr(buf, ')');
+	if(p == NULL) return false;
+	p++;
+	// Field 3 is the state, field 22 the start time
+	for(int i = 3; i <= 22; i++) {
+		while(*p == ' ') p++;
+		if(*p == '\0') return false;
+		if(i == 3) *state = *p;
+		if(i == 22) {
+			*start = strtoull(p, NULL, 10);
+			return true;
+		}
+		while(*p != ' ' && *p != '\0') p++;
+	}
+	return false;
+}
+
+/** Identity of this process as lock owner. Refreshed in forked children */
+static uint32_t owner_pid = 0;
+static uint64_t owner_start = 0;
+
+static void owner_refresh(void) {
+	owner_pid = (uint32_t)::getpid();
+	char state;
+	if(!process_stat((pid_t)owner_pid, &state, &owner_start)) owner_start = 0;
+}
+
+/** @returns pid of the calling process, without a system call */
+static inline uint32_t owner_self(void) {
+	static const int registered = (owner_refresh(), ::pthread_atfork(NULL, NULL, owner_refresh));
+	(void)registered;
+	return owner_pid;
+}
+
+/**
+ * Check if the owner of a lock still exists
+ * @param pid Pid of the owner
+ * @param start Start time the owner recorded, 0 if unknown
+ */
+static bool owner_alive(uint32_t pid, uint64_t start) {
+	char state;
+	uint64_t current;
+	if(!process_stat((pid_t)pid, &state, &current))
+		return !(::kill((pid_t)pid, 0) < 0 && errno == ESRCH);
+	// Zombies are dead owners, as are processes that reuse the pid of the owner
+	if(state == 'Z' || state == 'X') return false;
+	return start == 0 || current == start;
+}
+
+/**
+ * Check whether the owner of a lock word that still reads c died. The start time is reset
+ * before the word changes hands (unlock and takeover), so reading it between two identical
+ * acquire loads of the word yields either 0 or the start time of this owner. 0 counts as alive
+ */
+static bool owner_dead(const std::atomic<uint32_t> &word, const std::atomic<uint64_t> &ownerStart, uint32_t c) {
+	if(word.load(std::memory_order_acquire) != c) return false;
+	const uint64_t start = ownerStart.load(std::memory_order_acquire);
+	return word.load(std::memory_order_acquire) == c && !owner_alive(c & ~SHM_MUTEX_WAITERS, start);
+}
+
+bool ShmMutex::spin(void) {
+	const uint32_t estimate = this->spins.load(std::memory_order_relaxed);
+	const uint32_t maxSpin = (estimate * 2 + 16 < SHM_MUTEX_MAX_SPIN) ? estimate * 2 + 16 : SHM_MUTEX_MAX_SPIN;
+	for(uint32_t i = 0; i < maxSpin; i++) {
+		ipc_cpu_relax();
+		uint32_t c = this->word.load(std::memory_order_relaxed);
+		if(c == 0 && this->word.compare_exchange_weak(c, owner_self(), std::memory_order_acquire, std::memory_order_relaxed)) {
+			this->acquired();
+			// Move the estimate towards the number of rounds it actually took
+			this->spins.store(estimate + ((int32_t)i - (int32_t)estimate) / 8, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	// Spinning did not pay off, spin longer next time (bounded)
+	this->spins.store(estimate + ((int32_t)SHM_MUTEX_MAX_SPIN - (int32_t)estimate) / 8, std::memory_order_relaxed);
+	return false;
+}
+
+void ShmMutex::acquired(void) {
+	this->ownerStart.store(owner_start, std::memory_order_relaxed);
+}
+
+bool ShmMutex::wait(const struct timespec *deadline) {
+	const uint32_t self = owner_self();
+	long check_ns = SHM_MUTEX_OWNER_CHECK_NS;
+	uint32_t c = this->word.load(std::memory_order_acquire);
+	for(;;) {
+		if(c == 0) {
+			// Others may still sleep, so keep the waiters flag
+			if(this->word.compare_exchange_weak(c, self | SHM_MUTEX_WAITERS, std::memory_order_acquire, std::memory_order_acquire)) {
+				this->acquired();
+				return true;
+			}
+			continue;
+		}
+		if(!(c & SHM_MUTEX_WAITERS)) {
+			if(!this->word.compare_exchange_weak(c, c | SHM_MUTEX_WAITERS, std::memory_order_acquire, std::memory_order_acquire))
+				continue;
+			c |= SHM_MUTEX_WAITERS;
+		}
+
+		// Sleep in bounded intervals, to notice owners that died without unlocking. The interval
+		// backs off while the same owner stays alive, so long critical sections are not polled
+		struct timespec timeout;
+		timeout.tv_sec = check_ns / 1000000000L;
+		timeout.tv_nsec = check_ns % 1000000000L;
+		if(deadline != NULL) {
+			struct timespec remaining;
+			if(!time_remaining(*deadline, &remaining)) return false;
+			if(remaining.tv_sec < timeout.tv_sec || (remaining.tv_sec == timeout.tv_sec && remaining.tv_nsec < timeout.tv_nsec))
+				timeout = remaining;
+		}
+		if(futex_wait(&this->word, c, &timeout) < 0 && errno == ETIMEDOUT) {
+			if(owner_dead(this->word, this->ownerStart, c)) {
+				this->ownerStart.store(0, std::memory_order_relaxed);
+				if(this->word.compare_exchange_strong(c, self | SHM_MUTEX_WAITERS, std::memory_order_acq_rel, std::memory_order_acquire)) {
+					this->acquired();
+					this->died.store(1, std::memory_order_relaxed);
+					return true;
+				}
+				continue;
+			}
+			if(check_ns < SHM_MUTEX_OWNER_CHECK_MAX_NS) check_ns *= 2;
+		}
+		const uint32_t prev = c;
+		c = this->word.load(std::memory_order_acquire);
+		// A new owner gets checked soon again
+		if((c & ~SHM_MUTEX_WAITERS) != (prev & ~SHM_MUTEX_WAITERS)) check_ns = SHM_MUTEX_OWNER_CHECK_NS;
+	}
+}
+
+int ShmMutex::lock(void) {
+	uint32_t c = 0;
+	if(this->word.compare_exchange_strong(c, owner_self(), std::memory_order_acquire, std::memory_order_relaxed)) {
+		this->acquired();
+		return 0;
+	}
+	if(!this->spin()) this->wait(NULL);
+	return this->died.load(std::memory_order_relaxed) ? EOWNERDEAD : 0;
+}
+
+bool ShmMutex::try_lock(void) {
+	uint32_t c = 0;
+	if(!this->word.compare_exchange_strong(c, owner_self(), std::memory_order_acquire, std::memory_order_relaxed))
+		return false;
+	this->acquired();
+	return true;
+}
+
+bool ShmMutex::try_lock_for(long timeout_us) {
+	if(this->try_lock()) return true;
+	const struct timespec deadline = deadline_after(timeout_us);
+	if(this->spin()) return true;
+	return this->wait(&deadline);
+}
+
+void ShmMutex::unlock(void) {
+	this->died.store(0, std::memory_order_relaxed);
+	this->ownerStart.store(0, std::memory_order_relaxed);
+	// Only enter the kernel if somebody might be waiting
+	if(this->word.exchange(0, std::memory_order_release) & SHM_MUTEX_WAITERS)
+		futex_wake(&this->word, 1);
+}
+
+bool ShmMutex::isLocked(void) const {
+	return this->word.load(std::memory_order_relaxed) != 0;
+}
+
+bool ShmMutex::ownerDied(void) const {
+	return this->died.load(std::memory_order_relaxed) != 0;
+}
+
+/** Number of spin rounds of a Doorbell waiter before it sleeps */
+#define DOORBELL_SPIN 2000
+
+uint32_t Doorbell::sequence(void) const {
+	return this->seq.load(std::memory_order_acquire);
+}
+
+void Doorbell::wake(int n) {
+	if(this->waiters.load(std::memory_order_seq_cst) > 0)
+		futex_wake(&this->seq, n);
+}
+
+void Doorbell::ring(void) {
+	this->seq.fetch_add(1, std::memory_order_seq_cst);
+	this->wake(1);
+}
+
+void Doorbell::ringAll(void) {
+	this->seq.fetch_add(1, std::memory_order_seq_cst);
+	this->wake(INT_MAX);
+}
+
+void Doorbell::wait(uint32_t seen) {
+	this->wait_for(seen, -1);
+}
+
+bool Doorbell::wait_for(uint32_t seen, long timeout_us) {
+	// Spin first, most rings arrive within a few microseconds
+	for(int i = 0; i < DOORBELL_SPIN; i++) {
+		if(this->seq.load(std::memory_order_acquire) != seen) return true;
+		ipc_cpu_relax();
+	}
+
+	struct timespec deadline;
+	if(timeout_us >= 0) deadline = deadline_after(timeout_us);
+	for(;;) {
+		// Register as waiter before the final check, so that ring() sees us
+		this->waiters.fetch_add(1, std::memory_order_seq_cst);
+		if(this->seq.load(std::memory_order_seq_cst) != seen) {
+			this->waiters.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+		if(timeout_us < 0)
+			futex_wait(&this->seq, seen);
+		else {
+			struct timespec remaining;
+			if(!time_remaining(deadline, &remaining)) {
+				this->waiters.fetch_sub(1, std::memory_order_relaxed);
+				return false;
+			}
+			futex_wait(&this->seq, seen, &remaining);
+		}
+		this->waiters.fetch_sub(1, std::memory_order_relaxed);
+		if(this->seq.load(std::memory_order_acquire) != seen) return true;
+	}
+}
+
+/** Mapping of a System V segment in this process, shared by all SharedMemory instances */
+struct ShmMapping {
+	/** Attach address */
+	void *mem;
+	/** Key the segment has been attached with, IPC_PRIVATE if unknown */
+	int key;
+	/** Segment size requested when attaching. The actual segment may be larger */
+	size_t size;
+	/** Number of SharedMemory instances using this mapping */
+	int refs;
+	/** True if stat holds a cached IPC_STAT result */
+	bool statValid;
+	/** Cached IPC_STAT result */
+	struct ::shmid_ds stat;
+};
+
+/**
+ * Process-wide registry of attached System V segments, so that repeated attaches of the
+ * same segment reuse one mapping instead of issuing shmget/shmat again.
+ * Child processes inherit both the attachments and the registry on fork.
+ */
+struct ShmRegistry {
+	std::mutex mutex;
+	/** Mappings by shared memory id */
+	std::map<int, ShmMapping> byId;
+	/** Shared memory id by key */
+	std::map<int, int> byKey;
+};
+
+static ShmRegistry &shm_registry(void) {
+	// Never destroyed, so that static SharedMemory instances can detach during exit
+	static ShmRegistry *registry = new ShmRegistry();
+	return *registry;
+}
+
+/** Reuse an existing mapping for the given key, if it is large enough and the key still
+  * refers to the mapped segment. A segment that has been removed and recreated by another
+  * process gets a new id, so the cached entry is dropped and the caller attaches afresh
+  * @returns attach address or NULL if there is no usable mapping */
+static void *registry_acquire_key(int key, size_t segsize, int *shmid) {
+	if(key == IPC_PRIVATE) return NULL;
+	ShmRegistry &registry = shm_registry();
+	int cached;
+	{
+		std::lock_guard<std::mutex> guard(registry.mutex);
+		std::map<int, int>::iterator it = registry.byKey.find(key);
+		if(it == registry.byKey.end()) return NULL;
+		cached = it->second;
+	}
+
+	// Validate outside the registry lock, the system calls may block
+	struct ::shmid_ds stat;
+	const bool valid = ::shmget(key, 0, 0) == cached && ::shmctl(cached, IPC_STAT, &stat) == 0 && !(stat.shm_perm.mode & SHM_DEST);
+
+	std::lock_guard<std::mutex> guard(registry.mutex);
+	std::map<int, int>::iterator it = registry.byKey.find(key);
+	if(it == registry.byKey.end() || it->second != cached) return NULL;
+	if(!valid) {
+		registry.byKey.erase(it);
+		return NULL;
+	}
+	std::map<int, ShmMapping>::iterator mit = registry.byId.find(cached);
+	if(mit == registry.byId.end()) return NULL;
+	ShmMapping &mapping = mit->second;
+	mapping.stat = stat;
+	mapping.statValid = true;
+	if(segsize > (size_t)stat.shm_segsz) return NULL;
+	mapping.refs++;
+	*shmid = cached;
+	return mapping.mem;
+}
+
+/** Get the mapping of the given id, attaching the segment if it is not yet mapped
+  * @returns attach address or NULL if attaching failed */
+static void *registry_acquire_id(int shmid, int key, size_t segsize) {
+	ShmRegistry &registry = shm_registry();
+	std::lock_guard<std::mutex> guard(registry.mutex);
+	std::map<int, ShmMapping>::iterator it = registry.byId.find(shmid);
+	if(it != registry.byId.end()) {
+		it->second.refs++;
+		if(segsize > it->second.size) it->second.size = segsize;
+		if(key != IPC_PRIVATE) {
+			if(it->second.key == IPC_PRIVATE) it->second.key = key;
+			registry.byKey[key] = shmid;
+		}
+		return it->second.mem;
+	}
+
+	IPC_STATS_START(start);
+	void *mem = ::shmat(shmid, NULL, 0);
+	IPC_STATS_RECORD(IPC_STATS_SHM_SHMAT, start);
+	if(mem == (void*)-1) return NULL;
+	ShmMapping mapping;
+	mapping.mem = mem;
+	mapping.key = key;
+	mapping.size = segsize;
+	mapping.refs = 1;
+	mapping.statValid = false;
+	registry.byId[shmid] = mapping;
+	if(key != IPC_PRIVATE) registry.byKey[key] = shmid;
+	return mem;
+}
+
+/** Release a mapping. The segment is detached when the last user releases it
+  * @returns false if detaching failed */
+static bool registry_release(int shmid, void *mem) {
+	ShmRegistry &registry = shm_registry();
+	std::lock_guard<std::mutex> guard(registry.mutex);
+	std::map<int, ShmMapping>::iterator it = registry.byId.find(shmid);
+	if(it == registry.byId.end() || it->second.mem != mem)
+		return ::shmdt(mem) == 0;		// Not registered, e.g. attached before a fork of another thread
+	if(--it->second.refs > 0) return true;
+
+	const int key = it->second.key;
+	registry.byId.erase(it);
+	std::map<int, int>::iterator kit = registry.byKey.find(key);
+	if(kit != registry.byKey.end() && kit->second == shmid) registry.byKey.erase(kit);
+	return ::shmdt(mem) == 0;
+}
+
+/** Forget the key of a removed segment, so that new attaches by key don't reuse its mapping */
+static void registry_forget(int shmid) {
+	ShmRegistry &registry = shm_registry();
+	std::lock_guard<std::mutex> guard(registry.mutex);
+	for(std::map<int, int>::iterator it = registry.byKey.begin(); it != registry.byKey.end(); ) {
+		if(it->second == shmid) registry.byKey.erase(it++);
+		else ++it;
+	}
+}
+
+/** Get the IPC_STAT result for the given segment, from the cache unless refresh is set
+  * @returns false if IPC_STAT failed */
+static bool registry_stat(int shmid, struct ::shmid_ds *buf, bool refresh) {
+	ShmRegistry &registry = shm_registry();
+	std::lock_guard<std::mutex> guard(registry.mutex);
+	std::map<int, ShmMapping>::iterator it = registry.byId.find(shmid);
+	if(it != registry.byId.end() && it->second.statValid && !refresh) {
+		*buf = it->second.stat;
+		return true;
+	}
+	if(::shmctl(shmid, IPC_STAT, buf) < 0) return false;
+	if(it != registry.byId.end()) {
+		it->second.stat = *buf;
+		it->second.statValid = true;
+	}
+	return true;
+}
+
 SharedMemory::SharedMemory() {
 	this->shm_key = 0;
-	this->shmid = 0;
+	this->shmid = -1;
 	this->mem = NULL;
 	this->_attrs = 0;
 	this->_size = 0;
@@ -41,7 +677,7 @@ SharedMemory::SharedMemory() {
 
 SharedMemory::SharedMemory(int key) {
 	this->shm_key = key;
-	this->shmid = 0;
+	this->shmid = -1;
 	this->mem = NULL;
 	this->_attrs = 0;
 	this->_size = 0;
@@ -52,7 +688,7 @@ SharedMemory::SharedMemory(int key) {
 
 SharedMemory::SharedMemory(int key, size_t size, int attr) {
 	this->shm_key = key;
-	this->shmid = 0;
+	this->shmid = -1;
 	this->mem = NULL;
 	this->_attrs = 0;
 	this->_size = 0;
@@ -62,19 +698,97 @@ SharedMemory::SharedMemory(int key, size_t size, int attr) {
 	this->_deleteOnDestruction = this->_created;
 }
 
-SharedMemory::SharedMemory(const SharedMemory &ref) {
-	this->shm_key = ref.shm_key;
-	this->shmid = 0;
+SharedMemory::SharedMemory(int key, size_t size, int attr, const ShmOptions &options) {
+	this->shm_key = key;
+	this->shmid = -1;
 	this->mem = NULL;
 	this->_attrs = 0;
 	this->_size = 0;
+	this->_detachOnDestruction = true;
+	this->_created = false;
+	this->attach(size, attr, options);
+	this->_deleteOnDestruction = this->_created;
+}
+
+SharedMemory::SharedMemory(const SharedMemory &ref) {
+	this->shm_key = ref.shm_key;
+	this->shmid = -1;
+	this->mem = NULL;
+	this->_attrs = ref._attrs;
+	this->_size = ref._size;
+	this->_created = false;
+	this->_detachOnDestruction = true;
+	this->_deleteOnDestruction = false;
+	if(ref.isAttached()) {
+		// Share the mapping of the reference instead of attaching again
+		this->mem = registry_acquire_id(ref.shmid, ref.shm_key, ref._size + IPC_SHM_HEADER_SIZE);
+		if(this->mem == NULL)
+			throw IPCException("Attaching shared memory failed");
+		this->shmid = ref.shmid;
+	}
+}
+
+SharedMemory::SharedMemory(SharedMemory &&ref) {
+	this->shm_key = ref.shm_key;
+	this->shmid = ref.shmid;
+	this->mem = ref.mem;
+	this->_attrs = ref._attrs;
+	this->_size = ref._size;
+	this->_created = ref._created;
+	this->_detachOnDestruction = ref._detachOnDestruction;
+	this->_deleteOnDestruction = ref._deleteOnDestruction;
+	ref.forget();
+}
+
+SharedMemory &SharedMemory::operator=(const SharedMemory &ref) {
+	if(this == &ref) return *this;
+	// Acquire first, so that assigning a copy of the same segment never detaches it
+	void *mem = NULL;
+	if(ref.isAttached()) {
+		mem = registry_acquire_id(ref.shmid, ref.shm_key, ref._size + IPC_SHM_HEADER_SIZE);
+		if(mem == NULL)
+			throw IPCException("Attaching shared memory failed");
+	}
+	this->release();
+	this->shm_key = ref.shm_key;
+	this->shmid = (mem == NULL) ? -1 : ref.shmid;
+	this->mem = mem;
+	this->_attrs = ref._attrs;
+	this->_size = ref._size;
+	this->_created = false;
+	this->_detachOnDestruction = true;
+	this->_deleteOnDestruction = false;
+	return *this;
+}
+
+SharedMemory &SharedMemory::operator=(SharedMemory &&ref) {
+	if(this == &ref) return *this;
+	this->release();
+	this->shm_key = ref.shm_key;
+	this->shmid = ref.shmid;
+	this->mem = ref.mem;
+	this->_attrs = ref._attrs;
+	this->_size = ref._size;
+	this->_created = ref._created;
+	this->_detachOnDestruction = ref._detachOnDestruction;
+	this->_deleteOnDestruction = ref._deleteOnDestruction;
+	ref.forget();
+	return *this;
+}
+
+void SharedMemory::forget(void) {
+	this->shmid = -1;
+	this->mem = NULL;
 	this->_created = false;
 	this->_detachOnDestruction = true;
 	this->_deleteOnDestruction = false;
-	this->attach(ref._size, ref._attrs);
 }
 
 SharedMemory::~SharedMemory() {
+	this->release();
+}
+
+void SharedMemory::release(void) {
 	const int shm_key = this->shm_key;
 	const int shmid = this->shmid;
 	const size_t size = this->_size;
@@ -89,31 +803,169 @@ SharedMemory::~SharedMemory() {
 		}
 	}
 	if(this->_deleteOnDestruction) {
-		if(shmid <= 0)
-			SharedMemory::destroy(shm_key, size);
-		else {
-			if (::shmctl(shmid, IPC_RMID, NULL) < 0) {
-				// Possible error handling
+		try {
+			if(shmid < 0)
+				SharedMemory::destroy(shm_key, size);
+			else {
+				registry_forget(shmid);
+				if (::shmctl(shmid, IPC_RMID, NULL) < 0) {
+					// Possible error handling
+				}
 			}
+		} catch (...) {
+			// Swallow exception in destructor
 		}
 	}
+	this->forget();
 }
 
 
 void *SharedMemory::createNew(const int key, const size_t size, int attr) {
+	return SharedMemory::createNew(key, size, attr, ShmOptions());
+}
+
+void *SharedMemory::createNew(const int key, const size_t size, int attr, const ShmOptions &options) {
 	if(key < 0) throw IPCException("Illegal shared memory key");
 
 	// Create shared memory
-	const int shmid = shmget(key, size, attr | IPC_CREAT);
+	const size_t segsize = SharedMemory::segmentSize(size, options);
+	const int flags = SharedMemory::segmentFlags(attr, options);
+	bool created = true;
+	int shmid = shmget(key, segsize, flags | IPC_CREAT | IPC_EXCL);
+	if(shmid < 0 && errno == EEXIST) {
+		created = false;
+		shmid = shmget(key, segsize, flags);
+	}
 	if(shmid < 0)
 		throw IPCException("Error creating SharedMemory");
 
 	// Attach shared memory
 	void *mem = shmat(shmid, NULL, 0);
-	if(mem == NULL || (long)mem < 0)
+	if(mem == NULL || mem == (void*)-1) {
+		if(created) ::shmctl(shmid, IPC_RMID, NULL);
 		throw IPCException("Attaching shared memory failed");
+	}
 
-	return mem;
+	// Apply options on a temporary, non-owning instance
+	SharedMemory shm;
+	shm.shmid = shmid;
+	shm.mem = mem;
+	shm._size = size;
+	shm._detachOnDestruction = false;
+	try {
+		shm.applyOptions(options);
+	} catch(...) {
+		::shmdt(mem);
+		if(created) ::shmctl(shmid, IPC_RMID, NULL);
+		throw;
+	}
+
+	return (char*)mem + IPC_SHM_HEADER_SIZE;
+}
+
+size_t SharedMemory::segmentSize(size_t size, const ShmOptions &options) {
+	size_t segsize = size + IPC_SHM_HEADER_SIZE;
+	if(options.hugePageSize > 0) {
+		if((options.hugePageSize & (options.hugePageSize - 1)) != 0)
+			throw IPCException("Huge page size must be a power of two");
+		segsize = (segsize + options.hugePageSize - 1) & ~(options.hugePageSize - 1);
+	}
+	return segsize;
+}
+
+#ifndef SHM_HUGE_SHIFT
+#define SHM_HUGE_SHIFT 26
+#endif
+
+int SharedMemory::segmentFlags(int attr, const ShmOptions &options) {
+	if(options.hugePageSize == 0) return attr;
+	int log2 = 0;
+	while(((size_t)1 << log2) < options.hugePageSize) log2++;
+	return attr | SHM_HUGETLB | (log2 << SHM_HUGE_SHIFT);
+}
+
+void SharedMemory::applyOptions(const ShmOptions &options) {
+	if(options.lock) this->lockMemory();
+	if(options.prefault) this->prefault(options.prefaultThreads);
+}
+
+void SharedMemory::applyOptionsOrRelease(const ShmOptions &options) {
+	try {
+		this->applyOptions(options);
+	} catch(...) {
+		// Nobody else knows about a segment this instance just created
+		this->_detachOnDestruction = true;
+		this->_deleteOnDestruction = this->_created;
+		this->release();
+		throw;
+	}
+}
+
+void SharedMemory::lockMemory(void) {
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+
+	if(!this->shm_ctl(SHM_LOCK))
+		throw IPCException("Locking shared memory failed");
+	if(::mlock(this->mem, this->_size + IPC_SHM_HEADER_SIZE) < 0) {
+		// Don't leave the segment pinned system-wide
+		this->shm_ctl(SHM_UNLOCK);
+		throw IPCException("Locking shared memory pages failed");
+	}
+}
+
+void SharedMemory::unlockMemory(void) {
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+
+	::munlock(this->mem, this->_size + IPC_SHM_HEADER_SIZE);
+	if(!this->shm_ctl(SHM_UNLOCK))
+		throw IPCException("Unlocking shared memory failed");
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/** Minimum number of bytes a single prefault thread handles */
+#define SHM_PREFAULT_MIN_CHUNK (16UL << 20)
+
+/** Fault in the given page-aligned range without modifying its contents */
+static void prefault_range(char *begin, size_t len, size_t pagesize) {
+	// Let the kernel populate the range in one go if supported (Linux 5.14+)
+	if(::madvise(begin, len, MADV_POPULATE_WRITE) == 0) return;
+	// Fallback: atomically add zero to one byte per page, which is a write fault that leaves the data intact
+	for(size_t off = 0; off < len; off += pagesize)
+		__atomic_fetch_add(begin + off, (char)0, __ATOMIC_RELAXED);
+}
+
+void SharedMemory::prefault(int threads) {
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+
+	struct ::shmid_ds buf;
+	this->stats(&buf);
+	const size_t len = buf.shm_segsz;
+	// Huge page segments are aligned to the huge page size, so normal page steps are always fine
+	const size_t pagesize = (size_t)::sysconf(_SC_PAGESIZE);
+	char *base = (char*)this->mem;
+
+	if(threads <= 0) threads = (int)::sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads <= 0) threads = 1;
+	const size_t maxThreads = (len + SHM_PREFAULT_MIN_CHUNK - 1) / SHM_PREFAULT_MIN_CHUNK;
+	if((size_t)threads > maxThreads) threads = (int)maxThreads;
+	if(threads <= 1) {
+		prefault_range(base, len, pagesize);
+		return;
+	}
+
+	// Split into page-aligned chunks, one per thread
+	size_t chunk = (len + threads - 1) / threads;
+	chunk = (chunk + pagesize - 1) & ~(pagesize - 1);
+	vector<thread> workers;
+	for(size_t off = 0; off < len; off += chunk) {
+		const size_t n = (off + chunk > len) ? len - off : chunk;
+		workers.push_back(thread(prefault_range, base + off, n, pagesize));
+	}
+	for(size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
 }
 
 void SharedMemory::setDetachOnDispose(bool enabled) {
@@ -133,9 +985,9 @@ bool SharedMemory::isCreated(void) const {
 }
 
 void SharedMemory::detach(void *mem) {
-	if(mem == NULL || (long)mem < 0L) return;
+	if(mem == NULL || mem == (void*)-1) return;
 
-	int ret = ::shmdt(mem);
+	int ret = ::shmdt((char*)mem - IPC_SHM_HEADER_SIZE);
 	if(ret < 0) throw IPCException("Detaching shared memory failed");
 
 }
@@ -152,10 +1004,16 @@ int SharedMemory::id(void) const {
 }
 
 void *SharedMemory::get(void) const {
-	if(this->shmid <= 0)
+	if(this->mem == NULL)
 		return NULL;
 	else
-		return this->mem;
+		return (char*)this->mem + IPC_SHM_HEADER_SIZE;
+}
+
+SharedMemory::Header *SharedMemory::header(void) const {
+	static_assert(sizeof(Header) <= IPC_SHM_HEADER_SIZE, "Control header exceeds IPC_SHM_HEADER_SIZE");
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+	return (Header*)this->mem;
 }
 
 void *SharedMemory::create(size_t size, int attr) {
@@ -163,23 +1021,29 @@ void *SharedMemory::create(size_t size, int attr) {
 }
 
 void *SharedMemory::create(int shm_key, size_t size, int attr) {
+	return this->create(shm_key, size, attr, ShmOptions());
+}
+
+void *SharedMemory::create(int shm_key, size_t size, int attr, const ShmOptions &options) {
 	if(shm_key <= 0) throw IPCException("Illegal shared memory key");
 	if(this->isAttached()) throw IPCException("Cannot create shared memory while already one is attached to this class object");
 
-	int shmid = shmget(shm_key, size, attr | IPC_CREAT);
+	const size_t segsize = SharedMemory::segmentSize(size, options);
+	int shmid = shmget(shm_key, segsize, SharedMemory::segmentFlags(attr, options) | IPC_CREAT);
 	if(shmid < 0)
 		throw IPCException("Error creating SharedMemory");
-	this->shmid = shmid;
 
-	// Attach shared memory
-	this->mem = shmat(this->shmid, NULL, 0);
+	// Attach shared memory, or reuse the mapping if this process has already attached it
+	this->mem = registry_acquire_id(shmid, shm_key, segsize);
 	if(!this->isAttached())
 		throw IPCException("Attaching shared memory failed");
+	this->shmid = shmid;
 
 	this->_created = true;
 	this->_attrs = attr;
 	this->_size = size;
-	return this->mem;
+	this->applyOptionsOrRelease(options);
+	return this->get();
 }
 
 
@@ -191,19 +1055,42 @@ bool SharedMemory::isAttached(void) const {
 
 
 void *SharedMemory::attach(const size_t size, int attr) {
+	return this->attach(size, attr, ShmOptions());
+}
+
+void *SharedMemory::attach(const size_t size, int attr, const ShmOptions &options) {
 	if(shm_key < 0) throw IPCException("Illegal shared memory key");
 	if(this->isAttached()) throw IPCException("Cannot create shared memory while already one is attached to this class object");
-	if(size > SharedMemory::maxSize()) throw IPCException("Cannot allocate more memory than allowed by system");
+	const size_t segsize = SharedMemory::segmentSize(size, options);
+	if(segsize > SharedMemory::maxSize()) throw IPCException("Cannot allocate more memory than allowed by system");
+
+	IPC_STATS_COUNT(IPC_STATS_SHM_ATTACHES);
+	IPC_STATS_START(start);
 
+	// Reuse the mapping if this process has already attached the segment
 	int shmid;
+	this->mem = registry_acquire_key(shm_key, segsize, &shmid);
+	if(this->mem != NULL) {
+		IPC_STATS_COUNT(IPC_STATS_SHM_ATTACH_CACHED);
+		this->shmid = shmid;
+		this->_created = false;
+		this->_attrs = attr;
+		this->_size = size;
+		this->applyOptionsOrRelease(options);
+		IPC_STATS_RECORD(IPC_STATS_SHM_ATTACH, start);
+		return this->get();
+	}
+
+	const int flags = SharedMemory::segmentFlags(attr, options);
 	if(shm_key == 0)
-		shmid = ::shmget(shm_key, size, attr | IPC_CREAT);
+		shmid = ::shmget(shm_key, segsize, flags | IPC_CREAT);
 	else
-		shmid = ::shmget(shm_key, size, attr | IPC_CREAT | IPC_EXCL);
+		shmid = ::shmget(shm_key, segsize, flags | IPC_CREAT | IPC_EXCL);
 	if(shmid < 0) {
 		// Try just to get shared memory
 		if(errno == EEXIST) {
-			shmid = ::shmget(shm_key, size, attr);
+			IPC_STATS_COUNT(IPC_STATS_SHM_ATTACH_EEXIST);
+			shmid = ::shmget(shm_key, segsize, attr);
 			if(shmid < 0)
 				throw IPCException("Error creating SharedMemory");
 			this->_created = false;
@@ -212,15 +1099,17 @@ void *SharedMemory::attach(const size_t size, int attr) {
 	} else
 		this->_created = true;
 
-	this->shmid = shmid;
 	// Attach shared memory
-	this->mem = shmat(this->shmid, NULL, 0);
+	this->mem = registry_acquire_id(shmid, shm_key, segsize);
 	if(!this->isAttached())
 		throw IPCException("Attaching shared memory failed");
+	this->shmid = shmid;
 
 	this->_attrs = attr;
 	this->_size = size;
-	return this->mem;
+	this->applyOptionsOrRelease(options);
+	IPC_STATS_RECORD(IPC_STATS_SHM_ATTACH, start);
+	return this->get();
 }
 
 SharedMemory SharedMemory::attach(const int id, const size_t size) {
@@ -232,8 +1121,8 @@ SharedMemory SharedMemory::attach(const int id, const size_t size) {
 	shm._deleteOnDestruction = false;
 	shm._detachOnDestruction = true;
 	shm.shm_key = 0;
-	shm.shmid = id;
-	shm.mem = shmat(id, NULL, 0);
+	shm.mem = registry_acquire_id(id, IPC_PRIVATE, size + IPC_SHM_HEADER_SIZE);
+	shm.shmid = (shm.mem == NULL) ? -1 : id;
 
 	return shm;
 }
@@ -247,8 +1136,8 @@ SharedMemory *SharedMemory::attachNew(const int id, const size_t size) {
 	shm->_deleteOnDestruction = false;
 	shm->_detachOnDestruction = true;
 	shm->shm_key = 0;
-	shm->shmid = id;
-	shm->mem = shmat(id, NULL, 0);
+	shm->mem = registry_acquire_id(id, IPC_PRIVATE, size + IPC_SHM_HEADER_SIZE);
+	shm->shmid = (shm->mem == NULL) ? -1 : id;
 
 	return shm;
 }
@@ -256,9 +1145,9 @@ SharedMemory *SharedMemory::attachNew(const int id, const size_t size) {
 void SharedMemory::detach(void) {
 	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
 
-	int ret = ::shmdt(this->mem);
-	if(ret < 0) throw IPCException("Detaching shared memory failed");
+	void *mem = this->mem;
 	this->mem = NULL;
+	if(!registry_release(this->shmid, mem)) throw IPCException("Detaching shared memory failed");
 }
 
 bool SharedMemory::destroy(const int key, const size_t size, int attr) {
@@ -268,19 +1157,22 @@ bool SharedMemory::destroy(const int key, const size_t size, int attr) {
 	if(shmid < 0)
 		throw IPCException("Error getting SharedMemory");
 
+	registry_forget(shmid);
 	int ret = shmctl(shmid, IPC_RMID, NULL);
 	return ret == 0;
 }
 
 void SharedMemory::destroy(void) {
 	const int shmid = this->shmid;
-	if(shmid <= 0) throw IPCException("Not attached to shared memory segment");
+	if(shmid < 0) throw IPCException("Not attached to shared memory segment");
+	registry_forget(shmid);
 	if(this->isAttached()) {
-		if(::shmdt(this->mem) < 0)
+		void *mem = this->mem;
+		this->mem = NULL;
+		if(!registry_release(shmid, mem))
 			throw IPCException("Error detaching shared memory");
 	}
-	this->mem = NULL;
-	this->shmid = 0;
+	this->shmid = -1;
 	if (::shmctl(shmid, IPC_RMID, NULL) < 0)
 		throw IPCException("Destroying Shared memory failed");
 }
@@ -291,21 +1183,37 @@ void *SharedMemory::operator*(void) const {
 
 
 void SharedMemory::stats(struct shmid_ds *buf) const {
-	if (!this->shm_ctl(IPC_STAT, buf))
+	if(this->shmid < 0) throw IPCException("Shared-memory ID not defined");
+	if (!registry_stat(this->shmid, buf, false))
 		throw IPCException("Access to shared memory failed");
 }
 
-struct ::shmid_ds SharedMemory::stats(void) const {
+void SharedMemory::refresh(void) {
+	if(this->shmid < 0) throw IPCException("Shared-memory ID not defined");
 	struct ::shmid_ds buf;
-	this->stats(&buf);
-	return buf;
+	if (!registry_stat(this->shmid, &buf, true))
+		throw IPCException("Access to shared memory failed");
 }
 
-
-int SharedMemory::nAttached(void) const {
+void SharedMemory::waitReady(const std::atomic<uint32_t> &ready, uint32_t magic) const {
+	if(ready.load(std::memory_order_acquire) == magic) return;
 	struct ::shmid_ds buf;
 	this->stats(&buf);
-	return buf.shm_nattch;
+	if(!ready_wait(ready, magic, buf.shm_cpid))
+		throw IPCException("Creator of the shared memory segment exited before initializing it");
+}
+
+struct ::shmid_ds SharedMemory::stats(void) const {
+	struct ::shmid_ds buf;
+	this->stats(&buf);
+	return buf;
+}
+
+
+int SharedMemory::nAttached(void) const {
+	struct ::shmid_ds buf;
+	this->stats(&buf);
+	return buf.shm_nattch;
 }
 
 ipc_perm SharedMemory::permissions(void) const {
@@ -317,19 +1225,40 @@ ipc_perm SharedMemory::permissions(void) const {
 size_t SharedMemory::size(void) const {
 	struct ::shmid_ds buf;
 	this->stats(&buf);
-	return buf.shm_segsz;
+	if(buf.shm_segsz < IPC_SHM_HEADER_SIZE) return 0;
+	return buf.shm_segsz - IPC_SHM_HEADER_SIZE;
+}
+
+int SharedMemory::lock(void) {
+	return this->header()->mutex.lock();
+}
+
+bool SharedMemory::try_lock(void) {
+	return this->header()->mutex.try_lock();
+}
+
+bool SharedMemory::try_lock_for(long timeout_us) {
+	return this->header()->mutex.try_lock_for(timeout_us);
+}
+
+void SharedMemory::unlock(void) {
+	this->header()->mutex.unlock();
+}
+
+Doorbell &SharedMemory::doorbell(void) const {
+	return this->header()->doorbell;
 }
 
 
 bool SharedMemory::shm_ctl(int cmd) const {
-	if(this->shmid <= 0) throw IPCException("Shared-memory ID not defined");
+	if(this->shmid < 0) throw IPCException("Shared-memory ID not defined");
 
 	int ret = shmctl(this->shmid, cmd, NULL);
 	return ret == 0;
 }
 
 bool SharedMemory::shm_ctl(int cmd, struct ::shmid_ds *buf) const {
-	if(this->shmid <= 0) throw IPCException("Shared-memory ID not defined");
+	if(this->shmid < 0) throw IPCException("Shared-memory ID not defined");
 
 	int ret = shmctl(this->shmid, cmd, buf);
 	return ret == 0;
@@ -347,7 +1276,8 @@ bool SharedMemory::exists(const int shm_key, size_t size) {
 	}
 }
 
-size_t SharedMemory::maxSize(void) {
+/** Read /proc/sys/kernel/shmmax */
+static size_t read_shmmax(void) {
 	ifstream in("/proc/sys/kernel/shmmax");
 	if(!in.is_open()) return -1;
 	size_t ret;
@@ -356,8 +1286,740 @@ size_t SharedMemory::maxSize(void) {
 	return ret;
 }
 
+size_t SharedMemory::maxSize(void) {
+	// Read only once per process, the limit practically never changes at runtime
+	static const size_t shmmax = read_shmmax();
+	return shmmax;
+}
+
+void SharedMemory::setNumaPolicy(ShmNumaPolicy policy, const vector<int> &nodes, bool move) {
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+
+	struct ::shmid_ds buf;
+	this->stats(&buf);
+	SharedMemory::setNumaPolicy(this->mem, buf.shm_segsz, policy, nodes, move);
+}
+
+void SharedMemory::setNumaPolicy(void *addr, size_t len, ShmNumaPolicy policy, const vector<int> &nodes, bool move) {
+	const size_t bits = 8 * sizeof(unsigned long);
+	int mode;
+	switch(policy) {
+		case SHM_NUMA_DEFAULT: mode = MPOL_DEFAULT; break;
+		case SHM_NUMA_BIND: mode = MPOL_BIND; break;
+		case SHM_NUMA_INTERLEAVE: mode = MPOL_INTERLEAVE; break;
+		case SHM_NUMA_LOCAL: mode = MPOL_LOCAL; break;
+		default: throw IPCException("Illegal NUMA policy");
+	}
+
+	vector<unsigned long> mask;
+	if(policy == SHM_NUMA_BIND || policy == SHM_NUMA_INTERLEAVE) {
+		if(nodes.empty()) throw IPCException("NUMA policy requires at least one node");
+		for(size_t i = 0; i < nodes.size(); i++) {
+			if(nodes[i] < 0) throw IPCException("Illegal NUMA node");
+			const size_t word = (size_t)nodes[i] / bits;
+			if(mask.size() <= word) mask.resize(word + 1, 0);
+			mask[word] |= 1UL << ((size_t)nodes[i] % bits);
+		}
+	}
+
+	// The kernel reads maxnode - 1 bits from the mask
+	const unsigned long maxnode = mask.empty() ? 0 : mask.size() * bits + 1;
+	const unsigned flags = move ? MPOL_MF_MOVE : 0;
+	if(::syscall(SYS_mbind, addr, len, mode, mask.empty() ? NULL : &mask[0], maxnode, flags) < 0)
+		throw IPCException("Setting NUMA policy failed");
+}
+
+vector<size_t> SharedMemory::numaNodes(void) const {
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+
+	struct ::shmid_ds buf;
+	this->stats(&buf);
+	const size_t pagesize = (size_t)::sysconf(_SC_PAGESIZE);
+	const size_t npages = (buf.shm_segsz + pagesize - 1) / pagesize;
+
+	vector<void*> pages(npages);
+	for(size_t i = 0; i < npages; i++)
+		pages[i] = (char*)this->mem + i * pagesize;
+	vector<int> status(npages, -1);
+	// move_pages without target nodes only reports the node of each page
+	if(npages > 0 && ::syscall(SYS_move_pages, 0, npages, &pages[0], NULL, &status[0], 0) < 0)
+		throw IPCException("Querying NUMA placement failed");
+
+	vector<size_t> ret(SharedMemory::numaNodeCount(), 0);
+	for(size_t i = 0; i < npages; i++) {
+		if(status[i] < 0) continue;		// Not resident
+		if((size_t)status[i] >= ret.size()) ret.resize(status[i] + 1, 0);
+		ret[status[i]]++;
+	}
+	return ret;
+}
+
+int SharedMemory::numaNodeCount(void) {
+	// Format is a list of ranges, e.g. "0-1,3"
+	ifstream in("/sys/devices/system/node/online");
+	if(!in.is_open()) return 1;
+	string line;
+	getline(in, line);
+	int highest = 0;
+	int current = 0;
+	bool digits = false;
+	for(size_t i = 0; i <= line.size(); i++) {
+		if(i < line.size() && line[i] >= '0' && line[i] <= '9') {
+			current = current * 10 + (line[i] - '0');
+			digits = true;
+		} else {
+			if(digits && current > highest) highest = current;
+			current = 0;
+			digits = false;
+		}
+	}
+	return highest + 1;
+}
+
+int SharedMemory::currentNumaNode(void) {
+	unsigned cpu, node;
+	if(::syscall(SYS_getcpu, &cpu, &node, NULL) < 0) return 0;
+	return (int)node;
+}
+
+/** Round the given size up to a multiple of the page size */
+static size_t page_align(size_t size) {
+	const size_t pagesize = (size_t)::sysconf(_SC_PAGESIZE);
+	return (size + pagesize - 1) & ~(pagesize - 1);
+}
+
+ShmNumaPartition::ShmNumaPartition(int key, size_t sliceSize, int attr) :
+		// One additional page, so that the slices can start page aligned after the control header
+		shm(key, (size_t)::sysconf(_SC_PAGESIZE) + SharedMemory::numaNodeCount() * page_align(sliceSize), attr) {
+	if(sliceSize == 0) throw IPCException("Slice size must be greater than zero");
+	this->_nodes = SharedMemory::numaNodeCount();
+	this->_sliceSize = page_align(sliceSize);
+	this->slices = (char*)page_align((size_t)this->shm.get());
+
+	if(this->shm.isCreated()) {
+		for(int node = 0; node < this->_nodes; node++)
+			SharedMemory::setNumaPolicy(this->slice(node), this->_sliceSize, SHM_NUMA_BIND, vector<int>(1, node));
+	}
+}
+
+ShmNumaPartition::~ShmNumaPartition() {
+
+}
+
+int ShmNumaPartition::nodes(void) const { return this->_nodes; }
+size_t ShmNumaPartition::sliceSize(void) const { return this->_sliceSize; }
+
+void *ShmNumaPartition::slice(int node) const {
+	if(node < 0 || node >= this->_nodes) throw IPCException("Illegal NUMA node");
+	return this->slices + (size_t)node * this->_sliceSize;
+}
+
+void *ShmNumaPartition::local(void) const {
+	int node = SharedMemory::currentNumaNode();
+	if(node >= this->_nodes) node = 0;
+	return this->slice(node);
+}
+
+SharedMemory &ShmNumaPartition::memory(void) { return this->shm; }
+
+/** Make a valid POSIX shared memory name */
+static string posix_shm_name(const string &name) {
+	if(name.empty()) throw IPCException("Illegal shared memory name");
+	if(name[0] == '/') return name;
+	return "/" + name;
+}
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT 26
+#endif
+
+#define SHM_PERSIST_MAGIC 0x50455253
+
+/** Time an attacher waits for the creator of a named POSIX segment to size it, in microseconds */
+#define SHM_POSIX_SIZE_TIMEOUT_US 1000000L
+
+PosixSharedMemory::PosixSharedMemory() {
+	this->fd = -1;
+	this->mem = NULL;
+	this->mapped = 0;
+	this->filePid = 0;
+	this->_deleteOnDestruction = false;
+	this->_created = false;
+}
+
+PosixSharedMemory::PosixSharedMemory(const string &name, size_t size, int attr, const ShmOptions &options) {
+	this->fd = -1;
+	this->mem = NULL;
+	this->mapped = 0;
+	this->filePid = 0;
+	this->_created = false;
+	this->attach(name, size, attr, options);
+	this->_deleteOnDestruction = this->_created;
+}
+
+PosixSharedMemory::PosixSharedMemory(PosixSharedMemory &&ref) {
+	this->_name = ref._name;
+	this->_path = ref._path;
+	this->fd = ref.fd;
+	this->mem = ref.mem;
+	this->mapped = ref.mapped;
+	this->filePid = ref.filePid;
+	this->_deleteOnDestruction = ref._deleteOnDestruction;
+	this->_created = ref._created;
+	ref.forget();
+}
+
+PosixSharedMemory &PosixSharedMemory::operator=(PosixSharedMemory &&ref) {
+	if(this == &ref) return *this;
+	this->release();
+	this->_name = ref._name;
+	this->_path = ref._path;
+	this->fd = ref.fd;
+	this->mem = ref.mem;
+	this->mapped = ref.mapped;
+	this->filePid = ref.filePid;
+	this->_deleteOnDestruction = ref._deleteOnDestruction;
+	this->_created = ref._created;
+	ref.forget();
+	return *this;
+}
+
+void PosixSharedMemory::forget(void) {
+	this->_name.clear();
+	this->_path.clear();
+	this->fd = -1;
+	this->mem = NULL;
+	this->mapped = 0;
+	this->filePid = 0;
+	this->_deleteOnDestruction = false;
+	this->_created = false;
+}
+
+PosixSharedMemory::~PosixSharedMemory() {
+	this->release();
+}
+
+void PosixSharedMemory::release(void) {
+	const string name = this->_name;
+	const string path = this->_path;
+	try {
+		if(this->isAttached())
+			this->detach();
+	} catch (...) {
+		// Swallow exception in destructor
+	}
+	if(this->_deleteOnDestruction && !name.empty())
+		::shm_unlink(name.c_str());
+	if(this->_deleteOnDestruction && !path.empty())
+		::unlink(path.c_str());
+	this->forget();
+}
+
+string PosixSharedMemory::name(void) const { return this->_name; }
+int PosixSharedMemory::fileDescriptor(void) const { return this->fd; }
+
+void PosixSharedMemory::setDeleteOnDispose(bool enabled) {
+	this->_deleteOnDestruction = enabled;
+}
+
+bool PosixSharedMemory::isCreated(void) const {
+	return this->_created;
+}
+
+void PosixSharedMemory::map(size_t length, const ShmOptions &options) {
+	int flags = MAP_SHARED;
+	if(options.prefault) flags |= MAP_POPULATE;
+	void *mem = ::mmap(NULL, length, PROT_READ | PROT_WRITE, flags, this->fd, 0);
+	if(mem == MAP_FAILED)
+		throw IPCException("Mapping shared memory failed");
+	if(options.lock && ::mlock(mem, length) < 0) {
+		::munmap(mem, length);
+		throw IPCException("Locking shared memory pages failed");
+	}
+	this->mem = mem;
+	this->mapped = length;
+}
+
+void *PosixSharedMemory::attach(const string &name, size_t size, int attr, const ShmOptions &options) {
+	if(this->isAttached()) throw IPCException("Cannot attach shared memory while already one is attached to this class object");
+	if(options.hugePageSize > 0) throw IPCException("Huge pages are only supported for anonymous POSIX shared memory");
+	const string shm_name = posix_shm_name(name);
+	const size_t length = size + IPC_SHM_HEADER_SIZE;
+
+	int fd = ::shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, attr);
+	bool created = true;
+	if(fd < 0) {
+		if(errno != EEXIST) throw IPCException("Error creating shared memory");
+		fd = ::shm_open(shm_name.c_str(), O_RDWR, attr);
+		if(fd < 0) throw IPCException("Error opening shared memory");
+		created = false;
+	}
+
+	if(created) {
+		if(::ftruncate(fd, length) < 0) {
+			::close(fd);
+			::shm_unlink(shm_name.c_str());
+			throw IPCException("Error sizing shared memory");
+		}
+	} else {
+		// Wait for the creator to size the segment. It may have died between shm_open() and ftruncate()
+		const struct timespec deadline = deadline_after(SHM_POSIX_SIZE_TIMEOUT_US);
+		struct timespec remaining;
+		struct stat st;
+		for(;;) {
+			if(::fstat(fd, &st) < 0) {
+				::close(fd);
+				throw IPCException("Error querying shared memory");
+			}
+			if(st.st_size > 0) break;
+			if(!time_remaining(deadline, &remaining)) {
+				::close(fd);
+				throw IPCException("Shared memory segment was not sized by its creator");
+			}
+			sched_yield();
+		}
+		if((size_t)st.st_size < length) {
+			::close(fd);
+			throw IPCException("Existing shared memory segment is smaller than requested");
+		}
+	}
+
+	this->fd = fd;
+	this->_name = shm_name;
+	this->_path.clear();
+	this->_created = created;
+	try {
+		this->map(length, options);
+	} catch (...) {
+		::close(this->fd);
+		this->fd = -1;
+		if(created) ::shm_unlink(shm_name.c_str());
+		this->_name.clear();
+		this->_created = false;
+		throw;
+	}
+	return this->get();
+}
+
+void *PosixSharedMemory::createAnonymous(size_t size, const ShmOptions &options) {
+	if(this->isAttached()) throw IPCException("Cannot create shared memory while already one is attached to this class object");
+
+	size_t length = size + IPC_SHM_HEADER_SIZE;
+	unsigned int flags = MFD_CLOEXEC;
+	if(options.hugePageSize > 0) {
+		if((options.hugePageSize & (options.hugePageSize - 1)) != 0)
+			throw IPCException("Huge page size must be a power of two");
+		unsigned int log2 = 0;
+		while(((size_t)1 << log2) < options.hugePageSize) log2++;
+		flags |= MFD_HUGETLB | (log2 << MFD_HUGE_SHIFT);
+		length = (length + options.hugePageSize - 1) & ~(options.hugePageSize - 1);
+	}
+
+	const int fd = (int)::syscall(SYS_memfd_create, "ipc-shm", flags);
+	if(fd < 0) throw IPCException("Error creating anonymous shared memory");
+	if(::ftruncate(fd, length) < 0) {
+		::close(fd);
+		throw IPCException("Error sizing shared memory");
+	}
+
+	this->fd = fd;
+	this->_name.clear();
+	this->_path.clear();
+	this->_created = true;
+	try {
+		this->map(length, options);
+	} catch (...) {
+		::close(this->fd);
+		this->fd = -1;
+		throw;
+	}
+	return this->get();
+}
+
+void *PosixSharedMemory::attachFd(int fd, const ShmOptions &options) {
+	if(this->isAttached()) throw IPCException("Cannot attach shared memory while already one is attached to this class object");
+	if(fd < 0) throw IPCException("Illegal file descriptor");
+
+	struct stat st;
+	if(::fstat(fd, &st) < 0) {
+		::close(fd);
+		throw IPCException("Error querying shared memory");
+	}
+	if((size_t)st.st_size < IPC_SHM_HEADER_SIZE) {
+		::close(fd);
+		throw IPCException("File descriptor is not a shared memory segment");
+	}
+
+	this->fd = fd;
+	this->_name.clear();
+	this->_path.clear();
+	this->_created = false;
+	try {
+		this->map((size_t)st.st_size, options);
+	} catch (...) {
+		::close(this->fd);
+		this->fd = -1;
+		throw;
+	}
+	return this->get();
+}
+
+/** Checksum of persistent segment data. Four independent lanes of 64-bit words */
+static uint64_t persist_checksum(const void *data, size_t len) {
+	const uint64_t k1 = 0x9e3779b185ebca87ULL, k2 = 0xc2b2ae3d27d4eb4fULL;
+	uint64_t lane[4] = {k1, k2, ~k1, ~k2};
+	const unsigned char *bytes = (const unsigned char*)data;
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32) {
+		for(int j = 0; j < 4; j++) {
+			uint64_t word;
+			::memcpy(&word, bytes + i + 8 * j, sizeof(word));
+			lane[j] += word * k2;
+			lane[j] = ((lane[j] << 31) | (lane[j] >> 33)) * k1;
+		}
+	}
+	uint64_t h = len;
+	for(int j = 0; j < 4; j++) h = ((h ^ lane[j]) * k1) ^ (h >> 29);
+	for(; i < len; i++) h = (h ^ bytes[i]) * k2;
+	h ^= h >> 32;
+	return h;
+}
+
+/**
+ * Lock the backing file of a persistent segment with an open file description lock, which
+ * is shared by all descriptors of one open() and released when the last of them is closed.
+ * Converting a held lock between F_WRLCK and F_RDLCK is atomic
+ * @returns false if the lock is held by someone else (without wait) or on an error
+ */
+static bool persist_lock(int fd, short type, bool wait) {
+	struct flock lock;
+	::memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 0;
+	for(;;) {
+		if(::fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) == 0) return true;
+		if(errno != EINTR) return false;
+	}
+}
+
+void *PosixSharedMemory::attachFile(const string &path, size_t size, uint32_t version, int attr, const ShmOptions &options) {
+	if(this->isAttached()) throw IPCException("Cannot attach shared memory while already one is attached to this class object");
+	if(options.hugePageSize > 0) throw IPCException("Huge pages are not supported for file-backed shared memory");
+	if(path.empty()) throw IPCException("Illegal shared memory file name");
+	const size_t length = size + IPC_SHM_HEADER_SIZE;
+
+	const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, attr);
+	if(fd < 0) throw IPCException("Error opening shared memory file");
+	// Every process mapping the file holds a read lock. Getting a write lock means that
+	// nobody else has the file mapped, so it is created or restored and has to be validated.
+	// Processes attaching meanwhile block on their read lock until this one is done
+	const bool exclusive = persist_lock(fd, F_WRLCK, false);
+	if(!exclusive && !persist_lock(fd, F_RDLCK, true)) {
+		::close(fd);
+		throw IPCException("Error locking shared memory file");
+	}
+
+	this->fd = fd;
+	this->_name.clear();
+	this->_path = path;
+	this->_created = false;
+	try {
+		struct stat st;
+		if(::fstat(fd, &st) < 0) throw IPCException("Error querying shared memory file");
+		if(exclusive && st.st_size == 0) {
+			if(::ftruncate(fd, length) < 0) throw IPCException("Error sizing shared memory file");
+			this->map(length, options);
+			this->_created = true;
+			Header *header = this->header();
+			header->magic = SHM_PERSIST_MAGIC;
+			header->version = version;
+			this->seal();
+		} else {
+			if((size_t)st.st_size < IPC_SHM_HEADER_SIZE) throw IPCException("File is not a persistent shared memory segment");
+			if((size_t)st.st_size < length) throw IPCException("Existing shared memory segment is smaller than requested");
+			this->map((size_t)st.st_size, options);
+			Header *header = this->header();
+			if(header->magic != SHM_PERSIST_MAGIC) throw IPCException("File is not a persistent shared memory segment");
+			if(header->version != version) throw IPCException("Persistent shared memory layout version mismatch");
+			if(exclusive) {
+				// Data of running processes is not covered by the checksum, only validate on a restart
+				if(header->dataSize != this->size() || header->checksum != persist_checksum(this->get(), this->size()))
+					throw IPCException("Persistent shared memory checksum mismatch");
+				// The lock and doorbell state belong to processes that are gone
+				::memset((void*)&header->mutex, 0, sizeof(ShmMutex));
+				::memset((void*)&header->doorbell, 0, sizeof(Doorbell));
+			}
+		}
+		// Atomic downgrade, so nobody can take the write lock in between
+		if(exclusive && !persist_lock(fd, F_RDLCK, false)) throw IPCException("Error locking shared memory file");
+	} catch (...) {
+		if(this->mem != NULL) ::munmap(this->mem, this->mapped);
+		::close(fd);
+		this->mem = NULL;
+		this->mapped = 0;
+		this->fd = -1;
+		this->_path.clear();
+		this->_created = false;
+		throw;
+	}
+	this->filePid = ::getpid();
+	return this->get();
+}
+
+void PosixSharedMemory::recoverFile(const string &path, uint32_t version) {
+	const int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+	if(fd < 0) throw IPCException("Error opening shared memory file");
+	if(!persist_lock(fd, F_WRLCK, false)) {
+		::close(fd);
+		throw IPCException("Shared memory file is in use");
+	}
+	PosixSharedMemory shm;
+	try {
+		shm.attachFd(fd);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	Header *header = shm.header();
+	if(header->magic != SHM_PERSIST_MAGIC) throw IPCException("File is not a persistent shared memory segment");
+	if(header->version != version) throw IPCException("Persistent shared memory layout version mismatch");
+	shm.sync();
+}
+
+void PosixSharedMemory::seal(void) {
+	Header *header = this->header();
+	header->magic = SHM_PERSIST_MAGIC;
+	header->dataSize = this->size();
+	header->checksum = persist_checksum(this->get(), this->size());
+}
+
+void PosixSharedMemory::sync(void) {
+	this->seal();
+	if(::msync(this->mem, this->mapped, MS_SYNC) < 0)
+		throw IPCException("Syncing shared memory failed");
+}
+
+void PosixSharedMemory::snapshot(const string &path, int attr) {
+	this->seal();
+	const string tmp = path + ".tmp";
+	const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, attr);
+	if(fd < 0) throw IPCException("Error creating snapshot file");
+	const char *data = (const char*)this->mem;
+	size_t written = 0;
+	while(written < this->mapped) {
+		const ssize_t ret = ::write(fd, data + written, this->mapped - written);
+		if(ret < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		written += (size_t)ret;
+	}
+	if(written < this->mapped || ::fsync(fd) < 0) {
+		::close(fd);
+		::unlink(tmp.c_str());
+		throw IPCException("Error writing snapshot file");
+	}
+	::close(fd);
+	if(::rename(tmp.c_str(), path.c_str()) < 0) {
+		::unlink(tmp.c_str());
+		throw IPCException("Error renaming snapshot file");
+	}
+}
+
+string PosixSharedMemory::path(void) const { return this->_path; }
+
+uint32_t PosixSharedMemory::layoutVersion(void) const {
+	return this->header()->version;
+}
+
+void *PosixSharedMemory::resize(size_t size) {
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+
+	const size_t length = size + IPC_SHM_HEADER_SIZE;
+	if(::ftruncate(this->fd, length) < 0)
+		throw IPCException("Error resizing shared memory");
+	void *mem = ::mremap(this->mem, this->mapped, length, MREMAP_MAYMOVE);
+	if(mem == MAP_FAILED)
+		throw IPCException("Remapping shared memory failed");
+	this->mem = mem;
+	this->mapped = length;
+	return this->get();
+}
+
+bool PosixSharedMemory::refresh(void) {
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+
+	struct stat st;
+	if(::fstat(this->fd, &st) < 0) throw IPCException("Error querying shared memory");
+	if((size_t)st.st_size == this->mapped) return false;
+	void *mem = ::mremap(this->mem, this->mapped, (size_t)st.st_size, MREMAP_MAYMOVE);
+	if(mem == MAP_FAILED)
+		throw IPCException("Remapping shared memory failed");
+	this->mem = mem;
+	this->mapped = (size_t)st.st_size;
+	return true;
+}
+
+bool PosixSharedMemory::isAttached(void) const {
+	return this->mem != NULL;
+}
+
+void PosixSharedMemory::detach(void) {
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+
+	// The last process detaching from a file-backed segment seals it, so that a clean shutdown
+	// passes the validation on the next start. Forked children share the parent's file lock
+	// and leave this to the parent
+	int ret = 0;
+	if(this->filePid == ::getpid() && persist_lock(this->fd, F_WRLCK, false)) {
+		this->seal();
+		ret = ::msync(this->mem, this->mapped, MS_SYNC);
+	}
+	this->filePid = 0;
+	if(::munmap(this->mem, this->mapped) < 0) ret = -1;
+	::close(this->fd);
+	this->mem = NULL;
+	this->mapped = 0;
+	this->fd = -1;
+	if(ret < 0) throw IPCException("Detaching shared memory failed");
+}
+
+void PosixSharedMemory::destroy(void) {
+	const string name = this->_name;
+	const string path = this->_path;
+	// No need to seal a file that is removed
+	this->filePid = 0;
+	if(this->isAttached()) this->detach();
+	this->_deleteOnDestruction = false;
+	if(!name.empty() && ::shm_unlink(name.c_str()) < 0)
+		throw IPCException("Destroying shared memory failed");
+	if(!path.empty() && ::unlink(path.c_str()) < 0)
+		throw IPCException("Destroying shared memory file failed");
+}
+
+void *PosixSharedMemory::get(void) const {
+	if(this->mem == NULL)
+		return NULL;
+	else
+		return (char*)this->mem + IPC_SHM_HEADER_SIZE;
+}
+
+void *PosixSharedMemory::operator*(void) const {
+	return this->get();
+}
+
+size_t PosixSharedMemory::size(void) const {
+	if(this->mapped < IPC_SHM_HEADER_SIZE) return 0;
+	return this->mapped - IPC_SHM_HEADER_SIZE;
+}
+
+PosixSharedMemory::Header *PosixSharedMemory::header(void) const {
+	static_assert(sizeof(Header) <= IPC_SHM_HEADER_SIZE, "Control header exceeds IPC_SHM_HEADER_SIZE");
+	if(!this->isAttached()) throw IPCException("Shared-memory not attached");
+	return (Header*)this->mem;
+}
+
+void PosixSharedMemory::sendFd(int socket) const {
+	if(this->fd < 0) throw IPCException("Shared-memory not attached");
+
+	char data = 'F';
+	struct iovec iov;
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	::memset(&control, 0, sizeof(control));
+
+	struct msghdr msg;
+	::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	::memcpy(CMSG_DATA(cmsg), &this->fd, sizeof(int));
+
+	if(::sendmsg(socket, &msg, 0) < 0)
+		throw IPCException("Sending shared memory file descriptor failed");
+}
+
+int PosixSharedMemory::receiveFd(int socket) {
+	char data;
+	struct iovec iov;
+	iov.iov_base = &data;
+	iov.iov_len = 1;
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	struct msghdr msg;
+	::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if(::recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) <= 0)
+		throw IPCException("Receiving shared memory file descriptor failed");
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		throw IPCException("No file descriptor received");
+	int fd;
+	::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+bool PosixSharedMemory::destroy(const string &name) {
+	return ::shm_unlink(posix_shm_name(name).c_str()) == 0;
+}
+
+bool PosixSharedMemory::exists(const string &name) {
+	const int fd = ::shm_open(posix_shm_name(name).c_str(), O_RDONLY, 0);
+	if(fd >= 0) {
+		::close(fd);
+		return true;
+	}
+	if(errno == ENOENT || errno == EACCES) return false;
+	throw IPCException("Unknown error querying shared memory");
+}
+
+int PosixSharedMemory::lock(void) {
+	return this->header()->mutex.lock();
+}
+
+bool PosixSharedMemory::try_lock(void) {
+	return this->header()->mutex.try_lock();
+}
+
+bool PosixSharedMemory::try_lock_for(long timeout_us) {
+	return this->header()->mutex.try_lock_for(timeout_us);
+}
+
+void PosixSharedMemory::unlock(void) {
+	this->header()->mutex.unlock();
+}
+
+Doorbell &PosixSharedMemory::doorbell(void) const {
+	return this->header()->doorbell;
+}
+
 Semaphore::Semaphore(int key, int attr) {
 	this->semkey = key;
+	this->_undo = SEMAPHORE_UNDO_NONE;
 	this->semid = ::semget(key, 1, IPC_CREAT | attr);
 	if (this->semid < 0)
 		throw IPCException("Error creating semaphore");
@@ -372,6 +2034,22 @@ Semaphore::~Semaphore() {
 int Semaphore::key(void) const { return this->semkey; }
 int Semaphore::id(void) const { return this->semid; }
 
+void Semaphore::setUndo(bool enabled) {
+	this->_undo = enabled ? SEMAPHORE_UNDO_PAIRED : SEMAPHORE_UNDO_NONE;
+}
+
+void Semaphore::setUndo(SemaphoreUndo mode) {
+	this->_undo = mode;
+}
+
+bool Semaphore::undo(void) const {
+	return this->_undo != SEMAPHORE_UNDO_NONE;
+}
+
+SemaphoreUndo Semaphore::undoMode(void) const {
+	return this->_undo;
+}
+
 bool Semaphore::destroy(const int key, const int attr) {
 	const int semid = ::semget(key, 1, attr);
 	if(semid <= 0) return false;
@@ -413,6 +2091,22 @@ int Semaphore::operator*(void) const {
 
 
 
+/**
+ * Convert a semaphore operation to the short taken by semop
+ * @throws IPCException if the value does not fit, instead of silently truncating it
+ */
+static inline short sem_op_value(int op) {
+	if(op > SHRT_MAX || op < -SHRT_MAX) throw IPCException("Semaphore counter exceeds the semop range");
+	return (short)op;
+}
+
+/** @returns SEM_UNDO if the given mode covers an operation adding op to the semaphore, otherwise 0 */
+static inline short sem_undo_flag(SemaphoreUndo mode, int op) {
+	if(op < 0) return (mode & SEMAPHORE_UNDO_DECREASE) ? SEM_UNDO : 0;
+	if(op > 0) return (mode & SEMAPHORE_UNDO_INCREASE) ? SEM_UNDO : 0;
+	return 0;
+}
+
 void Semaphore::increase(int count) const {
 	if(this->semid < 0) throw IPCException("Illegal semaphore id");
 
@@ -421,8 +2115,8 @@ void Semaphore::increase(int count) const {
 	struct sembuf sop;
 
 	sop.sem_num = 0;
-	sop.sem_op = count;
-	sop.sem_flg = 0;
+	sop.sem_op = sem_op_value(count);
+	sop.sem_flg = sem_undo_flag(this->_undo, count);
 	if (::semop(this->semid, &sop, 1) < 0)
 		throw IPCException("Error increasing semaphore");
 }
@@ -436,10 +2130,24 @@ void Semaphore::decrease(int count) const {
 	struct sembuf sop;
 
 	sop.sem_num = 0;
-	sop.sem_op = -count;
-	sop.sem_flg = 0;
+	sop.sem_op = sem_op_value(-count);
+#ifdef IPC_STATS
+	// Try without blocking first, to tell contended from uncontended acquires
+	sop.sem_flg = IPC_NOWAIT | sem_undo_flag(this->_undo, -count);
+	if (::semop(this->semid, &sop, 1) == 0) {
+		IPC_STATS_COUNT(IPC_STATS_SEM_ACQUIRES);
+		return;
+	}
+	if (errno != EAGAIN)
+		throw IPCException("Error decreasing semaphore");
+	IPC_STATS_COUNT(IPC_STATS_SEM_CONTENDED);
+	IPC_STATS_START(start);
+#endif
+	sop.sem_flg = sem_undo_flag(this->_undo, -count);
 	if (::semop(this->semid, &sop, 1) < 0)
-		throw IPCException("Error increasing semaphore");
+		throw IPCException("Error decreasing semaphore");
+	IPC_STATS_RECORD(IPC_STATS_SEM_WAIT, start);
+	IPC_STATS_COUNT(IPC_STATS_SEM_ACQUIRES);
 }
 
 
@@ -450,3 +2158,1450 @@ void Semaphore::aquire(int count) {
 void Semaphore::release(int count) {
 	this->increase(count);
 }
+
+/**
+ * Run semop, or semtimedop if a timeout is given. Retries on EINTR
+ * @param timeout_us Timeout in microseconds, negative for no timeout
+ * @returns true on success, false if the operation would block (IPC_NOWAIT) or timed out
+ */
+static bool sem_operate(int semid, struct sembuf *sops, size_t nsops, long timeout_us) {
+	struct timespec deadline;
+	if(timeout_us >= 0) deadline = deadline_after(timeout_us);
+	for(;;) {
+		int ret;
+		if(timeout_us < 0)
+			ret = ::semop(semid, sops, nsops);
+		else {
+			struct timespec remaining;
+			if(!time_remaining(deadline, &remaining)) return false;
+			ret = ::semtimedop(semid, sops, nsops, &remaining);
+		}
+		if(ret == 0) return true;
+		if(errno == EAGAIN) return false;
+		if(errno != EINTR) throw IPCException("Error operating on semaphore");
+	}
+}
+
+bool Semaphore::try_aquire(int count) {
+	if(this->semid < 0) throw IPCException("Illegal semaphore id");
+
+	if(count == 0) return true;
+	else if(count < 0) throw IPCException("Semaphore counter cannot be negative");
+	struct sembuf sop;
+
+	sop.sem_num = 0;
+	sop.sem_op = sem_op_value(-count);
+	sop.sem_flg = IPC_NOWAIT | sem_undo_flag(this->_undo, -count);
+	const bool ret = sem_operate(this->semid, &sop, 1, -1);
+	IPC_STATS_COUNT(ret ? IPC_STATS_SEM_ACQUIRES : IPC_STATS_SEM_CONTENDED);
+	return ret;
+}
+
+bool Semaphore::try_aquire_for(int count, long timeout_us) {
+	if(this->semid < 0) throw IPCException("Illegal semaphore id");
+
+	if(count == 0) return true;
+	else if(count < 0) throw IPCException("Semaphore counter cannot be negative");
+	struct sembuf sop;
+
+	sop.sem_num = 0;
+	sop.sem_op = sem_op_value(-count);
+#ifdef IPC_STATS
+	sop.sem_flg = IPC_NOWAIT | sem_undo_flag(this->_undo, -count);
+	if (sem_operate(this->semid, &sop, 1, -1)) {
+		IPC_STATS_COUNT(IPC_STATS_SEM_ACQUIRES);
+		return true;
+	}
+	IPC_STATS_COUNT(IPC_STATS_SEM_CONTENDED);
+	IPC_STATS_START(start);
+#endif
+	sop.sem_flg = sem_undo_flag(this->_undo, -count);
+	const bool ret = sem_operate(this->semid, &sop, 1, timeout_us < 0 ? 0 : timeout_us);
+	IPC_STATS_RECORD(IPC_STATS_SEM_WAIT, start);
+	if(ret) IPC_STATS_COUNT(IPC_STATS_SEM_ACQUIRES);
+	return ret;
+}
+
+/** Argument for semctl, needs to be defined by the caller */
+union semun {
+	int val;
+	struct semid_ds *buf;
+	unsigned short *array;
+};
+
+SemaphoreSet::SemaphoreSet(int key, int nsems, int attr) {
+	if(nsems <= 0) throw IPCException("Illegal number of semaphores");
+	this->semkey = key;
+	this->nsems = nsems;
+	this->_undo = SEMAPHORE_UNDO_NONE;
+	this->semid = ::semget(key, nsems, IPC_CREAT | attr);
+	if (this->semid < 0)
+		throw IPCException("Error creating semaphore set");
+}
+
+SemaphoreSet::~SemaphoreSet() {
+
+}
+
+int SemaphoreSet::key(void) const { return this->semkey; }
+int SemaphoreSet::id(void) const { return this->semid; }
+int SemaphoreSet::size(void) const { return this->nsems; }
+
+void SemaphoreSet::setUndo(bool enabled) {
+	this->_undo = enabled ? SEMAPHORE_UNDO_PAIRED : SEMAPHORE_UNDO_NONE;
+}
+
+void SemaphoreSet::setUndo(SemaphoreUndo mode) {
+	this->_undo = mode;
+}
+
+bool SemaphoreSet::undo(void) const {
+	return this->_undo != SEMAPHORE_UNDO_NONE;
+}
+
+SemaphoreUndo SemaphoreSet::undoMode(void) const {
+	return this->_undo;
+}
+
+void SemaphoreSet::setValue(int index, int value) const {
+	if(this->semid < 0) throw IPCException("Illegal semaphore id");
+	if(index < 0 || index >= this->nsems) throw IPCException("Semaphore index out of range");
+
+	if (::semctl(this->semid, index, SETVAL, value) < 0)
+		throw IPCException("Error setting value of semaphore");
+}
+
+int SemaphoreSet::getValue(int index) const {
+	if(this->semid < 0) throw IPCException("Illegal semaphore id");
+	if(index < 0 || index >= this->nsems) throw IPCException("Semaphore index out of range");
+
+	int semValue = ::semctl(this->semid, index, GETVAL);
+	if (semValue < 0)
+		throw IPCException("Error getting value of semaphore");
+	return semValue;
+}
+
+void SemaphoreSet::setAll(const vector<unsigned short> &values) const {
+	if(this->semid < 0) throw IPCException("Illegal semaphore id");
+	if(values.size() != (size_t)this->nsems) throw IPCException("Number of values does not match the semaphore set");
+
+	vector<unsigned short> buf(values);
+	union semun arg;
+	arg.array = &buf[0];
+	if (::semctl(this->semid, 0, SETALL, arg) < 0)
+		throw IPCException("Error setting values of semaphore set");
+}
+
+vector<unsigned short> SemaphoreSet::getAll(void) const {
+	if(this->semid < 0) throw IPCException("Illegal semaphore id");
+
+	vector<unsigned short> values(this->nsems);
+	union semun arg;
+	arg.array = &values[0];
+	if (::semctl(this->semid, 0, GETALL, arg) < 0)
+		throw IPCException("Error getting values of semaphore set");
+	return values;
+}
+
+bool SemaphoreSet::operate(const vector<SemaphoreOp> &ops, short flags, long timeout_us) const {
+	if(this->semid < 0) throw IPCException("Illegal semaphore id");
+	if(ops.empty()) return true;
+
+	vector<struct sembuf> sops(ops.size());
+	for(size_t i = 0; i < ops.size(); i++) {
+		if(ops[i].index < 0 || ops[i].index >= this->nsems) throw IPCException("Semaphore index out of range");
+		sops[i].sem_num = (unsigned short)ops[i].index;
+		sops[i].sem_op = sem_op_value(ops[i].count);
+		sops[i].sem_flg = flags | sem_undo_flag(this->_undo, ops[i].count);
+	}
+	return sem_operate(this->semid, &sops[0], sops.size(), timeout_us);
+}
+
+void SemaphoreSet::aquire(int index, int count) {
+	if(count < 0) throw IPCException("Semaphore counter cannot be negative");
+	this->apply(vector<SemaphoreOp>(1, SemaphoreOp(index, -count)));
+}
+
+void SemaphoreSet::release(int index, int count) {
+	if(count < 0) throw IPCException("Semaphore counter cannot be negative");
+	this->apply(vector<SemaphoreOp>(1, SemaphoreOp(index, count)));
+}
+
+bool SemaphoreSet::try_aquire(int index, int count) {
+	if(count < 0) throw IPCException("Semaphore counter cannot be negative");
+	return this->try_apply(vector<SemaphoreOp>(1, SemaphoreOp(index, -count)));
+}
+
+bool SemaphoreSet::try_aquire_for(int index, int count, long timeout_us) {
+	if(count < 0) throw IPCException("Semaphore counter cannot be negative");
+	return this->try_apply_for(vector<SemaphoreOp>(1, SemaphoreOp(index, -count)), timeout_us);
+}
+
+void SemaphoreSet::apply(const vector<SemaphoreOp> &ops) {
+	this->operate(ops, 0, -1);
+}
+
+bool SemaphoreSet::try_apply(const vector<SemaphoreOp> &ops) {
+	return this->operate(ops, IPC_NOWAIT, -1);
+}
+
+bool SemaphoreSet::try_apply_for(const vector<SemaphoreOp> &ops, long timeout_us) {
+	return this->operate(ops, 0, timeout_us < 0 ? 0 : timeout_us);
+}
+
+bool SemaphoreSet::destroy(const int key, const int attr) {
+	const int semid = ::semget(key, 0, attr);
+	if(semid < 0) return false;
+	if (::semctl(semid, 0, IPC_RMID) < 0)
+		return false;
+	else
+		return true;
+}
+
+void SemaphoreSet::destroy() {
+	if(this->semid < 0) throw IPCException("Illegal semaphore id");
+
+	if (::semctl(this->semid, 0, IPC_RMID) < 0)
+		throw IPCException("Error destroying semaphore set");
+
+	this->semid = -1;
+}
+
+
+FastSemaphore::FastSemaphore(int key, int attr) : shm(key, sizeof(State), attr) {
+	this->semkey = key;
+	this->state = (State*)this->shm.get();
+	if(this->state == NULL)
+		throw IPCException("Error creating semaphore");
+	// Like System V semaphores, the semaphore outlives this instance
+	this->shm.setDeleteOnDispose(false);
+}
+
+FastSemaphore::~FastSemaphore() {
+
+}
+
+FastSemaphore::State *FastSemaphore::get(void) const {
+	if(this->state == NULL) throw IPCException("Illegal semaphore");
+	return this->state;
+}
+
+int FastSemaphore::key(void) const { return this->semkey; }
+int FastSemaphore::id(void) const { return this->shm.id(); }
+
+bool FastSemaphore::destroy(const int key, const int attr) {
+	const int shmid = ::shmget(key, 0, attr);
+	if(shmid < 0) return false;
+	registry_forget(shmid);
+	if (::shmctl(shmid, IPC_RMID, NULL) < 0)
+		return false;
+	else
+		return true;
+}
+
+void FastSemaphore::destroy() {
+	this->get();
+	this->shm.destroy();
+	this->state = NULL;
+}
+
+void FastSemaphore::setValue(int value) const {
+	State *state = this->get();
+	if(value < 0) throw IPCException("Semaphore value cannot be negative");
+
+	state->value.store((uint32_t)value, std::memory_order_seq_cst);
+	if(state->waiters.load(std::memory_order_seq_cst) > 0)
+		futex_wake(&state->value, INT_MAX);
+}
+
+int FastSemaphore::getValue() const {
+	return (int)this->get()->value.load(std::memory_order_acquire);
+}
+
+int FastSemaphore::operator*(void) const {
+	return this->getValue();
+}
+
+void FastSemaphore::increase(int count) const {
+	State *state = this->get();
+
+	if(count == 0) return;
+	else if(count < 0) throw IPCException("Semaphore counter cannot be negative");
+
+	state->value.fetch_add((uint32_t)count, std::memory_order_seq_cst);
+	// Waiters may wait for different counts, so all of them need to re-check
+	if(state->waiters.load(std::memory_order_seq_cst) > 0)
+		futex_wake(&state->value, INT_MAX);
+}
+
+void FastSemaphore::decrease(int count) const {
+	State *state = this->get();
+
+	if(count == 0) return;
+	else if(count < 0) throw IPCException("Semaphore counter cannot be negative");
+	const uint32_t needed = (uint32_t)count;
+
+	uint32_t value = state->value.load(std::memory_order_relaxed);
+	for(;;) {
+		if(value >= needed) {
+			if(state->value.compare_exchange_weak(value, value - needed, std::memory_order_acquire, std::memory_order_relaxed))
+				return;
+			continue;
+		}
+
+		// Need to block. Register as waiter before the final check, so that increase() sees us
+		state->waiters.fetch_add(1, std::memory_order_seq_cst);
+		value = state->value.load(std::memory_order_seq_cst);
+		if(value < needed) {
+			if(futex_wait(&state->value, value) < 0 && errno != EAGAIN && errno != EINTR) {
+				state->waiters.fetch_sub(1, std::memory_order_relaxed);
+				throw IPCException("Error decreasing semaphore");
+			}
+		}
+		state->waiters.fetch_sub(1, std::memory_order_relaxed);
+		value = state->value.load(std::memory_order_relaxed);
+	}
+}
+
+void FastSemaphore::aquire(int count) {
+	this->decrease(count);
+}
+
+void FastSemaphore::release(int count) {
+	this->increase(count);
+}
+
+
+/** Magic value marking an initialized arena header */
+#define SHM_ARENA_MAGIC 0x41524e41
+
+/** Size of the block header preceding each allocation. Keeps 16 byte alignment */
+#define SHM_ARENA_BLOCK_HEADER 16
+
+/** Smallest size class in bytes (as power of two) */
+#define SHM_ARENA_MIN_SHIFT 4
+
+/** Header of each block in the arena */
+struct ShmArenaBlock {
+	/** Usable size of the block in bytes */
+	uint64_t size;
+	/** Offset of the next free block while the block is in a free list */
+	uint64_t next;
+};
+
+/** @returns size class for the given number of bytes, or -1 for large blocks */
+static int arena_size_class(size_t bytes) {
+	int cls = 0;
+	size_t size = (size_t)1 << SHM_ARENA_MIN_SHIFT;
+	while(size < bytes) {
+		size <<= 1;
+		cls++;
+	}
+	return (cls < ShmArena::SIZE_CLASSES) ? cls : -1;
+}
+
+static inline ShmArenaBlock *arena_block(ShmArena::Header *header, uint64_t offset) {
+	return (ShmArenaBlock*)((char*)header + offset);
+}
+
+/** @returns offset of the first block in the arena */
+static inline uint64_t arena_start(void) {
+	return (sizeof(ShmArena::Header) + 15) & ~(uint64_t)15;
+}
+
+/**
+ * Rebuild the bookkeeping after a process died while holding the arena lock.
+ * Free lists are truncated at the first link that does not point to a plausible free block,
+ * and the used byte count is recomputed from the remaining free blocks. Blocks cut off from a
+ * list stay allocated and are lost for reuse.
+ */
+static void arena_repair(ShmArena::Header *header) {
+	const uint64_t start = arena_start();
+	if(header->top < start || header->top > header->size || (header->top & 15) != 0)
+		header->top = start;
+	// Every block occupies at least 32 bytes, which bounds the walk even for cyclic lists
+	const uint64_t max_blocks = (header->top - start) / (SHM_ARENA_BLOCK_HEADER + 16);
+	uint64_t free_bytes = 0;
+
+	for(int cls = 0; cls <= ShmArena::SIZE_CLASSES; cls++) {
+		uint64_t *link = (cls < ShmArena::SIZE_CLASSES) ? &header->freeLists[cls] : &header->largeFree;
+		uint64_t steps = 0;
+		while(*link != 0) {
+			const uint64_t offset = *link;
+			ShmArenaBlock *block = arena_block(header, offset);
+			bool valid = steps++ < max_blocks && offset >= start && (offset & 15) == 0 && offset + SHM_ARENA_BLOCK_HEADER <= header->top;
+			if(valid) {
+				if(cls < ShmArena::SIZE_CLASSES)
+					valid = block->size == ((uint64_t)1 << (cls + SHM_ARENA_MIN_SHIFT));
+				else
+					valid = block->size >= 16 && (block->size & 15) == 0;
+				valid = valid && block->size <= header->top - offset - SHM_ARENA_BLOCK_HEADER;
+			}
+			if(!valid) {
+				*link = 0;
+				break;
+			}
+			free_bytes += SHM_ARENA_BLOCK_HEADER + block->size;
+			link = &block->next;
+		}
+	}
+	header->used = (free_bytes <= header->top - start) ? header->top - start - free_bytes : 0;
+}
+
+/** Lock the arena bookkeeping, repairing it if the previous owner died */
+static void arena_lock(ShmArena::Header *header) {
+	if(header->mutex.lock() == EOWNERDEAD) arena_repair(header);
+}
+
+void *ShmArena::allocate(Header *header, size_t bytes) {
+	if(bytes == 0) bytes = 1;
+	// Also keeps the rounding below from overflowing
+	if(bytes > header->size) throw std::bad_alloc();
+	const int cls = arena_size_class(bytes);
+	const uint64_t size = (cls >= 0) ? ((uint64_t)1 << (cls + SHM_ARENA_MIN_SHIFT)) : ((bytes + 15) & ~(uint64_t)15);
+
+	uint64_t offset = 0;
+	arena_lock(header);
+	if(cls >= 0 && header->freeLists[cls] != 0) {
+		// Reuse a free block of the same size class
+		offset = header->freeLists[cls];
+		header->freeLists[cls] = arena_block(header, offset)->next;
+	} else if(cls < 0) {
+		// First fit among the free large blocks
+		uint64_t *link = &header->largeFree;
+		while(*link != 0) {
+			ShmArenaBlock *block = arena_block(header, *link);
+			if(block->size >= size) {
+				offset = *link;
+				*link = block->next;
+				break;
+			}
+			link = &block->next;
+		}
+	}
+	if(offset == 0) {
+		// Carve a new block from the untouched part of the arena
+		if(header->top + SHM_ARENA_BLOCK_HEADER + size > header->size) {
+			header->mutex.unlock();
+			throw std::bad_alloc();
+		}
+		// Write the block size before publishing the block below top, so a repair after a
+		// crash never sees a carved block without its size
+		offset = header->top;
+		arena_block(header, offset)->size = size;
+		header->top += SHM_ARENA_BLOCK_HEADER + size;
+	}
+	ShmArenaBlock *block = arena_block(header, offset);
+	block->next = 0;
+	header->used += SHM_ARENA_BLOCK_HEADER + block->size;
+	header->mutex.unlock();
+	return (char*)block + SHM_ARENA_BLOCK_HEADER;
+}
+
+void ShmArena::deallocate(Header *header, void *ptr) {
+	if(ptr == NULL) return;
+	ShmArenaBlock *block = (ShmArenaBlock*)((char*)ptr - SHM_ARENA_BLOCK_HEADER);
+	const uint64_t offset = (char*)block - (char*)header;
+	if(offset < sizeof(Header) || offset >= header->size)
+		throw IPCException("Pointer does not belong to this arena");
+	const int cls = arena_size_class(block->size);
+
+	arena_lock(header);
+	if(cls >= 0 && ((uint64_t)1 << (cls + SHM_ARENA_MIN_SHIFT)) == block->size) {
+		block->next = header->freeLists[cls];
+		header->freeLists[cls] = offset;
+	} else {
+		block->next = header->largeFree;
+		header->largeFree = offset;
+	}
+	header->used -= SHM_ARENA_BLOCK_HEADER + block->size;
+	header->mutex.unlock();
+}
+
+ShmArena::ShmArena(int key, size_t size, int attr) : shm(key, size, attr) {
+	if(size < sizeof(Header) + 1024) throw IPCException("Arena size too small");
+	this->header = (Header*)this->shm.get();
+	if(this->header == NULL) throw IPCException("Attaching arena failed");
+
+	if(this->shm.isCreated()) {
+		this->header->size = size;
+		this->header->top = arena_start();
+		this->header->used = 0;
+		this->header->ready.store(SHM_ARENA_MAGIC, std::memory_order_release);
+	} else {
+		// Wait for the creator to initialize the header
+		this->shm.waitReady(this->header->ready, SHM_ARENA_MAGIC);
+	}
+}
+
+ShmArena::~ShmArena() {
+
+}
+
+void *ShmArena::allocate(size_t bytes) {
+	return ShmArena::allocate(this->header, bytes);
+}
+
+void ShmArena::deallocate(void *ptr) {
+	ShmArena::deallocate(this->header, ptr);
+}
+
+void ShmArena::setRoot(void *ptr) {
+	const uint64_t offset = (ptr == NULL) ? 0 : (uint64_t)((char*)ptr - (char*)this->header);
+	this->header->root.store(offset, std::memory_order_release);
+}
+
+void *ShmArena::root(void) const {
+	const uint64_t offset = this->header->root.load(std::memory_order_acquire);
+	if(offset == 0) return NULL;
+	return (char*)this->header + offset;
+}
+
+size_t ShmArena::capacity(void) const {
+	return (size_t)this->header->size;
+}
+
+size_t ShmArena::used(void) const {
+	arena_lock(this->header);
+	const size_t ret = (size_t)this->header->used;
+	this->header->mutex.unlock();
+	return ret;
+}
+
+SharedMemory &ShmArena::memory(void) { return this->shm; }
+
+
+
+/** Magic value marking an initialized broadcast channel header */
+#define SHM_BROADCAST_MAGIC 0x42434153
+
+/** Header of every record in the buffer: length and flags, 8 bytes */
+struct ShmBroadcastRecord {
+	uint32_t length;
+	uint32_t flags;
+};
+
+/** Record flag marking unused space up to the end of the buffer */
+#define SHM_BROADCAST_PADDING 1U
+
+/** @returns space occupied by a record of the given length, including its header */
+static inline uint64_t broadcast_record_size(uint64_t length) {
+	return (sizeof(ShmBroadcastRecord) + length + 7) & ~(uint64_t)7;
+}
+
+static size_t broadcast_capacity(size_t capacity) {
+	if(capacity < 64) capacity = 64;
+	size_t ret = 1;
+	while(ret < capacity) ret <<= 1;
+	return ret;
+}
+
+static size_t broadcast_segment_size(size_t capacity, int maxConsumers) {
+	if(maxConsumers <= 0) throw IPCException("Broadcast channel needs at least one consumer slot");
+	return IPC_CACHELINE_SIZE * (3 + (size_t)maxConsumers) + broadcast_capacity(capacity);
+}
+
+ShmBroadcast::ShmBroadcast(int key, size_t capacity, int maxConsumers, ShmBroadcastMode mode, int attr) :
+		shm(key, broadcast_segment_size(capacity, maxConsumers), attr) {
+	static_assert(sizeof(Header) == 3 * IPC_CACHELINE_SIZE, "Unexpected broadcast header layout");
+	static_assert(sizeof(Consumer) == IPC_CACHELINE_SIZE, "Unexpected broadcast consumer slot layout");
+	this->header = (Header*)this->shm.get();
+	if(this->header == NULL) throw IPCException("Attaching broadcast channel failed");
+	this->slots = (Consumer*)((char*)this->header + sizeof(Header));
+	this->buffer = (char*)(this->slots + maxConsumers);
+	this->_capacity = broadcast_capacity(capacity);
+	this->mask = this->_capacity - 1;
+	this->overwrite = (mode == SHM_BROADCAST_OVERWRITE);
+	this->pendingEnd = 0;
+
+	if(this->shm.isCreated()) {
+		this->header->capacity = this->_capacity;
+		this->header->maxConsumers = (uint32_t)maxConsumers;
+		this->header->mode = (uint32_t)mode;
+		this->header->ready.store(SHM_BROADCAST_MAGIC, std::memory_order_release);
+	} else {
+		// Wait for the creator to initialize the header
+		this->shm.waitReady(this->header->ready, SHM_BROADCAST_MAGIC);
+		if(this->header->capacity != this->_capacity || this->header->maxConsumers != (uint32_t)maxConsumers || this->header->mode != (uint32_t)mode)
+			throw IPCException("Broadcast channel layout mismatch");
+	}
+	this->cachedMin = this->minCursor(this->header->claimPos.load(std::memory_order_acquire));
+}
+
+ShmBroadcast::~ShmBroadcast() {
+
+}
+
+ShmBroadcast::Consumer &ShmBroadcast::consumer(int id) const {
+	if(id < 0 || (uint32_t)id >= this->header->maxConsumers) throw IPCException("Illegal consumer id");
+	return this->slots[id];
+}
+
+uint64_t ShmBroadcast::minCursor(uint64_t pos) const {
+	// Pairs with the fence in subscribe(): either we see the new slot, or the subscriber
+	// sees all records committed so far
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	uint64_t ret = pos;
+	for(uint32_t i = 0; i < this->header->maxConsumers; i++) {
+		const uint32_t state = this->slots[i].active.load(std::memory_order_acquire);
+		if(state == 0) continue;
+		// A subscriber is about to take its cursor from writePos. Until it is set, nothing
+		// bounds the cursor but the start of the stream, so the producer must not lap it
+		if(state == 2) return 0;
+		const uint64_t cursor = this->slots[i].cursor.load(std::memory_order_acquire);
+		if(cursor < ret) ret = cursor;
+	}
+	return ret;
+}
+
+bool ShmBroadcast::lapped(uint64_t pos) const {
+	return this->header->claimPos.load(std::memory_order_acquire) > pos + this->_capacity;
+}
+
+uint64_t ShmBroadcast::resync(Consumer &c) const {
+	const uint64_t pos = this->header->writePos.load(std::memory_order_acquire);
+	c.cursor.store(pos, std::memory_order_release);
+	c.overruns.fetch_add(1, std::memory_order_relaxed);
+	return pos;
+}
+
+void *ShmBroadcast::try_claim(size_t length) {
+	if(length > this->maxRecordSize()) throw IPCException("Record exceeds maximum record size");
+	if(this->pendingEnd != 0) throw IPCException("Claim already pending");
+
+	const uint64_t pos = this->header->claimPos.load(std::memory_order_relaxed);
+	const uint64_t total = broadcast_record_size(length);
+	const uint64_t contiguous = this->_capacity - (pos & this->mask);
+	const uint64_t padding = (total <= contiguous) ? 0 : contiguous;
+	const uint64_t end = pos + padding + total;
+
+	if(!this->overwrite && end - this->cachedMin > this->_capacity) {
+		this->cachedMin = this->minCursor(pos);
+		if(end - this->cachedMin > this->_capacity) return NULL;
+	}
+
+	// Announce the claim before touching the buffer, so that overrun consumers notice
+	this->header->claimPos.store(end, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	if(padding > 0) {
+		ShmBroadcastRecord *pad = (ShmBroadcastRecord*)(this->buffer + (pos & this->mask));
+		pad->length = (uint32_t)(padding - sizeof(ShmBroadcastRecord));
+		pad->flags = SHM_BROADCAST_PADDING;
+	}
+	ShmBroadcastRecord *rec = (ShmBroadcastRecord*)(this->buffer + ((pos + padding) & this->mask));
+	rec->length = (uint32_t)length;
+	rec->flags = 0;
+	this->pendingEnd = end;
+	return (char*)rec + sizeof(ShmBroadcastRecord);
+}
+
+void *ShmBroadcast::claim(size_t length) {
+	void *ret = this->try_claim(length);
+	while(ret == NULL) {
+		// Announce that we wait, then re-check before sleeping so that no release is missed
+		const uint32_t seen = this->header->spaceBell.sequence();
+		this->header->producerBlocked.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		ret = this->try_claim(length);
+		if(ret == NULL) this->header->spaceBell.wait(seen);
+	}
+	this->header->producerBlocked.store(0, std::memory_order_relaxed);
+	return ret;
+}
+
+void ShmBroadcast::commit(void) {
+	if(this->pendingEnd == 0) throw IPCException("No pending claim");
+	this->header->writePos.store(this->pendingEnd, std::memory_order_release);
+	this->pendingEnd = 0;
+	this->header->dataBell.ringAll();
+}
+
+bool ShmBroadcast::try_publish(const void *data, size_t length) {
+	void *dst = this->try_claim(length);
+	if(dst == NULL) return false;
+	::memcpy(dst, data, length);
+	this->commit();
+	return true;
+}
+
+void ShmBroadcast::publish(const void *data, size_t length) {
+	void *dst = this->claim(length);
+	::memcpy(dst, data, length);
+	this->commit();
+}
+
+int ShmBroadcast::subscribe(void) {
+	for(uint32_t i = 0; i < this->header->maxConsumers; i++) {
+		// Reserve the slot. While it is in state 2 the producer does not claim past the
+		// stream start plus the capacity, so the cursor taken below cannot be lapped
+		uint32_t expected = 0;
+		if(!this->slots[i].active.compare_exchange_strong(expected, 2, std::memory_order_seq_cst)) continue;
+		this->slots[i].overruns.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		this->slots[i].cursor.store(this->header->writePos.load(std::memory_order_acquire), std::memory_order_relaxed);
+		this->slots[i].active.store(1, std::memory_order_seq_cst);
+		// The producer may have blocked on the reserved slot
+		if(this->header->producerBlocked.load(std::memory_order_seq_cst) != 0)
+			this->header->spaceBell.ring();
+		return (int)i;
+	}
+	throw IPCException("No free consumer slot");
+}
+
+void ShmBroadcast::unsubscribe(int consumer) {
+	Consumer &c = this->consumer(consumer);
+	c.active.store(0, std::memory_order_seq_cst);
+	if(this->header->producerBlocked.load(std::memory_order_seq_cst) != 0)
+		this->header->spaceBell.ring();
+}
+
+const void *ShmBroadcast::peek(int consumer, size_t &length) {
+	Consumer &c = this->consumer(consumer);
+	uint64_t pos = c.cursor.load(std::memory_order_relaxed);
+	for(;;) {
+		if(pos >= this->header->writePos.load(std::memory_order_acquire)) return NULL;
+		if(this->overwrite && this->lapped(pos)) {
+			pos = this->resync(c);
+			continue;
+		}
+		const ShmBroadcastRecord *rec = (const ShmBroadcastRecord*)(this->buffer + (pos & this->mask));
+		const uint32_t len = rec->length;
+		const uint32_t flags = rec->flags;
+		if(this->overwrite) {
+			// The header may have been overwritten while we read it
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(this->lapped(pos)) {
+				pos = this->resync(c);
+				continue;
+			}
+		}
+		if(flags & SHM_BROADCAST_PADDING) {
+			pos += broadcast_record_size(len);
+			c.cursor.store(pos, std::memory_order_release);
+			continue;
+		}
+		length = len;
+		return (const char*)rec + sizeof(ShmBroadcastRecord);
+	}
+}
+
+bool ShmBroadcast::release(int consumer) {
+	Consumer &c = this->consumer(consumer);
+	const uint64_t pos = c.cursor.load(std::memory_order_relaxed);
+	if(pos >= this->header->writePos.load(std::memory_order_acquire)) return false;
+	const ShmBroadcastRecord *rec = (const ShmBroadcastRecord*)(this->buffer + (pos & this->mask));
+	const uint32_t len = rec->length;
+	if(this->overwrite) {
+		// Validate after the caller has read the record, like a seqlock reader
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(this->lapped(pos)) {
+			this->resync(c);
+			return false;
+		}
+		c.cursor.store(pos + broadcast_record_size(len), std::memory_order_release);
+		return true;
+	}
+	c.cursor.store(pos + broadcast_record_size(len), std::memory_order_relaxed);
+	// Pairs with the fence in claim(): either the producer sees the new cursor or we see it waiting
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(this->header->producerBlocked.load(std::memory_order_relaxed) != 0)
+		this->header->spaceBell.ring();
+	return true;
+}
+
+bool ShmBroadcast::wait(int consumer, long timeout_us) {
+	Consumer &c = this->consumer(consumer);
+	struct timespec deadline;
+	if(timeout_us >= 0) deadline = deadline_after(timeout_us);
+	for(;;) {
+		const uint32_t seen = this->header->dataBell.sequence();
+		if(c.cursor.load(std::memory_order_relaxed) < this->header->writePos.load(std::memory_order_acquire)) return true;
+		if(timeout_us < 0) {
+			this->header->dataBell.wait(seen);
+		} else {
+			struct timespec remaining;
+			if(!time_remaining(deadline, &remaining)) return false;
+			this->header->dataBell.wait_for(seen, remaining.tv_sec * 1000000L + remaining.tv_nsec / 1000L);
+		}
+	}
+}
+
+size_t ShmBroadcast::lag(int consumer) const {
+	const uint64_t cursor = this->consumer(consumer).cursor.load(std::memory_order_acquire);
+	const uint64_t pos = this->header->writePos.load(std::memory_order_acquire);
+	return (pos > cursor) ? (size_t)(pos - cursor) : 0;
+}
+
+uint64_t ShmBroadcast::overruns(int consumer) const {
+	return this->consumer(consumer).overruns.load(std::memory_order_relaxed);
+}
+
+size_t ShmBroadcast::capacity(void) const { return (size_t)this->_capacity; }
+
+size_t ShmBroadcast::maxRecordSize(void) const {
+	// Half the buffer, so that a record always fits after the padding at the end of the buffer
+	return (size_t)(this->_capacity / 2 - sizeof(ShmBroadcastRecord));
+}
+
+int ShmBroadcast::maxConsumers(void) const { return (int)this->header->maxConsumers; }
+
+SharedMemory &ShmBroadcast::memory(void) { return this->shm; }
+
+
+
+/** @returns segment size of a process pool */
+static size_t pool_segment_size(int processes, size_t header, size_t worker, size_t item) {
+	return header + (size_t)processes * (worker + ShmProcessPool::DEQUE_CAPACITY * item);
+}
+
+/** @returns the given number of processes, or the number of online CPUs if 0 */
+static int pool_processes(int processes) {
+	if(processes < 0) throw IPCException("Illegal number of processes");
+	if(processes > 0) return processes;
+	const long cpus = ::sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? (int)cpus : 1;
+}
+
+ShmProcessPool::ShmProcessPool(int processes) :
+		shm(IPC_PRIVATE, pool_segment_size(pool_processes(processes), sizeof(Header), sizeof(Worker), sizeof(Item))) {
+	this->_processes = pool_processes(processes);
+	this->header = (Header*)this->shm.get();
+	if(this->header == NULL) throw IPCException("Attaching process pool failed");
+	this->workers = (Worker*)((char*)this->header + sizeof(Header));
+	this->items = (Item*)(this->workers + this->_processes);
+	this->seed = 0x9e3779b97f4a7c15ULL;
+	this->broken = false;
+
+	// Don't let the workers flush buffered output of the caller a second time
+	::fflush(NULL);
+	for(int i = 1; i < this->_processes; i++) {
+		const pid_t pid = ::fork();
+		if(pid < 0) {
+			this->shutdown();
+			throw IPCException("Forking worker process failed");
+		} else if(pid == 0) {
+			this->seed ^= (uint64_t)i * 0xbf58476d1ce4e5b9ULL;
+			int status = EXIT_SUCCESS;
+			try {
+				this->work(i);
+			} catch (...) {
+				status = EXIT_FAILURE;
+			}
+			::_exit(status);
+		}
+		this->children.push_back(pid);
+	}
+}
+
+ShmProcessPool::~ShmProcessPool() {
+	try {
+		this->shutdown();
+	} catch (...) {
+		// Swallow exception in destructor
+	}
+}
+
+bool ShmProcessPool::push(int self, const Range &range) {
+	Worker &w = this->workers[self];
+	const int64_t b = w.bottom.load(std::memory_order_relaxed);
+	const int64_t t = w.top.load(std::memory_order_acquire);
+	if(b - t >= DEQUE_CAPACITY) return false;
+	Item &item = this->items[(size_t)self * DEQUE_CAPACITY + (size_t)(b % DEQUE_CAPACITY)];
+	item.begin.store(range.begin, std::memory_order_relaxed);
+	item.end.store(range.end, std::memory_order_relaxed);
+	item.epoch.store(range.epoch, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	w.bottom.store(b + 1, std::memory_order_relaxed);
+
+	// Wake up a sleeping process to steal it. Pairs with the sleepers increment in work()
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(this->header->sleepers.load(std::memory_order_relaxed) > 0)
+		this->header->bell.ring();
+	return true;
+}
+
+bool ShmProcessPool::pop(int self, Range &range) {
+	Worker &w = this->workers[self];
+	const int64_t b = w.bottom.load(std::memory_order_relaxed) - 1;
+	w.bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t t = w.top.load(std::memory_order_relaxed);
+	if(t > b) {
+		w.bottom.store(b + 1, std::memory_order_relaxed);
+		return false;
+	}
+	Item &item = this->items[(size_t)self * DEQUE_CAPACITY + (size_t)(b % DEQUE_CAPACITY)];
+	range.begin = item.begin.load(std::memory_order_relaxed);
+	range.end = item.end.load(std::memory_order_relaxed);
+	range.epoch = item.epoch.load(std::memory_order_relaxed);
+	if(t == b) {
+		// Last item, race against thieves
+		const bool won = w.top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		w.bottom.store(b + 1, std::memory_order_relaxed);
+		return won;
+	}
+	return true;
+}
+
+bool ShmProcessPool::steal(int victim, Range &range) {
+	Worker &w = this->workers[victim];
+	int64_t t = w.top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	const int64_t b = w.bottom.load(std::memory_order_acquire);
+	if(t >= b) return false;
+	Item &item = this->items[(size_t)victim * DEQUE_CAPACITY + (size_t)(t % DEQUE_CAPACITY)];
+	range.begin = item.begin.load(std::memory_order_relaxed);
+	range.end = item.end.load(std::memory_order_relaxed);
+	range.epoch = item.epoch.load(std::memory_order_relaxed);
+	return w.top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+bool ShmProcessPool::hasWork(void) const {
+	for(int i = 0; i < this->_processes; i++) {
+		if(this->workers[i].top.load(std::memory_order_acquire) < this->workers[i].bottom.load(std::memory_order_acquire))
+			return true;
+	}
+	return false;
+}
+
+void ShmProcessPool::execute(int self, Range range) {
+	const Job &job = this->header->job;
+	// Keep the lower half, offer the upper half to thieves
+	while(range.end - range.begin > job.grain) {
+		const uint64_t mid = range.begin + (range.end - range.begin) / 2;
+		Range upper = { mid, range.end, range.epoch };
+		if(!this->push(self, upper)) break;
+		range.end = mid;
+	}
+	try {
+		job.run(job, (size_t)range.begin, (size_t)range.end, this->workers[self].partial);
+	} catch (...) {
+		this->header->failed.store(1, std::memory_order_relaxed);
+	}
+	const uint64_t n = range.end - range.begin;
+	if(this->header->remaining.fetch_sub(n, std::memory_order_acq_rel) == n)
+		this->header->bell.ringAll();
+}
+
+void ShmProcessPool::work(int self) {
+	for(;;) {
+		Range range;
+		bool found = this->pop(self, range);
+		for(int i = 1; !found && i < this->_processes; i++) {
+			// Start at a random victim, so that thieves spread over the deques
+			this->seed ^= this->seed << 13;
+			this->seed ^= this->seed >> 7;
+			this->seed ^= this->seed << 17;
+			const int victim = (int)((self + 1 + this->seed % (uint64_t)(this->_processes - 1) + (uint64_t)i) % (uint64_t)this->_processes);
+			if(victim != self) found = this->steal(victim, range);
+		}
+		if(found) {
+			if(range.epoch == this->header->epoch.load(std::memory_order_acquire))
+				this->execute(self, range);
+			continue;
+		}
+
+		if(self == 0) {
+			if(this->header->remaining.load(std::memory_order_acquire) == 0) return;
+		} else if(this->header->shutdown.load(std::memory_order_acquire) != 0)
+			return;
+
+		const uint32_t seen = this->header->bell.sequence();
+		this->header->sleepers.fetch_add(1, std::memory_order_seq_cst);
+		const bool done = (self == 0) ? (this->header->remaining.load(std::memory_order_seq_cst) == 0) : (this->header->shutdown.load(std::memory_order_seq_cst) != 0);
+		if(!done && !this->hasWork()) {
+			// The caller wakes up regularly to notice dead workers
+			if(self == 0) this->header->bell.wait_for(seen, 10000);
+			else this->header->bell.wait(seen);
+		}
+		this->header->sleepers.fetch_sub(1, std::memory_order_relaxed);
+		if(self == 0) this->checkWorkers();
+	}
+}
+
+void ShmProcessPool::checkWorkers(void) {
+	for(size_t i = 0; i < this->children.size(); i++) {
+		int status;
+		if(::waitpid(this->children[i], &status, WNOHANG) == this->children[i]) {
+			this->children.erase(this->children.begin() + i);
+			this->broken = true;
+			throw IPCException("Worker process terminated");
+		}
+	}
+}
+
+void ShmProcessPool::run(size_t begin, size_t end, size_t grain) {
+	if(this->broken) throw IPCException("Process pool is broken");
+	if(end <= begin) return;
+	this->header->job.grain = (grain == 0) ? 1 : grain;
+	this->header->failed.store(0, std::memory_order_relaxed);
+	this->header->remaining.store(end - begin, std::memory_order_relaxed);
+	const uint64_t epoch = this->header->epoch.load(std::memory_order_relaxed) + 1;
+	this->header->epoch.store(epoch, std::memory_order_release);
+
+	// Seed our own deque with the whole range, the workers steal from there
+	Range range = { begin, end, epoch };
+	if(!this->push(0, range)) throw IPCException("Process pool deque overflow");
+	this->header->bell.ringAll();
+	this->work(0);
+	if(this->header->failed.load(std::memory_order_acquire) != 0)
+		throw IPCException("Exception in parallel loop body");
+}
+
+void ShmProcessPool::parallel_for(size_t begin, size_t end, size_t grain, ForFunction fn, void *arg) {
+	struct Trampoline {
+		static void run(const Job &job, size_t begin, size_t end, void *) {
+			((ForFunction)job.fn)(begin, end, job.arg);
+		}
+	};
+	this->header->job.run = &Trampoline::run;
+	this->header->job.fn = (void (*)(void))fn;
+	this->header->job.combine = NULL;
+	this->header->job.arg = arg;
+	this->run(begin, end, grain);
+}
+
+void ShmProcessPool::shutdown(void) {
+	if(this->children.empty()) return;
+	this->header->shutdown.store(1, std::memory_order_seq_cst);
+	this->header->bell.ringAll();
+	for(size_t i = 0; i < this->children.size(); i++) {
+		int status;
+		while(::waitpid(this->children[i], &status, 0) < 0 && errno == EINTR);
+	}
+	this->children.clear();
+}
+
+int ShmProcessPool::processes(void) const { return this->_processes; }
+
+
+
+/** Magic value marking an initialized barrier */
+#define SHM_BARRIER_MAGIC 0x42415252
+
+/** Number of spins on the sense before a waiter sleeps */
+#define SHM_BARRIER_SPIN 4000
+
+/** @returns number of tree nodes for the given number of participants */
+static size_t barrier_nodes(int participants) {
+	if(participants <= 0) throw IPCException("Barrier needs at least one participant");
+	size_t ret = 0;
+	size_t level = (size_t)participants;
+	do {
+		level = (level + ShmBarrier::FANIN - 1) / ShmBarrier::FANIN;
+		ret += level;
+	} while(level > 1);
+	return ret;
+}
+
+ShmBarrier::ShmBarrier(int key, int participants, int id, int attr) :
+		shm(key, IPC_CACHELINE_SIZE * (2 + barrier_nodes(participants)), attr) {
+	static_assert(sizeof(Header) == 2 * IPC_CACHELINE_SIZE, "Unexpected barrier header layout");
+	static_assert(sizeof(Node) == IPC_CACHELINE_SIZE, "Unexpected barrier node layout");
+	if(id >= participants) throw IPCException("Illegal barrier participant id");
+	this->header = (Header*)this->shm.get();
+	if(this->header == NULL) throw IPCException("Attaching barrier failed");
+	this->nodes = (Node*)((char*)this->header + sizeof(Header));
+
+	if(this->shm.isCreated()) {
+		// Build the tree level by level. Participants and nodes of a level map to node i / FANIN of the next
+		const size_t count = barrier_nodes(participants);
+		size_t children = (size_t)participants;
+		size_t first = 0;
+		while(first < count) {
+			const size_t level = (children + FANIN - 1) / FANIN;
+			for(size_t i = 0; i < level; i++) {
+				Node &node = this->nodes[first + i];
+				node.expected = (uint32_t)((i + 1 < level) ? FANIN : children - i * FANIN);
+				node.parent = (level == 1) ? -1 : (int32_t)(first + level + i / FANIN);
+			}
+			first += level;
+			children = level;
+		}
+		this->header->participants = (uint32_t)participants;
+		this->header->nodes = (uint32_t)count;
+		this->header->ready.store(SHM_BARRIER_MAGIC, std::memory_order_release);
+	} else {
+		// Wait for the creator to initialize the tree
+		this->shm.waitReady(this->header->ready, SHM_BARRIER_MAGIC);
+		if(this->header->participants != (uint32_t)participants)
+			throw IPCException("Barrier layout mismatch");
+	}
+	if(id < 0) id = (int)(this->header->joined.fetch_add(1, std::memory_order_relaxed) % (uint32_t)participants);
+	this->_id = id;
+	// Wait for the round after the current one
+	this->localSense = this->header->sense.load(std::memory_order_acquire) ^ 1;
+}
+
+ShmBarrier::~ShmBarrier() {
+
+}
+
+void ShmBarrier::wait(void) {
+	const uint32_t sense = this->localSense;
+	this->localSense ^= 1;
+
+	// Climb the tree as long as we are the last to arrive at a node
+	int32_t node = this->_id / FANIN;
+	while(node >= 0) {
+		Node &n = this->nodes[node];
+		if(n.count.fetch_add(1, std::memory_order_acq_rel) + 1 < n.expected) break;
+		// Reset for the next round before anyone can be released
+		n.count.store(0, std::memory_order_relaxed);
+		node = n.parent;
+	}
+	if(node < 0) {
+		// Last arrival at the root, release everybody
+		this->header->sense.store(sense, std::memory_order_seq_cst);
+		if(this->header->waiters.load(std::memory_order_seq_cst) > 0)
+			futex_wake(&this->header->sense, INT_MAX);
+		return;
+	}
+
+	for(int i = 0; i < SHM_BARRIER_SPIN; i++) {
+		if(this->header->sense.load(std::memory_order_acquire) == sense) return;
+		ipc_cpu_relax();
+	}
+	while(this->header->sense.load(std::memory_order_acquire) != sense) {
+		// Register as waiter before the final check, so that the releasing process sees us
+		this->header->waiters.fetch_add(1, std::memory_order_seq_cst);
+		if(this->header->sense.load(std::memory_order_seq_cst) != sense)
+			futex_wait(&this->header->sense, sense ^ 1);
+		this->header->waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+int ShmBarrier::id(void) const { return this->_id; }
+
+int ShmBarrier::participants(void) const { return (int)this->header->participants; }
+
+SharedMemory &ShmBarrier::memory(void) { return this->shm; }
+
+
+
+/** Magic value marking an initialized reader-writer lock */
+#define SHM_RWLOCK_MAGIC 0x52574c4b
+
+/** Number of spins before a blocked reader or writer sleeps */
+#define SHM_RWLOCK_SPIN 1000
+
+/** Reader slot hint of the calling thread, -1 if not yet chosen */
+static thread_local int rwlock_slot_hint = -1;
+
+/** Forked children choose a new slot, so that they don't share the counter of their parent */
+static void rwlock_atfork_child(void) {
+	rwlock_slot_hint = -1;
+}
+
+static int rwlock_slots(int slots) {
+	if(slots < 0) throw IPCException("Illegal number of reader slots");
+	if(slots > 0) return slots;
+	const long cpus = ::sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? (int)cpus : 1;
+}
+
+ShmRWLock::ShmRWLock(int key, int slots, int attr) :
+		shm(key, IPC_CACHELINE_SIZE * (3 + (size_t)rwlock_slots(slots)), attr) {
+	static_assert(sizeof(Header) == 3 * IPC_CACHELINE_SIZE, "Unexpected reader-writer lock header layout");
+	static_assert(sizeof(Slot) == IPC_CACHELINE_SIZE, "Unexpected reader slot layout");
+	static const int registered = ::pthread_atfork(NULL, NULL, rwlock_atfork_child);
+	(void)registered;
+	slots = rwlock_slots(slots);
+	this->header = (Header*)this->shm.get();
+	if(this->header == NULL) throw IPCException("Attaching reader-writer lock failed");
+	this->slots = (Slot*)((char*)this->header + sizeof(Header));
+
+	if(this->shm.isCreated()) {
+		this->header->slots = (uint32_t)slots;
+		this->header->ready.store(SHM_RWLOCK_MAGIC, std::memory_order_release);
+	} else {
+		// Wait for the creator to initialize the header
+		this->shm.waitReady(this->header->ready, SHM_RWLOCK_MAGIC);
+		if(this->header->slots != (uint32_t)slots)
+			throw IPCException("Reader-writer lock layout mismatch");
+	}
+}
+
+ShmRWLock::~ShmRWLock() {
+
+}
+
+ShmRWLock::Slot &ShmRWLock::slot(void) const {
+	int hint = rwlock_slot_hint;
+	if(hint < 0) {
+		// Spread threads by the CPU they start on. The slot is kept, so unlock finds it again
+		hint = ::sched_getcpu();
+		if(hint < 0) hint = (int)(::getpid() & 0x7fff);
+		rwlock_slot_hint = hint;
+	}
+	return this->slots[(uint32_t)hint % this->header->slots];
+}
+
+void ShmRWLock::waitWriter(void) {
+	for(int i = 0; i < SHM_RWLOCK_SPIN; i++) {
+		if(this->header->writer.load(std::memory_order_acquire) == 0) return;
+		ipc_cpu_relax();
+	}
+	this->wait(false);
+}
+
+void ShmRWLock::wait(bool exclusive) {
+	const uint32_t self = owner_self();
+	std::atomic<uint32_t> &word = this->header->writer;
+	long check_ns = SHM_MUTEX_OWNER_CHECK_NS;
+	uint32_t c = word.load(std::memory_order_acquire);
+	for(;;) {
+		if(c == 0) {
+			if(!exclusive) return;
+			// Others may still sleep, so keep the waiters flag
+			if(word.compare_exchange_weak(c, self | SHM_MUTEX_WAITERS, std::memory_order_seq_cst, std::memory_order_acquire)) {
+				this->header->ownerStart.store(owner_start, std::memory_order_relaxed);
+				return;
+			}
+			continue;
+		}
+		// Mark that somebody sleeps, so that unlock() wakes us
+		if(!(c & SHM_MUTEX_WAITERS)) {
+			if(!word.compare_exchange_weak(c, c | SHM_MUTEX_WAITERS, std::memory_order_acquire, std::memory_order_acquire))
+				continue;
+			c |= SHM_MUTEX_WAITERS;
+		}
+
+		// Sleep in bounded intervals to notice a writer that died, backing off like ShmMutex
+		struct timespec timeout;
+		timeout.tv_sec = check_ns / 1000000000L;
+		timeout.tv_nsec = check_ns % 1000000000L;
+		if(futex_wait(&word, c, &timeout) < 0 && errno == ETIMEDOUT) {
+			if(owner_dead(word, this->header->ownerStart, c)) {
+				this->header->ownerStart.store(0, std::memory_order_relaxed);
+				if(word.compare_exchange_strong(c, self | SHM_MUTEX_WAITERS, std::memory_order_seq_cst, std::memory_order_acquire)) {
+					this->header->ownerStart.store(owner_start, std::memory_order_relaxed);
+					this->header->died.store(1, std::memory_order_relaxed);
+					// A reader cannot repair the data, it only frees the lock and leaves that to the next writer
+					if(!exclusive) this->release();
+					return;
+				}
+				continue;
+			}
+			if(check_ns < SHM_MUTEX_OWNER_CHECK_MAX_NS) check_ns *= 2;
+		}
+		const uint32_t prev = c;
+		c = word.load(std::memory_order_acquire);
+		// A new writer gets checked soon again
+		if((c & ~SHM_MUTEX_WAITERS) != (prev & ~SHM_MUTEX_WAITERS)) check_ns = SHM_MUTEX_OWNER_CHECK_NS;
+	}
+}
+
+void ShmRWLock::drain(void) {
+	for(uint32_t i = 0; i < this->header->slots; i++) {
+		Slot &s = this->slots[i];
+		while(s.readers.load(std::memory_order_seq_cst) != 0) {
+			const uint32_t seen = this->header->drained.sequence();
+			if(s.readers.load(std::memory_order_seq_cst) == 0) break;
+			this->header->drained.wait(seen);
+		}
+	}
+}
+
+int ShmRWLock::lock(void) {
+	const uint32_t self = owner_self();
+	uint32_t c = 0;
+	if(this->header->writer.compare_exchange_strong(c, self, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+		this->header->ownerStart.store(owner_start, std::memory_order_relaxed);
+	} else {
+		for(int i = 0; i < SHM_RWLOCK_SPIN; i++) {
+			c = 0;
+			if(this->header->writer.compare_exchange_weak(c, self, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+				this->header->ownerStart.store(owner_start, std::memory_order_relaxed);
+				break;
+			}
+			ipc_cpu_relax();
+		}
+		// Slow path: sleep until the writer word is free or its owner died
+		if(c != 0) this->wait(true);
+	}
+	// New readers back off now, wait for the current ones to leave
+	this->drain();
+	return this->ownerDied() ? EOWNERDEAD : 0;
+}
+
+bool ShmRWLock::try_lock(void) {
+	uint32_t c = 0;
+	if(!this->header->writer.compare_exchange_strong(c, owner_self(), std::memory_order_seq_cst, std::memory_order_relaxed))
+		return false;
+	this->header->ownerStart.store(owner_start, std::memory_order_relaxed);
+	for(uint32_t i = 0; i < this->header->slots; i++) {
+		if(this->slots[i].readers.load(std::memory_order_seq_cst) != 0) {
+			this->release();
+			return false;
+		}
+	}
+	return true;
+}
+
+void ShmRWLock::release(void) {
+	this->header->ownerStart.store(0, std::memory_order_relaxed);
+	// Wake everybody, blocked readers can all proceed at once
+	if(this->header->writer.exchange(0, std::memory_order_release) & SHM_MUTEX_WAITERS)
+		futex_wake(&this->header->writer, INT_MAX);
+}
+
+void ShmRWLock::unlock(void) {
+	this->header->died.store(0, std::memory_order_relaxed);
+	this->release();
+}
+
+bool ShmRWLock::ownerDied(void) const {
+	return this->header->died.load(std::memory_order_relaxed) != 0;
+}
+
+int ShmRWLock::lock_shared(void) {
+	Slot &s = this->slot();
+	for(;;) {
+		s.readers.fetch_add(1, std::memory_order_seq_cst);
+		if(this->header->writer.load(std::memory_order_seq_cst) == 0)
+			return this->ownerDied() ? EOWNERDEAD : 0;
+		// A writer holds or waits for the lock. Back off and let it drain
+		this->unlock_shared();
+		this->waitWriter();
+	}
+}
+
+bool ShmRWLock::try_lock_shared(void) {
+	Slot &s = this->slot();
+	s.readers.fetch_add(1, std::memory_order_seq_cst);
+	if(this->header->writer.load(std::memory_order_seq_cst) == 0) return true;
+	this->unlock_shared();
+	return false;
+}
+
+void ShmRWLock::unlock_shared(void) {
+	Slot &s = this->slot();
+	if(s.readers.fetch_sub(1, std::memory_order_seq_cst) == 1 && this->header->writer.load(std::memory_order_seq_cst) != 0)
+		this->header->drained.ringAll();
+}
+
+int ShmRWLock::slotCount(void) const { return (int)this->header->slots; }
+
+SharedMemory &ShmRWLock::memory(void) { return this->shm; }
+
+
+#define SHM_COUNTERS_MAGIC 0x434e5453
+
+/** @returns number of shards for the given parameter, 0 meaning one per online CPU */
+static int counter_shards(int shards) {
+	if(shards < 0) throw IPCException("Illegal number of counter shards");
+	if(shards == 0) {
+		const long cpus = ::sysconf(_SC_NPROCESSORS_CONF);
+		shards = (cpus > 0) ? (int)cpus : 1;
+	}
+	return shards;
+}
+
+/** @returns number of values per shard, rounded up to whole cache lines */
+static size_t counter_stride(int counters, int gauges) {
+	if(counters < 0 || gauges < 0 || counters + gauges == 0) throw IPCException("Illegal number of counters");
+	const size_t perLine = IPC_CACHELINE_SIZE / sizeof(uint64_t);
+	return (((size_t)counters + (size_t)gauges + perLine - 1) / perLine) * perLine;
+}
+
+ShmCounterSet::ShmCounterSet(int key, int counters, int gauges, int shards, int attr) :
+		shm(key, IPC_CACHELINE_SIZE + (size_t)counter_shards(shards) * counter_stride(counters, gauges) * sizeof(uint64_t), attr) {
+	static_assert(sizeof(Header) <= IPC_CACHELINE_SIZE, "Counter set header exceeds a cache line");
+	static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "Counter values must be plain 64-bit integers");
+	shards = counter_shards(shards);
+	this->header = (Header*)this->shm.get();
+	if(this->header == NULL) throw IPCException("Attaching counter set failed");
+	this->values = (std::atomic<uint64_t>*)((char*)this->header + IPC_CACHELINE_SIZE);
+	this->stride = counter_stride(counters, gauges);
+	this->_counters = counters;
+	this->_gauges = gauges;
+	this->_shards = shards;
+
+	if(this->shm.isCreated()) {
+		this->header->counters = (uint32_t)counters;
+		this->header->gauges = (uint32_t)gauges;
+		this->header->shards = (uint32_t)shards;
+		this->header->ready.store(SHM_COUNTERS_MAGIC, std::memory_order_release);
+	} else {
+		// Wait for the creator to initialize the header
+		this->shm.waitReady(this->header->ready, SHM_COUNTERS_MAGIC);
+		if(this->header->counters != (uint32_t)counters || this->header->gauges != (uint32_t)gauges || this->header->shards != (uint32_t)shards)
+			throw IPCException("Counter set layout mismatch");
+	}
+}
+
+ShmCounterSet::~ShmCounterSet() {
+
+}
+
+std::atomic<uint64_t> *ShmCounterSet::shard(void) const {
+	const int cpu = ::sched_getcpu();
+	return this->values + (size_t)((cpu < 0 ? 0 : cpu) % this->_shards) * this->stride;
+}
+
+void ShmCounterSet::count(int counter, uint64_t n) {
+	if(counter < 0 || counter >= this->_counters) throw IPCException("Illegal counter");
+	this->shard()[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void ShmCounterSet::adjust(int gauge, int64_t delta) {
+	if(gauge < 0 || gauge >= this->_gauges) throw IPCException("Illegal gauge");
+	// Two's complement wrap-around makes the sum over all shards come out signed
+	this->shard()[this->_counters + gauge].fetch_add((uint64_t)delta, std::memory_order_relaxed);
+}
+
+uint64_t ShmCounterSet::counter(int counter) const {
+	if(counter < 0 || counter >= this->_counters) throw IPCException("Illegal counter");
+	uint64_t ret = 0;
+	for(int s = 0; s < this->_shards; s++)
+		ret += this->values[(size_t)s * this->stride + counter].load(std::memory_order_relaxed);
+	return ret;
+}
+
+int64_t ShmCounterSet::gauge(int gauge) const {
+	if(gauge < 0 || gauge >= this->_gauges) throw IPCException("Illegal gauge");
+	uint64_t ret = 0;
+	for(int s = 0; s < this->_shards; s++)
+		ret += this->values[(size_t)s * this->stride + this->_counters + gauge].load(std::memory_order_relaxed);
+	return (int64_t)ret;
+}
+
+void ShmCounterSet::snapshot(Snapshot &snapshot, bool reset) {
+	snapshot.counters.assign(this->_counters, 0);
+	std::vector<uint64_t> gauges(this->_gauges, 0);
+	for(int s = 0; s < this->_shards; s++) {
+		std::atomic<uint64_t> *shard = this->values + (size_t)s * this->stride;
+		for(int i = 0; i < this->_counters; i++) {
+			// Exchange, so that adds racing with the reset are kept for the next snapshot
+			if(reset) snapshot.counters[i] += shard[i].exchange(0, std::memory_order_relaxed);
+			else snapshot.counters[i] += shard[i].load(std::memory_order_relaxed);
+		}
+		for(int i = 0; i < this->_gauges; i++)
+			gauges[i] += shard[this->_counters + i].load(std::memory_order_relaxed);
+	}
+	snapshot.gauges.assign(this->_gauges, 0);
+	for(int i = 0; i < this->_gauges; i++)
+		snapshot.gauges[i] = (int64_t)gauges[i];
+}
+
+ShmCounterSet::Snapshot ShmCounterSet::snapshot(void) {
+	Snapshot ret;
+	this->snapshot(ret, false);
+	return ret;
+}
+
+void ShmCounterSet::reset(void) {
+	for(int s = 0; s < this->_shards; s++) {
+		std::atomic<uint64_t> *shard = this->values + (size_t)s * this->stride;
+		for(int i = 0; i < this->_counters; i++)
+			shard[i].exchange(0, std::memory_order_relaxed);
+	}
+}
+
+int ShmCounterSet::counters(void) const { return this->_counters; }
+int ShmCounterSet::gauges(void) const { return this->_gauges; }
+int ShmCounterSet::shards(void) const { return this->_shards; }
+
+SharedMemory &ShmCounterSet::memory(void) { return this->shm; }
@@ -14,6 +14,16 @@
 #include <string>
 #include <vector>
 #include <exception>
+#include <atomic>
+#include <type_traits>
+#include <iterator>
+#include <utility>
+#include <new>
+#include <cstddef>
+
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/ipc.h>
@@ -22,8 +32,50 @@
 #include <string.h>
 
 class IPCException;
+class IPCStats;
+class ShmMutex;
+class Doorbell;
+struct ShmOptions;
+class ShmSegment;
 class SharedMemory;
+template<typename T, typename Segment> class SharedArray;
+template<typename T, typename Segment> class SharedObject;
+class ShmNumaPartition;
+class PosixSharedMemory;
 class Semaphore;
+struct SemaphoreOp;
+class SemaphoreSet;
+class FastSemaphore;
+template<typename T> class ShmRingBuffer;
+template<typename T> class ShmMpmcQueue;
+template<typename T> class ShmOffsetPtr;
+class ShmArena;
+template<typename T> class ShmAllocator;
+template<typename T> struct ShmSeqlockSlot;
+template<typename T> class ShmSeqlock;
+template<typename T> class ShmDoubleBuffer;
+class ShmBroadcast;
+class ShmProcessPool;
+class ShmBarrier;
+class ShmRWLock;
+class ShmCounterSet;
+template<typename T> class ShmVector;
+template<typename K, typename V> class ShmHashMap;
+template<typename Request, typename Response> class ShmRpc;
+
+/** Assumed size of a cache line. Used to pad shared data structures against false sharing */
+#define IPC_CACHELINE_SIZE 64
+
+/** Hint for the CPU that we are in a spin-wait loop */
+static inline void ipc_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
 
 /** General IPC exception class */
 class IPCException : public std::exception {
@@ -38,10 +90,313 @@ protected:
 };
 
 
+/** Well-known key of the stats segment, see IPCStats */
+#define IPC_STATS_KEY 0x49505354
+/** Number of per-CPU shards of the stats segment */
+#define IPC_STATS_SHARDS 16
+/** Number of log2 buckets of a latency histogram, from 1 ns to 2^30 ns and above */
+#define IPC_STATS_BUCKETS 32
+
+/** Counters maintained by IPCStats */
+enum IPCStatsCounter {
+	/** Completed Semaphore acquires */
+	IPC_STATS_SEM_ACQUIRES,
+	/** Semaphore acquires that had to wait */
+	IPC_STATS_SEM_CONTENDED,
+	/** SharedMemory attaches by key */
+	IPC_STATS_SHM_ATTACHES,
+	/** Attaches that went down the EEXIST fallback, i.e. the segment already existed */
+	IPC_STATS_SHM_ATTACH_EEXIST,
+	/** Attaches served from the per-process attachment registry without syscalls */
+	IPC_STATS_SHM_ATTACH_CACHED,
+	IPC_STATS_COUNTERS
+};
+
+/** Latency histograms maintained by IPCStats */
+enum IPCStatsHistogram {
+	/** Time blocked in Semaphore acquires that had to wait */
+	IPC_STATS_SEM_WAIT,
+	/** Total time of SharedMemory attaches */
+	IPC_STATS_SHM_ATTACH,
+	/** Time spent in shmat */
+	IPC_STATS_SHM_SHMAT,
+	IPC_STATS_HISTOGRAMS
+};
+
+/**
+ * Contention and latency instrumentation of Semaphore and SharedMemory.
+ * Only recorded if the library is compiled with IPC_STATS defined (make STATS=-DIPC_STATS),
+ * otherwise the instrumentation points compile to nothing. Values are published into the
+ * stats segment with key IPC_STATS_KEY, shared by all instrumented processes and sharded
+ * per CPU, so that the ipcstat tool can display them live.
+ */
+class IPCStats {
+public:
+	/** Summed up values of all shards */
+	struct Snapshot {
+		uint64_t counters[IPC_STATS_COUNTERS];
+		/** Number of samples per histogram */
+		uint64_t samples[IPC_STATS_HISTOGRAMS];
+		/** Sum of all samples per histogram in nanoseconds */
+		uint64_t total_ns[IPC_STATS_HISTOGRAMS];
+		/** Bucket i counts samples in [2^(i-1), 2^i) ns */
+		uint64_t buckets[IPC_STATS_HISTOGRAMS][IPC_STATS_BUCKETS];
+	};
+
+	/** @returns monotonic time in nanoseconds, as used for the histograms */
+	static uint64_t now(void);
+
+	/** Add to a counter of the stats segment */
+	static void count(IPCStatsCounter counter, uint64_t n = 1);
+
+	/** Add a latency sample in nanoseconds to a histogram of the stats segment */
+	static void record(IPCStatsHistogram histogram, uint64_t ns);
+
+	/**
+	 * Read the current values of a stats segment. Never throws
+	 * @returns false if the segment does not exist, cannot be attached or has an unknown layout
+	 */
+	static bool snapshot(Snapshot &snapshot, int key = IPC_STATS_KEY);
+
+	/**
+	 * Reset all values of a stats segment to zero. Never throws
+	 * @returns false if the segment does not exist, cannot be attached or has an unknown layout
+	 */
+	static bool reset(int key = IPC_STATS_KEY);
+
+	/** @returns upper bound in nanoseconds of the given percentile (0..1) of a histogram */
+	static uint64_t percentile(const Snapshot &snapshot, IPCStatsHistogram histogram, double p);
+
+	static const char *name(IPCStatsCounter counter);
+	static const char *name(IPCStatsHistogram histogram);
+};
+
+#ifdef IPC_STATS
+/** Count an event */
+#define IPC_STATS_COUNT(counter) IPCStats::count(counter)
+/** Start a latency measurement */
+#define IPC_STATS_START(var) const uint64_t var = IPCStats::now()
+/** Record the latency since IPC_STATS_START */
+#define IPC_STATS_RECORD(histogram, var) IPCStats::record(histogram, IPCStats::now() - (var))
+#else
+#define IPC_STATS_COUNT(counter) ((void)0)
+#define IPC_STATS_START(var) ((void)0)
+#define IPC_STATS_RECORD(histogram, var) ((void)0)
+#endif
+
+
+/**
+ * Process-shared mutex that lives inside a shared memory segment.
+ * Zero-initialized memory is a valid, unlocked mutex, so no initialization is required
+ * for freshly created segments. Uncontended lock/unlock is a single atomic instruction,
+ * contended lockers spin for a bounded, adaptive number of rounds before they sleep
+ * on a futex. The kernel is only entered when there is contention.
+ *
+ * The lock word holds the pid of the owner and the owner's start time is recorded next
+ * to it. Sleeping waiters periodically check whether the owner still exists; if it died
+ * (or its pid has been reused), one of them takes the lock over and lock() returns
+ * EOWNERDEAD, as the data protected by the mutex may be inconsistent.
+ */
+class ShmMutex {
+private:
+	/** Lock state: 0 unlocked, otherwise pid of the owner, with SHM_MUTEX_WAITERS if there may be waiters */
+	std::atomic<uint32_t> word;
+
+	/** Adaptive spin estimate, shared by all lockers */
+	std::atomic<uint32_t> spins;
+
+	/** Start time of the owner process (clock ticks since boot), 0 if unknown */
+	std::atomic<uint64_t> ownerStart;
+
+	/** Set if the current owner took the lock over from a dead owner */
+	std::atomic<uint32_t> died;
+
+	/** Spin phase of lock(). Returns true if the lock has been acquired */
+	bool spin(void);
+
+	/** Record the calling process as owner after acquiring the lock */
+	void acquired(void);
+
+	/**
+	 * Sleep until the lock is acquired, taking it over if the owner died
+	 * @param deadline Absolute CLOCK_MONOTONIC deadline or NULL to wait forever
+	 * @returns true if the lock has been acquired, false if the deadline passed
+	 */
+	bool wait(const struct timespec *deadline);
+
+public:
+	/**
+	 * Locks the mutex. Blocks until the lock is acquired
+	 * @returns 0, or EOWNERDEAD if the previous owner died while holding the lock
+	 */
+	int lock(void);
+
+	/**
+	 * Tries to lock the mutex without blocking
+	 * @returns true if the lock has been acquired
+	 */
+	bool try_lock(void);
+
+	/**
+	 * Tries to lock the mutex, but blocks at most for the given time
+	 * @param timeout_us Timeout in microseconds
+	 * @returns true if the lock has been acquired, false if the timeout expired
+	 */
+	bool try_lock_for(long timeout_us);
+
+	/** Unlocks the mutex. Only wakes a waiter if there is one */
+	void unlock(void);
+
+	/** @returns true if the mutex is currently locked */
+	bool isLocked(void) const;
+
+	/**
+	 * @returns true if the current owner took the lock over from a dead owner, i.e. the
+	 * protected state may be inconsistent. Reset by unlock()
+	 */
+	bool ownerDied(void) const;
+};
+
+/**
+ * Cross-process notification primitive that lives inside a shared memory segment.
+ * Waiters spin briefly and then sleep on a futex, so they wake up within microseconds
+ * without burning a CPU while waiting. Zero-initialized memory is a valid doorbell.
+ *
+ * Typical use is waiting for a condition on shared data:
+ *
+ *     bell->wait_until([&]() { return data->ready; });	// Waiter
+ *     data->ready = true; bell->ringAll();				// Notifier
+ */
+class Doorbell {
+private:
+	/** Number of rings so far. Also the futex word waiters sleep on */
+	std::atomic<uint32_t> seq;
+
+	/** Number of processes sleeping or about to sleep on the doorbell */
+	std::atomic<uint32_t> waiters;
+
+	/** Wake up the given number of waiters after a ring */
+	void wake(int n);
+
+public:
+	/** @returns the current ring sequence. Pass it to wait() to wait for the next ring */
+	uint32_t sequence(void) const;
+
+	/** Ring the doorbell and wake up one waiter. Only enters the kernel if somebody sleeps */
+	void ring(void);
+
+	/** Ring the doorbell and wake up all waiters. Only enters the kernel if somebody sleeps */
+	void ringAll(void);
+
+	/**
+	 * Wait until the doorbell has been rung after the given sequence
+	 * @param seen Sequence obtained by sequence() before checking the condition
+	 */
+	void wait(uint32_t seen);
+
+	/**
+	 * Wait until the doorbell has been rung after the given sequence, at most for the given time
+	 * @param seen Sequence obtained by sequence() before checking the condition
+	 * @param timeout_us Timeout in microseconds
+	 * @returns true if the doorbell has been rung, false if the timeout expired
+	 */
+	bool wait_for(uint32_t seen, long timeout_us);
+
+	/** Wait until the given predicate holds. The predicate is re-checked after every ring */
+	template<class Pred>
+	void wait_until(Pred pred) {
+		for(;;) {
+			const uint32_t seen = this->sequence();
+			if(pred()) return;
+			this->wait(seen);
+		}
+	}
+};
+
+/** Additional options for creating and attaching shared memory segments */
+struct ShmOptions {
+	/** Huge page size in bytes (e.g. 2 MiB or 1 GiB) for SHM_HUGETLB segments. 0 uses normal pages */
+	size_t hugePageSize;
+	/** Pin the segment in memory (SHM_LOCK and mlock) after attaching */
+	bool lock;
+	/** Fault in all pages after attaching, so that the first access does not page fault */
+	bool prefault;
+	/** Number of threads used for prefaulting. 0 uses one thread per online CPU */
+	int prefaultThreads;
+
+	ShmOptions() : hugePageSize(0), lock(false), prefault(false), prefaultThreads(0) {}
+};
+
+/** NUMA placement policies for shared memory segments */
+enum ShmNumaPolicy {
+	/** System default policy: pages are placed on the node of the process that first touches them */
+	SHM_NUMA_DEFAULT = 0,
+	/** Place all pages on the given nodes */
+	SHM_NUMA_BIND,
+	/** Interleave pages round-robin over the given nodes */
+	SHM_NUMA_INTERLEAVE,
+	/** Place each page on the node of the CPU that touches it first */
+	SHM_NUMA_LOCAL
+};
+
+/** Size of the control header that SharedMemory reserves at the beginning of each segment */
+#define IPC_SHM_HEADER_SIZE IPC_CACHELINE_SIZE
+
+/**
+ * Interface shared by the segment types SharedMemory (System V) and PosixSharedMemory
+ * (shm_open, memfd or file-backed), so that typed views and user code can work on either.
+ * Each segment starts with a control header holding a mutex and a doorbell, get() returns
+ * the memory after it.
+ */
+class ShmSegment {
+public:
+	virtual ~ShmSegment() {}
+
+	/** Get the actual memory segment, after the control header */
+	virtual void *get(void) const = 0;
+	/** Size of the attached segment, without the control header */
+	virtual size_t size(void) const = 0;
+	/** @returns true if the segment is attached */
+	virtual bool isAttached(void) const = 0;
+	/** @returns true, if this instance has created the segment */
+	virtual bool isCreated(void) const = 0;
+	/** Enable or disable deleting the segment on disposal */
+	virtual void setDeleteOnDispose(bool enabled = true) = 0;
+	/** Detach the segment */
+	virtual void detach(void) = 0;
+	/** Detach and delete the segment */
+	virtual void destroy(void) = 0;
+
+	/**
+	 * Locks the mutex of the segment. Blocks until the locks is yielded
+	 * @returns 0, or EOWNERDEAD if the previous owner died while holding the lock
+	 */
+	virtual int lock(void) = 0;
+	/** Tries to lock the mutex of the segment without blocking */
+	virtual bool try_lock(void) = 0;
+	/** Tries to lock the mutex of the segment, blocking at most for the given time in microseconds */
+	virtual bool try_lock_for(long timeout_us) = 0;
+	/** Unlocks the mutex of the segment */
+	virtual void unlock(void) = 0;
+	/** @returns the doorbell of the segment, for waiting on changes made by other processes */
+	virtual Doorbell &doorbell(void) const = 0;
+};
+
 /**
  * Implements a shared memory segment
+ *
+ * Each segment starts with a control header of IPC_SHM_HEADER_SIZE bytes, which holds
+ * the segment mutex used by lock() and unlock(). get(), create() and attach() all return the
+ * memory after the header. The segment is IPC_SHM_HEADER_SIZE bytes larger than requested,
+ * so peers that use plain shmget()/shmat() on the same key see the data at that offset and
+ * must agree on the layout; a segment created by such a peer with exactly the requested
+ * size is too small to be attached.
+ *
+ * Attachments are tracked in a process-wide registry: attaching a segment that this process
+ * has already attached (by key, by id or by copying an instance) reuses the existing mapping,
+ * and the segment is detached when the last instance using it detaches.
  */
-class SharedMemory {
+class SharedMemory : public ShmSegment {
 private:
 	/** Shared memory ID */
 	int shmid;
@@ -67,6 +422,33 @@ private:
 	/** Size of the shared memory */
 	size_t _size;
 
+	/** Control header at the beginning of each segment */
+	struct Header {
+		ShmMutex mutex;
+		Doorbell doorbell;
+	};
+
+	/** @returns the control header of the attached segment */
+	Header *header(void) const;
+
+	/** @returns the size of the segment including header, rounded up to the page size */
+	static size_t segmentSize(size_t size, const ShmOptions &options);
+
+	/** @returns shmget flags for the given attributes and options */
+	static int segmentFlags(int attr, const ShmOptions &options);
+
+	/** Apply the lock and prefault options to the attached segment */
+	void applyOptions(const ShmOptions &options);
+
+	/** Apply the options, or detach (and delete, if created by this instance) the segment and rethrow if that fails */
+	void applyOptionsOrRelease(const ShmOptions &options);
+
+	/** Detach (and delete, if set) the segment as on destruction and reset to the unattached state */
+	void release(void);
+
+	/** Reset to the unattached state without touching the segment */
+	void forget(void);
+
 protected:
 
 	/** Execute shared memory command on this shared memory segment
@@ -85,10 +467,19 @@ public:
 	SharedMemory();
 	SharedMemory(int key);
 	SharedMemory(int key, size_t size, int attr = 0600);
+	SharedMemory(int key, size_t size, int attr, const ShmOptions &options);
+	/** Share the mapping of the given instance. The copy never deletes the segment on dispose */
 	SharedMemory(const SharedMemory &ref);
+	/** Take over the mapping and dispose flags of the given instance without any syscalls */
+	SharedMemory(SharedMemory &&ref);
 
 	virtual ~SharedMemory();
 
+	/** Dispose the current segment and share the mapping of the given instance */
+	SharedMemory &operator=(const SharedMemory &ref);
+	/** Dispose the current segment and take over the mapping of the given instance */
+	SharedMemory &operator=(SharedMemory &&ref);
+
 	void setKey(int key);
 	int key(void) const;
 	int id(void) const;
@@ -116,12 +507,24 @@ public:
 
 
 	/**
-	 * Get the shared memory stats
+	 * Get the shared memory stats. The result is cached per process, call refresh() to update it
 	 * @returns Shared memory stats struct
 	 * @throws IPCException If the access to the shared memory fails
 	 */
 	struct shmid_ds stats(void) const;
 
+	/**
+	 * Refresh the cached shared memory stats used by stats(), nAttached(), permissions() and size()
+	 * @throws IPCException If the access to the shared memory fails
+	 */
+	void refresh(void);
+
+
+	/**
+	 * Wait until the creator of the segment stores the given magic value into a ready field, i.e. has initialized it
+	 * @throws IPCException if the creator exited without storing the value
+	 */
+	void waitReady(const std::atomic<uint32_t> &ready, uint32_t magic) const;
 
 	/**
 	 * Get the shared memory stats and write them in the given struct
@@ -131,7 +534,7 @@ public:
 	void stats(struct shmid_ds *buf) const;
 
 	/**
-	 * @returns number of attached clients to the shared memory
+	 * @returns number of attached clients to the shared memory, as of the last refresh()
 	 */
 	int nAttached(void) const;
 
@@ -149,9 +552,19 @@ public:
 		  @param size Size in bytes of the new shared memory segment
 		  @param attr Attributes of the the shared memory. IPC_CREAT will be added to this. Default value is 0600
 		  @throws IPCException on an error
+		  @returns the memory after the control header, like get()
 	 */
 	void *create(int shm_key, size_t size, int attr = 0600);
 
+	/**
+	 * Create new shared memory segment with additional options (huge pages, locking, prefaulting)
+		  @param shm_key Key of the new Shared memory segment
+		  @param size Size in bytes of the new shared memory segment
+		  @param attr Attributes of the the shared memory. IPC_CREAT will be added to this
+		  @param options Additional options for the segment
+		  @throws IPCException on an error
+	 */
+	void *create(int shm_key, size_t size, int attr, const ShmOptions &options);
 
 	/**
 	  * Create new shared memory segment
@@ -163,9 +576,32 @@ public:
 
 	/**
 	 * Attach to shared memory with the internal key
+	 * @returns the memory after the control header, like get()
 	 */
 	void *attach(const size_t size, int attr = 0600);
 
+	/**
+	 * Attach to shared memory with the internal key, with additional options (huge pages, locking, prefaulting).
+	 * The huge page option only applies if the segment is created by this call
+	 */
+	void *attach(const size_t size, int attr, const ShmOptions &options);
+
+	/**
+	 * Pin the attached segment in memory using SHM_LOCK and mlock
+	 * @throws IPCException if locking fails, e.g. because of RLIMIT_MEMLOCK
+	 */
+	void lockMemory(void);
+
+	/** Undo lockMemory() */
+	void unlockMemory(void);
+
+	/**
+	 * Fault in all pages of the attached segment, so that they are resident before the first access.
+	 * Existing contents are not modified
+	 * @param threads Number of threads to use. 0 uses one thread per online CPU
+	 */
+	void prefault(int threads = 0);
+
 	/**
 	 * @returns true if the shared memory object is attached
 	 */
@@ -188,7 +624,8 @@ public:
 	void *operator*(void) const;
 
 	/**
-	 * Create or attach to the given key as shared memory
+	 * Create or attach to the given key as shared memory.
+	 * The segment includes the control header, the returned pointer points after it.
 	 * @param key Shared memory key
 	 * @param size Size of the shared memory segment in bytes
 	 * @param attr Attribute of the shared memory segment
@@ -197,7 +634,17 @@ public:
 	 */
 	static void *createNew(const int key, const size_t size, int attr = 0600);
 	/**
-	 * Detach the given pointer to a shared memory
+	 * Create or attach to the given key as shared memory with additional options
+	 * @param key Shared memory key
+	 * @param size Size of the shared memory segment in bytes
+	 * @param attr Attribute of the shared memory segment
+	 * @param options Additional options for the segment
+	 * @throws IPCException Thrown if something went wrong
+	 * @return pointer to the shared memory
+	 */
+	static void *createNew(const int key, const size_t size, int attr, const ShmOptions &options);
+	/**
+	 * Detach the given pointer to a shared memory, as returned by createNew
 	 * @throws IPCException Thrown if something went wrong
 	 */
 	static void detach(void *mem);
@@ -227,78 +674,3343 @@ public:
 	 */
 	static SharedMemory *attachNew(const int id, const size_t size);
 
-	/** Locks the mutex of this shared memory. Blocks until the locks is yielded */
-	void lock(void);
+	/**
+	 * Set the NUMA placement policy of the segment (mbind). The policy is attached to the
+	 * segment itself, so it applies to pages faulted in by any attached process
+	 * @param policy Placement policy
+	 * @param nodes NUMA nodes for SHM_NUMA_BIND and SHM_NUMA_INTERLEAVE
+	 * @param move If true, already resident pages are migrated as well (MPOL_MF_MOVE)
+	 * @throws IPCException if the policy cannot be applied
+	 */
+	void setNumaPolicy(ShmNumaPolicy policy, const std::vector<int> &nodes = std::vector<int>(), bool move = false);
+
+	/**
+	 * Query on which NUMA nodes the resident pages of the segment are placed
+	 * @returns number of resident pages per node, indexed by node
+	 * @throws IPCException if the query fails
+	 */
+	std::vector<size_t> numaNodes(void) const;
+
+	/** @returns number of NUMA nodes of the system (highest online node + 1) */
+	static int numaNodeCount(void);
+
+	/** @returns NUMA node the calling thread is currently running on */
+	static int currentNumaNode(void);
+
+	/**
+	 * Apply a NUMA placement policy to the given page-aligned memory range
+	 * @throws IPCException if the policy cannot be applied
+	 */
+	static void setNumaPolicy(void *addr, size_t len, ShmNumaPolicy policy, const std::vector<int> &nodes, bool move = false);
+
+	/**
+	 * Locks the mutex of this shared memory. Blocks until the locks is yielded
+	 * @returns 0, or EOWNERDEAD if the previous owner died while holding the lock
+	 */
+	int lock(void);
+	/**
+	 * Tries to lock the mutex of this shared memory without blocking
+	 * @returns true if the lock has been acquired
+	 */
+	bool try_lock(void);
+	/**
+	 * Tries to lock the mutex of this shared memory, blocking at most for the given time
+	 * @param timeout_us Timeout in microseconds
+	 * @returns true if the lock has been acquired, false if the timeout expired
+	 */
+	bool try_lock_for(long timeout_us);
 	/** Unlocks the mutex of this shared memory */
 	void unlock(void);
+
+	/** @returns the doorbell of this shared memory, for waiting on changes made by other processes */
+	Doorbell &doorbell(void) const;
 };
 
 
-class Semaphore {
+/**
+ * Typed view of a shared memory segment as array of n elements of T.
+ * The view owns its segment and caches the data pointer, so element access does not
+ * go through get(). Views are cheap to move; copies share the mapping of this process.
+ * The memory of a newly created segment is zero-initialised.
+ * Segment is SharedMemory (by key) or PosixSharedMemory (by name, not copyable).
+ */
+template<typename T, typename Segment = SharedMemory>
+class SharedArray {
+	static_assert(std::is_base_of<ShmSegment, Segment>::value, "SharedArray requires a ShmSegment");
+	static_assert(std::is_trivially_copyable<T>::value, "SharedArray requires a trivially copyable type");
+	static_assert(alignof(T) <= IPC_SHM_HEADER_SIZE, "SharedArray type alignment exceeds the segment data alignment");
+	static_assert(sizeof(T) > 0, "SharedArray requires a complete type");
+
 private:
-	/** Semaphore id */
-	int semid;
+	Segment shm;
+	T *_data;
+	size_t _count;
 
-	/** Semaphore key */
-	int semkey;
-public:
-	/** Attach to the given semaphore id
-	 * @param key Key of the semaphore to be used
-	 * @param attr Attribute for the semaphore. Default is 0600
-	 * */
-	Semaphore(int key, int attr = 0600);
+	/** @returns byte size of n elements */
+	static size_t bytes(size_t n) {
+		if(n > ((size_t)-1) / sizeof(T)) throw IPCException("SharedArray size overflow");
+		return n * sizeof(T);
+	}
 
-	virtual ~Semaphore();
+public:
+	typedef T value_type;
+	typedef T *iterator;
+	typedef const T *const_iterator;
 
-	/** Get the key of the semaphore */
-	int key(void) const;
-	/** Get the id of the semaphore */
-	int id(void) const;
+	/**
+	 * Create or attach to the segment with the given key
+	 * @param key Shared memory key
+	 * @param n Number of elements
+	 * @param attr Attributes of the shared memory
+	 * @throws IPCException on an error
+	 */
+	SharedArray(int key, size_t n, int attr = 0600) : shm(key, bytes(n), attr), _data((T*)shm.get()), _count(n) {}
 
-	/** Set the value of the semaphore
-	 * @param value Value to be set
-	 * */
-	void setValue(int value) const;
+	/**
+	 * Create or attach to the named segment (PosixSharedMemory)
+	 * @param name Name of the segment
+	 * @param n Number of elements
+	 * @param attr Permissions of the segment
+	 * @throws IPCException on an error
+	 */
+	SharedArray(const std::string &name, size_t n, int attr = 0600) : shm(name, bytes(n), attr), _data((T*)shm.get()), _count(n) {}
 
 	/**
-	 * Get the value of the semaphore
-	 * @return value of the semaphore
+	 * Take over an attached segment as array of n elements
+	 * @throws IPCException if the segment is not attached or smaller than n elements
 	 */
-	int getValue() const ;
+	SharedArray(Segment &&memory, size_t n) : shm(std::move(memory)), _data(NULL), _count(n) {
+		if(!this->shm.isAttached()) throw IPCException("Shared-memory not attached");
+		if(this->shm.size() < bytes(n)) throw IPCException("Shared memory segment too small for SharedArray");
+		this->_data = (T*)this->shm.get();
+	}
 
-	/** @return value of the semaphore */
-	int operator*(void) const;
+	SharedArray(const SharedArray &ref) : shm(ref.shm), _data((T*)shm.get()), _count(ref._count) {}
+	SharedArray(SharedArray &&ref) : shm(std::move(ref.shm)), _data(ref._data), _count(ref._count) {
+		ref._data = NULL;
+		ref._count = 0;
+	}
+	SharedArray &operator=(const SharedArray &ref) {
+		this->shm = ref.shm;
+		this->_data = (T*)this->shm.get();
+		this->_count = ref._count;
+		return *this;
+	}
+	SharedArray &operator=(SharedArray &&ref) {
+		this->shm = std::move(ref.shm);
+		this->_data = ref._data;
+		this->_count = ref._count;
+		ref._data = NULL;
+		ref._count = 0;
+		return *this;
+	}
+
+	T *data(void) const { return this->_data; }
+	size_t size(void) const { return this->_count; }
+	T &operator[](size_t i) const { return this->_data[i]; }
+	/** Bounds-checked element access
+	  * @throws IPCException if the index is out of range */
+	T &at(size_t i) const {
+		if(i >= this->_count) throw IPCException("SharedArray index out of range");
+		return this->_data[i];
+	}
+	iterator begin(void) const { return this->_data; }
+	iterator end(void) const { return this->_data + this->_count; }
+
+	/** @returns the underlying shared memory, e.g. for locking or the doorbell */
+	Segment &memory(void) { return this->shm; }
+};
+
+/**
+ * Typed view of a shared memory segment holding a single object of type T.
+ * Same ownership rules as SharedArray; the object of a newly created segment is zero-initialised.
+ */
+template<typename T, typename Segment = SharedMemory>
+class SharedObject {
+	static_assert(std::is_base_of<ShmSegment, Segment>::value, "SharedObject requires a ShmSegment");
+	static_assert(std::is_trivially_copyable<T>::value, "SharedObject requires a trivially copyable type");
+	static_assert(alignof(T) <= IPC_SHM_HEADER_SIZE, "SharedObject type alignment exceeds the segment data alignment");
+	static_assert(sizeof(T) > 0, "SharedObject requires a complete type");
+
+private:
+	Segment shm;
+	T *object;
 
+public:
 	/**
-	 * Increase semaphore by the given value
-	 * @param count increase counter. Default is 1
+	 * Create or attach to the segment with the given key
+	 * @throws IPCException on an error
 	 */
-	void increase(int count = 1) const;
+	SharedObject(int key, int attr = 0600) : shm(key, sizeof(T), attr), object((T*)shm.get()) {}
+
 	/**
-	 * Decrease semaphore by the given value
-	 * @param count increase counter. Default is 1
+	 * Create or attach to the named segment (PosixSharedMemory)
+	 * @throws IPCException on an error
 	 */
-	void decrease(int count = 1) const;
-
-	/** Destroys this semaphore */
-	void destroy(void);
+	SharedObject(const std::string &name, int attr = 0600) : shm(name, sizeof(T), attr), object((T*)shm.get()) {}
 
-	/** Acquire resources from semaphore. Blocks until the given count is available
-	 * @param count Counter indicating how many resources should be acquired. Default value is 1
+	/**
+	 * Take over an attached segment
+	 * @throws IPCException if the segment is not attached or smaller than T
 	 */
-	void aquire(int count = 1);
+	SharedObject(Segment &&memory) : shm(std::move(memory)), object(NULL) {
+		if(!this->shm.isAttached()) throw IPCException("Shared-memory not attached");
+		if(this->shm.size() < sizeof(T)) throw IPCException("Shared memory segment too small for SharedObject");
+		this->object = (T*)this->shm.get();
+	}
 
-	/** Release resources to semaphore. Blocks until the given count is available
-	 * @param count Counter indicating how many resources should be released. Default value is 1
+	SharedObject(const SharedObject &ref) : shm(ref.shm), object((T*)shm.get()) {}
+	SharedObject(SharedObject &&ref) : shm(std::move(ref.shm)), object(ref.object) { ref.object = NULL; }
+	SharedObject &operator=(const SharedObject &ref) {
+		this->shm = ref.shm;
+		this->object = (T*)this->shm.get();
+		return *this;
+	}
+	SharedObject &operator=(SharedObject &&ref) {
+		this->shm = std::move(ref.shm);
+		this->object = ref.object;
+		ref.object = NULL;
+		return *this;
+	}
+
+	T *get(void) const { return this->object; }
+	T &operator*(void) const { return *this->object; }
+	T *operator->(void) const { return this->object; }
+
+	/** @returns the underlying shared memory, e.g. for locking or the doorbell */
+	Segment &memory(void) { return this->shm; }
+};
+
+
+/**
+ * Shared memory segment partitioned into one slice per NUMA node.
+ * Each slice is bound to its node, so every process can work on memory local to the
+ * node it runs on via local(), while all slices remain accessible to everyone.
+ */
+class ShmNumaPartition {
+private:
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	/** Number of slices (NUMA nodes) */
+	int _nodes;
+
+	/** Size of a single slice, rounded up to the page size */
+	size_t _sliceSize;
+
+	/** First slice, page aligned */
+	char *slices;
+
+	ShmNumaPartition(const ShmNumaPartition &ref) = delete;
+	ShmNumaPartition &operator=(const ShmNumaPartition &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the partitioned segment
+	 * @param key Shared memory key
+	 * @param sliceSize Size of each per-node slice in bytes
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException on an error
 	 */
-	void release(int count = 1);
+	ShmNumaPartition(int key, size_t sliceSize, int attr = 0600);
 
-	/** Destroy the given semaphore
-	  * @param key Key of the semaphore to be destroyed
-	  * @param attr Attribute with witch the semaphore is accessed
-	  * @returns true if the action was successful, otherwise false. If it fails, errno is set
-	  */
-	static bool destroy(const int key, const int attr = 0600);
+	virtual ~ShmNumaPartition();
+
+	/** @returns number of slices (NUMA nodes) */
+	int nodes(void) const;
+
+	/** @returns size of a single slice in bytes */
+	size_t sliceSize(void) const;
+
+	/** @returns the slice bound to the given node */
+	void *slice(int node) const;
+
+	/** @returns the slice of the node the calling thread is currently running on */
+	void *local(void) const;
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void);
+};
+
+/**
+ * Shared memory segment backed by POSIX shared memory (shm_open) or an anonymous memfd.
+ * Implements the ShmSegment interface like SharedMemory, but segments are identified by name,
+ * are not limited by kernel.shmmax, can grow in place and can be passed to other
+ * processes as file descriptor over a UNIX domain socket.
+ * Like SharedMemory, each segment starts with a control header holding the segment mutex.
+ * Segments can also be backed by a regular file (attachFile), which keeps their contents
+ * across restarts. The control header then records a magic value, a layout version and a
+ * checksum of the data as of the last sync() or clean detach, which are validated when the
+ * file is mapped again.
+ */
+class PosixSharedMemory : public ShmSegment {
+private:
+	/** Name of the segment. Empty for anonymous and file-backed segments */
+	std::string _name;
+
+	/** Path of the backing file. Empty unless file-backed */
+	std::string _path;
+
+	/** File descriptor of the segment */
+	int fd;
+
+	/** Mapping of the segment, including the control header */
+	void *mem;
+
+	/** Mapped length in bytes, including the control header */
+	size_t mapped;
+
+	/** Process that took the lock on the backing file, 0 unless file-backed */
+	pid_t filePid;
+
+	/** Flag indicating if we unlink the segment on destruction */
+	bool _deleteOnDestruction;
+
+	/** Created flag */
+	bool _created;
+
+	/** Control header at the beginning of each segment */
+	struct Header {
+		ShmMutex mutex;
+		Doorbell doorbell;
+		/** Persistence data, written by sync() and snapshot() */
+		uint32_t magic;
+		uint32_t version;
+		uint64_t dataSize;
+		uint64_t checksum;
+	};
+
+	/** @returns the control header of the attached segment */
+	Header *header(void) const;
+
+	/** Record size and checksum of the data in the control header */
+	void seal(void);
+
+	/** Map the file descriptor with the given length. Nothing stays mapped if it fails */
+	void map(size_t length, const ShmOptions &options);
+
+	/** Detach (and unlink, if set) the segment as on destruction and reset to the unattached state */
+	void release(void);
+
+	/** Reset to the unattached state without touching the segment */
+	void forget(void);
+
+	PosixSharedMemory(const PosixSharedMemory &ref) = delete;
+	PosixSharedMemory &operator=(const PosixSharedMemory &ref) = delete;
+
+public:
+	PosixSharedMemory();
+	/**
+	 * Create or attach to the named segment. An attacher waits up to one second for the creator to size the segment
+	 * @param name Name of the segment. A leading slash is added if missing
+	 * @param size Size in bytes of the segment
+	 * @param attr Permissions of the segment. Default value is 0600
+	 * @param options Additional options. prefault maps with MAP_POPULATE, lock with mlock
+	 * @throws IPCException on an error, e.g. if the creator never sized the segment. A name created by this call is unlinked again
+	 */
+	PosixSharedMemory(const std::string &name, size_t size, int attr = 0600, const ShmOptions &options = ShmOptions());
+	/** Take over the mapping, file descriptor and dispose flag of the given instance */
+	PosixSharedMemory(PosixSharedMemory &&ref);
+
+	virtual ~PosixSharedMemory();
+
+	/** Dispose the current segment and take over the given instance */
+	PosixSharedMemory &operator=(PosixSharedMemory &&ref);
+
+	/** @returns name of the segment, or an empty string for anonymous segments */
+	std::string name(void) const;
+
+	/** @returns file descriptor of the segment, or -1 if not attached */
+	int fileDescriptor(void) const;
+
+	/**
+	 * Enable or disable the delete on dispose routine
+	 * @param enabled if true, the segment will be unlinked on disposal
+	 * */
+	void setDeleteOnDispose(bool enabled = true);
+
+	/** @returns true, if this instance has created the segment */
+	bool isCreated(void) const;
+
+	/**
+	 * Create or attach to the named segment. An attacher waits up to one second for the creator to size the segment
+	 * @param name Name of the segment. A leading slash is added if missing
+	 * @param size Size in bytes of the segment
+	 * @param attr Permissions of the segment. Default value is 0600
+	 * @param options Additional options. prefault maps with MAP_POPULATE, lock with mlock
+	 * @throws IPCException on an error, e.g. if the creator never sized the segment. A name created by this call is unlinked again
+	 */
+	void *attach(const std::string &name, size_t size, int attr = 0600, const ShmOptions &options = ShmOptions());
+
+	/**
+	 * Create a new anonymous segment using memfd_create. It can be shared with
+	 * child processes or passed to other processes with sendFd()
+	 * @param size Size in bytes of the segment
+	 * @param options Additional options. hugePageSize selects MFD_HUGETLB
+	 * @throws IPCException on an error
+	 */
+	void *createAnonymous(size_t size, const ShmOptions &options = ShmOptions());
+
+	/**
+	 * Create or map a segment backed by the given file, e.g. on disk or on a tmpfs.
+	 * If no other process has the file mapped, an existing file is validated: magic value,
+	 * layout version, size and the checksum must match. The checksum is written by sync()
+	 * and by the last process detaching, so it only fails after a crash or a kill without
+	 * sync(); see recoverFile(). The file is not removed on destruction, unless
+	 * setDeleteOnDispose() is called
+	 * @param path Path of the backing file
+	 * @param size Size in bytes of the segment
+	 * @param version Layout version of the data. Mapping a file with another version fails
+	 * @param attr Permissions of a newly created file. Default value is 0600
+	 * @param options Additional options. prefault maps with MAP_POPULATE, lock with mlock
+	 * @throws IPCException on an error or if the validation fails
+	 */
+	void *attachFile(const std::string &path, size_t size, uint32_t version = 0, int attr = 0600, const ShmOptions &options = ShmOptions());
+
+	/**
+	 * Update the checksum of the data and write the segment back to its file (msync).
+	 * Writers must be stopped during the call, e.g. by holding lock(), so that the checksum is consistent
+	 * @throws IPCException on an error
+	 */
+	void sync(void);
+
+	/**
+	 * Write a consistent copy of the segment to the given file, which can later be mapped with attachFile().
+	 * The copy is written to a temporary file first and then renamed. Writers must be stopped during the call
+	 * @param path Path of the snapshot file
+	 * @param attr Permissions of the snapshot file. Default value is 0600
+	 * @throws IPCException on an error
+	 */
+	void snapshot(const std::string &path, int attr = 0600);
+
+	/**
+	 * Accept the current contents of a file-backed segment that fails the checksum, e.g.
+	 * after a crash, by sealing it again. The application is responsible for checking the
+	 * data; alternatively the file can simply be removed and rebuilt
+	 * @param path Path of the backing file
+	 * @param version Expected layout version
+	 * @throws IPCException if the file is mapped by another process, is not a persistent
+	 * segment or has another layout version
+	 */
+	static void recoverFile(const std::string &path, uint32_t version = 0);
+
+	/** @returns path of the backing file, or an empty string if the segment is not file-backed */
+	std::string path(void) const;
+
+	/** @returns layout version of the segment */
+	uint32_t layoutVersion(void) const;
+
+	/**
+	 * Attach to the segment behind the given file descriptor, e.g. as received by receiveFd().
+	 * This instance takes ownership of the file descriptor, it is closed if attaching fails
+	 * @throws IPCException on an error
+	 */
+	void *attachFd(int fd, const ShmOptions &options = ShmOptions());
+
+	/**
+	 * Grow or shrink the segment in place (ftruncate and mremap). The mapping may move,
+	 * so pointers obtained by get() must be refreshed. Other processes pick up the
+	 * new size with refresh()
+	 * @param size New size in bytes
+	 * @throws IPCException on an error
+	 */
+	void *resize(size_t size);
+
+	/**
+	 * Remap the segment if its size has been changed by another process
+	 * @returns true if the mapping has been changed
+	 */
+	bool refresh(void);
+
+	/** @returns true if the segment is attached */
+	bool isAttached(void) const;
+
+	/** Detach the segment and close its file descriptor. The last process detaching from a
+	 * file-backed segment writes the checksum and syncs the file */
+	void detach(void);
+
+	/** Detach and unlink the segment, or its backing file */
+	void destroy(void);
+
+	/** Get the actual memory segment */
+	void *get(void) const;
+	/** Get the actual memory segment */
+	void *operator*(void) const;
+
+	/** Size of the attached segment, without the control header */
+	size_t size(void) const;
+
+	/**
+	 * Send the file descriptor of this segment over a connected UNIX domain socket
+	 * @throws IPCException on an error
+	 */
+	void sendFd(int socket) const;
+
+	/**
+	 * Receive a segment file descriptor sent by sendFd() over a UNIX domain socket
+	 * @returns the received file descriptor, to be used with attachFd()
+	 * @throws IPCException on an error
+	 */
+	static int receiveFd(int socket);
+
+	/**
+	 * Unlink the named segment
+	 * @returns true if the segment has been unlinked, false if an error occurred
+	 */
+	static bool destroy(const std::string &name);
+
+	/** Checks if the named segment exists */
+	static bool exists(const std::string &name);
+
+	/**
+	 * Locks the mutex of this shared memory. Blocks until the locks is yielded
+	 * @returns 0, or EOWNERDEAD if the previous owner died while holding the lock
+	 */
+	int lock(void);
+	/** Tries to lock the mutex of this shared memory without blocking */
+	bool try_lock(void);
+	/** Tries to lock the mutex of this shared memory, blocking at most for the given time in microseconds */
+	bool try_lock_for(long timeout_us);
+	/** Unlocks the mutex of this shared memory */
+	void unlock(void);
+
+	/** @returns the doorbell of this shared memory, for waiting on changes made by other processes */
+	Doorbell &doorbell(void) const;
+};
+
+
+/**
+ * Operations that use SEM_UNDO. The kernel reverts the flagged operations of a process when it
+ * terminates. Only flag both directions if every process pairs its decreases with increases:
+ * with SEMAPHORE_UNDO_PAIRED a process that only increases (a producer posting items) has all
+ * its posts taken back when it exits, and one that only decreases gets its takes undone
+ */
+enum SemaphoreUndo {
+	/** No operation uses SEM_UNDO */
+	SEMAPHORE_UNDO_NONE = 0,
+	/** Decreases (acquires) use SEM_UNDO, so a crashed holder does not keep its resources */
+	SEMAPHORE_UNDO_DECREASE = 1,
+	/** Increases (releases) use SEM_UNDO */
+	SEMAPHORE_UNDO_INCREASE = 2,
+	/** Both directions use SEM_UNDO, for lock-style use where every acquire is followed by a release in the same process */
+	SEMAPHORE_UNDO_PAIRED = 3
+};
+
+class Semaphore {
+private:
+	/** Semaphore id */
+	int semid;
+
+	/** Semaphore key */
+	int semkey;
+
+	/** Operations that use SEM_UNDO */
+	SemaphoreUndo _undo;
+public:
+	/** Attach to the given semaphore id
+	 * @param key Key of the semaphore to be used
+	 * @param attr Attribute for the semaphore. Default is 0600
+	 * */
+	Semaphore(int key, int attr = 0600);
+
+	virtual ~Semaphore();
+
+	/**
+	 * Enable or disable SEM_UNDO for both directions (SEMAPHORE_UNDO_PAIRED). Use this only
+	 * if every process releases what it acquires, see SemaphoreUndo
+	 * @param enabled if true, SEM_UNDO is used. Default is false
+	 */
+	void setUndo(bool enabled = true);
+	/** Select the operations that use SEM_UNDO, e.g. SEMAPHORE_UNDO_DECREASE in a consumer */
+	void setUndo(SemaphoreUndo mode);
+	/** @returns true if any operation uses SEM_UNDO */
+	bool undo(void) const;
+	/** @returns the operations that use SEM_UNDO */
+	SemaphoreUndo undoMode(void) const;
+
+	/** Get the key of the semaphore */
+	int key(void) const;
+	/** Get the id of the semaphore */
+	int id(void) const;
+
+	/** Set the value of the semaphore
+	 * @param value Value to be set
+	 * */
+	void setValue(int value) const;
+
+	/**
+	 * Get the value of the semaphore
+	 * @return value of the semaphore
+	 */
+	int getValue() const ;
+
+	/** @return value of the semaphore */
+	int operator*(void) const;
+
+	/**
+	 * Increase semaphore by the given value
+	 * @param count increase counter. Default is 1
+	 */
+	void increase(int count = 1) const;
+	/**
+	 * Decrease semaphore by the given value
+	 * @param count increase counter. Default is 1
+	 */
+	void decrease(int count = 1) const;
+
+	/** Destroys this semaphore */
+	void destroy(void);
+
+	/** Acquire resources from semaphore. Blocks until the given count is available
+	 * @param count Counter indicating how many resources should be acquired. Default value is 1
+	 */
+	void aquire(int count = 1);
+
+	/** Release resources to semaphore. Blocks until the given count is available
+	 * @param count Counter indicating how many resources should be released. Default value is 1
+	 */
+	void release(int count = 1);
+
+	/** Acquire resources from semaphore without blocking (IPC_NOWAIT)
+	 * @param count Counter indicating how many resources should be acquired. Default value is 1
+	 * @returns true if the resources have been acquired, false if they are not available
+	 */
+	bool try_aquire(int count = 1);
+
+	/** Acquire resources from semaphore, blocking at most for the given time
+	 * @param count Counter indicating how many resources should be acquired
+	 * @param timeout_us Timeout in microseconds
+	 * @returns true if the resources have been acquired, false if the timeout expired
+	 */
+	bool try_aquire_for(int count, long timeout_us);
+
+	/** Destroy the given semaphore
+	  * @param key Key of the semaphore to be destroyed
+	  * @param attr Attribute with witch the semaphore is accessed
+	  * @returns true if the action was successful, otherwise false. If it fails, errno is set
+	  */
+	static bool destroy(const int key, const int attr = 0600);
+};
+
+/** Single operation of an atomic SemaphoreSet operation */
+struct SemaphoreOp {
+	/** Index of the semaphore in the set */
+	int index;
+	/** Positive to release, negative to acquire, 0 to wait until the semaphore is zero.
+	 * semop takes a short, so the magnitude is limited to SHRT_MAX (checked when applied) */
+	int count;
+
+	SemaphoreOp(int index, int count) : index(index), count(count) {}
+};
+
+/**
+ * Set of System V semaphores sharing one id (nsems > 1).
+ * Operations on several semaphores of the set are applied atomically in a single
+ * semop call, so coordinating N resources costs one system call instead of N.
+ */
+class SemaphoreSet {
+private:
+	/** Semaphore set id */
+	int semid;
+
+	/** Semaphore set key */
+	int semkey;
+
+	/** Number of semaphores in the set */
+	int nsems;
+
+	/** Operations that use SEM_UNDO */
+	SemaphoreUndo _undo;
+
+	/** Execute the given operations, with the given additional flags and timeout
+	  * @returns true on success, false if the operation would block or timed out */
+	bool operate(const std::vector<SemaphoreOp> &ops, short flags, long timeout_us) const;
+
+public:
+	/** Create or attach to the given semaphore set
+	 * @param key Key of the semaphore set to be used
+	 * @param nsems Number of semaphores in the set
+	 * @param attr Attribute for the semaphore set. Default is 0600
+	 * */
+	SemaphoreSet(int key, int nsems, int attr = 0600);
+
+	virtual ~SemaphoreSet();
+
+	/** Get the key of the semaphore set */
+	int key(void) const;
+	/** Get the id of the semaphore set */
+	int id(void) const;
+	/** Get the number of semaphores in the set */
+	int size(void) const;
+
+	/**
+	 * Enable or disable SEM_UNDO for both directions (SEMAPHORE_UNDO_PAIRED). Use this only
+	 * if every process releases what it acquires, see SemaphoreUndo
+	 * @param enabled if true, SEM_UNDO is used. Default is false
+	 */
+	void setUndo(bool enabled = true);
+	/** Select the operations that use SEM_UNDO. Negative counts are decreases, positive ones increases */
+	void setUndo(SemaphoreUndo mode);
+	/** @returns true if any operation uses SEM_UNDO */
+	bool undo(void) const;
+	/** @returns the operations that use SEM_UNDO */
+	SemaphoreUndo undoMode(void) const;
+
+	/** Set the value of a semaphore in the set */
+	void setValue(int index, int value) const;
+	/** Get the value of a semaphore in the set */
+	int getValue(int index) const;
+
+	/** Set the values of all semaphores in the set at once */
+	void setAll(const std::vector<unsigned short> &values) const;
+	/** Get the values of all semaphores in the set at once */
+	std::vector<unsigned short> getAll(void) const;
+
+	/** Acquire resources from a semaphore of the set. Blocks until the given count is available */
+	void aquire(int index, int count = 1);
+	/** Release resources to a semaphore of the set */
+	void release(int index, int count = 1);
+	/** Acquire resources from a semaphore of the set without blocking
+	 * @returns true if the resources have been acquired */
+	bool try_aquire(int index, int count = 1);
+	/** Acquire resources from a semaphore of the set, blocking at most for the given time in microseconds
+	 * @returns true if the resources have been acquired, false if the timeout expired */
+	bool try_aquire_for(int index, int count, long timeout_us);
+
+	/** Apply all given operations atomically in a single semop call. Blocks until all of them can be applied */
+	void apply(const std::vector<SemaphoreOp> &ops);
+	/** Apply all given operations atomically without blocking
+	 * @returns true if the operations have been applied, false if they would block */
+	bool try_apply(const std::vector<SemaphoreOp> &ops);
+	/** Apply all given operations atomically, blocking at most for the given time in microseconds
+	 * @returns true if the operations have been applied, false if the timeout expired */
+	bool try_apply_for(const std::vector<SemaphoreOp> &ops, long timeout_us);
+
+	/** Destroys this semaphore set */
+	void destroy(void);
+
+	/** Destroy the given semaphore set
+	  * @param key Key of the semaphore set to be destroyed
+	  * @param attr Attribute with witch the semaphore set is accessed
+	  * @returns true if the action was successful, otherwise false. If it fails, errno is set
+	  */
+	static bool destroy(const int key, const int attr = 0600);
+};
+
+/**
+ * Semaphore with a userspace fast path, living in a shared memory segment.
+ * Drop-in alternative to Semaphore: the count is an atomic that is updated with CAS,
+ * so acquire and release only enter the kernel (futex wait/wake) if a caller has to block
+ * or if there are sleeping waiters to be woken.
+ * Like a System V semaphore, the segment persists until it is explicitly destroyed.
+ */
+class FastSemaphore {
+private:
+	/** Semaphore state in the shared memory segment */
+	struct State {
+		/** Semaphore value. Also the futex word waiters sleep on */
+		std::atomic<uint32_t> value;
+		/** Number of processes sleeping or about to sleep on the value */
+		std::atomic<uint32_t> waiters;
+	};
+
+	/** Segment holding the state */
+	SharedMemory shm;
+
+	/** Semaphore state */
+	State *state;
+
+	/** Semaphore key */
+	int semkey;
+
+	FastSemaphore(const FastSemaphore &ref) = delete;
+	FastSemaphore &operator=(const FastSemaphore &ref) = delete;
+
+	/** @returns the semaphore state, throws if the semaphore has been destroyed */
+	State *get(void) const;
+
+public:
+	/** Create or attach to the semaphore with the given key
+	 * @param key Key of the shared memory segment holding the semaphore
+	 * @param attr Attribute for the shared memory segment. Default is 0600
+	 * */
+	FastSemaphore(int key, int attr = 0600);
+
+	virtual ~FastSemaphore();
+
+	/** Get the key of the semaphore */
+	int key(void) const;
+	/** Get the id of the shared memory segment holding the semaphore */
+	int id(void) const;
+
+	/** Set the value of the semaphore and wake up all waiters
+	 * @param value Value to be set
+	 * */
+	void setValue(int value) const;
+
+	/**
+	 * Get the value of the semaphore
+	 * @return value of the semaphore
+	 */
+	int getValue() const;
+
+	/** @return value of the semaphore */
+	int operator*(void) const;
+
+	/**
+	 * Increase semaphore by the given value. Only enters the kernel if there are waiters
+	 * @param count increase counter. Default is 1
+	 */
+	void increase(int count = 1) const;
+	/**
+	 * Decrease semaphore by the given value. Only enters the kernel if it has to block
+	 * @param count decrease counter. Default is 1
+	 */
+	void decrease(int count = 1) const;
+
+	/** Destroys this semaphore */
+	void destroy(void);
+
+	/** Acquire resources from semaphore. Blocks until the given count is available
+	 * @param count Counter indicating how many resources should be acquired. Default value is 1
+	 */
+	void aquire(int count = 1);
+
+	/** Release resources to semaphore
+	 * @param count Counter indicating how many resources should be released. Default value is 1
+	 */
+	void release(int count = 1);
+
+	/** Destroy the given semaphore
+	  * @param key Key of the semaphore to be destroyed
+	  * @param attr Attribute with witch the semaphore is accessed
+	  * @returns true if the action was successful, otherwise false. If it fails, errno is set
+	  */
+	static bool destroy(const int key, const int attr = 0600);
+};
+
+
+/**
+ * Lock-free single-producer single-consumer ring buffer in a shared memory segment.
+ * Exactly one process pushes and exactly one process pops elements. Head and tail
+ * indices live on separate cache lines and each side keeps a local copy of the
+ * other side's index, so in the steady state a handoff costs no system call and
+ * at most one cache line transfer per batch.
+ * The element type must be trivially copyable, as elements are copied bytewise.
+ */
+template<typename T>
+class ShmRingBuffer {
+	static_assert(std::is_trivially_copyable<T>::value, "ShmRingBuffer requires a trivially copyable type");
+	static_assert(alignof(T) <= IPC_CACHELINE_SIZE, "ShmRingBuffer element alignment exceeds cache line size");
+private:
+	/** Magic value marking an initialized ring buffer header */
+	static const uint32_t READY_MAGIC = 0x52494e47;
+
+	/** Header at the beginning of the segment. Head and tail are on separate cache lines */
+	struct Header {
+		/** Index of the next element to be read. Written by the consumer only */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> head;
+		/** Index of the next element to be written. Written by the producer only */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> tail;
+		/** Number of elements, always a power of two */
+		alignas(IPC_CACHELINE_SIZE) uint64_t capacity;
+		/** Size of a single element, to detect mismatching peers */
+		uint64_t elementSize;
+		/** Set to READY_MAGIC by the creator once the header is initialized */
+		std::atomic<uint32_t> ready;
+	};
+
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	/** Segment header */
+	Header *header;
+
+	/** Element storage, directly following the header */
+	T *buffer;
+
+	/** Capacity and index mask of the buffer */
+	uint64_t _capacity;
+	uint64_t mask;
+
+	/** Producer-local copy of the head index, refreshed only when the buffer looks full */
+	uint64_t cachedHead;
+	/** Consumer-local copy of the tail index, refreshed only when the buffer looks empty */
+	uint64_t cachedTail;
+
+	static uint64_t roundCapacity(size_t capacity) {
+		if(capacity == 0) throw IPCException("Ring buffer capacity must be greater than zero");
+		uint64_t ret = 1;
+		while(ret < capacity) ret <<= 1;
+		return ret;
+	}
+
+	ShmRingBuffer(const ShmRingBuffer &ref) = delete;
+	ShmRingBuffer &operator=(const ShmRingBuffer &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the ring buffer with the given key
+	 * @param key Shared memory key of the ring buffer
+	 * @param capacity Number of elements. Will be rounded up to the next power of two
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created or its layout does not match
+	 */
+	ShmRingBuffer(int key, size_t capacity, int attr = 0600) :
+			shm(key, sizeof(Header) + roundCapacity(capacity) * sizeof(T), attr) {
+		this->header = (Header*)this->shm.get();
+		if(this->header == NULL) throw IPCException("Attaching ring buffer failed");
+		this->buffer = (T*)((char*)this->header + sizeof(Header));
+		this->_capacity = roundCapacity(capacity);
+		this->mask = this->_capacity - 1;
+
+		if(this->shm.isCreated()) {
+			this->header->capacity = this->_capacity;
+			this->header->elementSize = sizeof(T);
+			this->header->ready.store(READY_MAGIC, std::memory_order_release);
+		} else {
+			// Wait for the creator to initialize the header
+			this->shm.waitReady(this->header->ready, READY_MAGIC);
+			if(this->header->elementSize != sizeof(T) || this->header->capacity != this->_capacity)
+				throw IPCException("Ring buffer layout mismatch");
+		}
+		this->cachedHead = this->header->head.load(std::memory_order_acquire);
+		this->cachedTail = this->header->tail.load(std::memory_order_acquire);
+	}
+
+	virtual ~ShmRingBuffer() {}
+
+	/**
+	 * Push a single element. Must only be called by the producer
+	 * @returns true if the element has been pushed, false if the buffer is full
+	 */
+	bool push(const T &item) {
+		return this->push(&item, 1) == 1;
+	}
+
+	/**
+	 * Push up to n elements at once. Must only be called by the producer
+	 * @param items Elements to be pushed
+	 * @param n Number of elements to be pushed
+	 * @returns number of elements that have been pushed
+	 */
+	size_t push(const T *items, size_t n) {
+		const uint64_t tail = this->header->tail.load(std::memory_order_relaxed);
+		uint64_t avail = this->_capacity - (tail - this->cachedHead);
+		if(avail < n) {
+			this->cachedHead = this->header->head.load(std::memory_order_acquire);
+			avail = this->_capacity - (tail - this->cachedHead);
+		}
+		if(n > avail) n = avail;
+		if(n == 0) return 0;
+
+		const uint64_t idx = tail & this->mask;
+		const uint64_t first = (n < this->_capacity - idx) ? n : this->_capacity - idx;
+		::memcpy(this->buffer + idx, items, first * sizeof(T));
+		if(first < n)
+			::memcpy(this->buffer, items + first, (n - first) * sizeof(T));
+		this->header->tail.store(tail + n, std::memory_order_release);
+		return n;
+	}
+
+	/**
+	 * Pop a single element. Must only be called by the consumer
+	 * @returns true if an element has been popped, false if the buffer is empty
+	 */
+	bool pop(T &item) {
+		return this->pop(&item, 1) == 1;
+	}
+
+	/**
+	 * Pop up to n elements at once. Must only be called by the consumer
+	 * @param items Destination of the popped elements
+	 * @param n Maximum number of elements to be popped
+	 * @returns number of elements that have been popped
+	 */
+	size_t pop(T *items, size_t n) {
+		const uint64_t head = this->header->head.load(std::memory_order_relaxed);
+		uint64_t avail = this->cachedTail - head;
+		if(avail < n) {
+			this->cachedTail = this->header->tail.load(std::memory_order_acquire);
+			avail = this->cachedTail - head;
+		}
+		if(n > avail) n = avail;
+		if(n == 0) return 0;
+
+		const uint64_t idx = head & this->mask;
+		const uint64_t first = (n < this->_capacity - idx) ? n : this->_capacity - idx;
+		::memcpy(items, this->buffer + idx, first * sizeof(T));
+		if(first < n)
+			::memcpy(items + first, this->buffer, (n - first) * sizeof(T));
+		this->header->head.store(head + n, std::memory_order_release);
+		return n;
+	}
+
+	/** @returns number of elements currently in the buffer */
+	size_t size(void) const {
+		const uint64_t head = this->header->head.load(std::memory_order_acquire);
+		const uint64_t tail = this->header->tail.load(std::memory_order_acquire);
+		return (size_t)(tail - head);
+	}
+
+	/** @returns true if the buffer is empty */
+	bool empty(void) const { return this->size() == 0; }
+
+	/** @returns maximum number of elements in the buffer */
+	size_t capacity(void) const { return (size_t)this->_capacity; }
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void) { return this->shm; }
+};
+
+
+/**
+ * Bounded multi-producer multi-consumer queue in a shared memory segment.
+ * Uses per-slot sequence numbers (Vyukov's bounded MPMC queue), so producers and
+ * consumers only contend on their respective position counter and never take a lock.
+ * All state lives in the segment, any process attaching with the same key can
+ * join as producer, consumer or both.
+ * The element type must be trivially copyable, as elements are copied bytewise.
+ */
+template<typename T>
+class ShmMpmcQueue {
+	static_assert(std::is_trivially_copyable<T>::value, "ShmMpmcQueue requires a trivially copyable type");
+	static_assert(alignof(T) <= IPC_CACHELINE_SIZE, "ShmMpmcQueue element alignment exceeds cache line size");
+private:
+	/** Magic value marking an initialized queue header */
+	static const uint32_t READY_MAGIC = 0x4d504d43;
+
+	/** Single slot of the queue */
+	struct Cell {
+		/** Sequence number of the slot. Equals the position if the slot is free for that position */
+		std::atomic<uint64_t> sequence;
+		T data;
+	};
+
+	/** Header at the beginning of the segment */
+	struct Header {
+		/** Next position to be enqueued */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> enqueuePos;
+		/** Next position to be dequeued */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> dequeuePos;
+		/** Number of slots, always a power of two */
+		alignas(IPC_CACHELINE_SIZE) uint64_t capacity;
+		/** Size of a single element, to detect mismatching peers */
+		uint64_t elementSize;
+		/** Set to READY_MAGIC by the creator once the slots are initialized */
+		std::atomic<uint32_t> ready;
+	};
+
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	/** Segment header */
+	Header *header;
+
+	/** Slots, directly following the header */
+	Cell *cells;
+
+	/** Capacity and index mask of the queue */
+	uint64_t _capacity;
+	uint64_t mask;
+
+	static uint64_t roundCapacity(size_t capacity) {
+		if(capacity < 2) throw IPCException("Queue capacity must be at least 2");
+		uint64_t ret = 1;
+		while(ret < capacity) ret <<= 1;
+		return ret;
+	}
+
+	/** Back off after a failed attempt: spin first, then yield, then sleep briefly */
+	static void backoff(unsigned &round) {
+		if(round < 64) {
+			for(unsigned i = 0; i <= round; i++) ipc_cpu_relax();
+		} else if(round < 128) {
+			sched_yield();
+		} else {
+			struct timespec ts;
+			ts.tv_sec = 0;
+			ts.tv_nsec = 50000;
+			::nanosleep(&ts, NULL);
+		}
+		if(round < 128) round++;
+	}
+
+	ShmMpmcQueue(const ShmMpmcQueue &ref) = delete;
+	ShmMpmcQueue &operator=(const ShmMpmcQueue &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the queue with the given key
+	 * @param key Shared memory key of the queue
+	 * @param capacity Number of elements. Will be rounded up to the next power of two
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created or its layout does not match
+	 */
+	ShmMpmcQueue(int key, size_t capacity, int attr = 0600) :
+			shm(key, sizeof(Header) + roundCapacity(capacity) * sizeof(Cell), attr) {
+		this->header = (Header*)this->shm.get();
+		if(this->header == NULL) throw IPCException("Attaching queue failed");
+		this->cells = (Cell*)((char*)this->header + sizeof(Header));
+		this->_capacity = roundCapacity(capacity);
+		this->mask = this->_capacity - 1;
+
+		if(this->shm.isCreated()) {
+			for(uint64_t i = 0; i < this->_capacity; i++)
+				this->cells[i].sequence.store(i, std::memory_order_relaxed);
+			this->header->capacity = this->_capacity;
+			this->header->elementSize = sizeof(T);
+			this->header->ready.store(READY_MAGIC, std::memory_order_release);
+		} else {
+			// Wait for the creator to initialize the slots
+			this->shm.waitReady(this->header->ready, READY_MAGIC);
+			if(this->header->elementSize != sizeof(T) || this->header->capacity != this->_capacity)
+				throw IPCException("Queue layout mismatch");
+		}
+	}
+
+	virtual ~ShmMpmcQueue() {}
+
+	/**
+	 * Try to enqueue an element without blocking
+	 * @returns true if the element has been enqueued, false if the queue is full
+	 */
+	bool try_push(const T &item) {
+		uint64_t pos = this->header->enqueuePos.load(std::memory_order_relaxed);
+		for(;;) {
+			Cell *cell = &this->cells[pos & this->mask];
+			const uint64_t seq = cell->sequence.load(std::memory_order_acquire);
+			const int64_t diff = (int64_t)seq - (int64_t)pos;
+			if(diff == 0) {
+				if(this->header->enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					::memcpy(&cell->data, &item, sizeof(T));
+					cell->sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if(diff < 0) {
+				return false;		// Full
+			} else
+				pos = this->header->enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Try to dequeue an element without blocking
+	 * @returns true if an element has been dequeued, false if the queue is empty
+	 */
+	bool try_pop(T &item) {
+		uint64_t pos = this->header->dequeuePos.load(std::memory_order_relaxed);
+		for(;;) {
+			Cell *cell = &this->cells[pos & this->mask];
+			const uint64_t seq = cell->sequence.load(std::memory_order_acquire);
+			const int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+			if(diff == 0) {
+				if(this->header->dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					::memcpy(&item, &cell->data, sizeof(T));
+					cell->sequence.store(pos + this->mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if(diff < 0) {
+				return false;		// Empty
+			} else
+				pos = this->header->dequeuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	/** Enqueue an element. Blocks until there is space in the queue */
+	void push(const T &item) {
+		unsigned round = 0;
+		while(!this->try_push(item))
+			backoff(round);
+	}
+
+	/** Dequeue an element. Blocks until an element is available */
+	void pop(T &item) {
+		unsigned round = 0;
+		while(!this->try_pop(item))
+			backoff(round);
+	}
+
+	/** @returns approximate number of elements in the queue */
+	size_t size(void) const {
+		const uint64_t deq = this->header->dequeuePos.load(std::memory_order_acquire);
+		const uint64_t enq = this->header->enqueuePos.load(std::memory_order_acquire);
+		return (enq > deq) ? (size_t)(enq - deq) : 0;
+	}
+
+	/** @returns true if the queue is (approximately) empty */
+	bool empty(void) const { return this->size() == 0; }
+
+	/** @returns maximum number of elements in the queue */
+	size_t capacity(void) const { return (size_t)this->_capacity; }
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void) { return this->shm; }
+};
+
+
+/**
+ * Self-relative pointer for data structures inside shared memory.
+ * Stores the distance between the pointer object and its target instead of an absolute
+ * address, so it remains valid if the segment is mapped at a different address in
+ * every process. The pointer itself must live in the same segment as its target.
+ */
+template<typename T>
+class ShmOffsetPtr {
+private:
+	/** Offset marking a null pointer. An offset of 1 can never point to a valid object */
+	static const ptrdiff_t NULL_OFFSET = 1;
+
+	/** Distance from this object to the target in bytes */
+	ptrdiff_t offset;
+
+	// Offsets are computed on integers, the target is usually not part of the same object
+	void set(const void *ptr) {
+		if(ptr == NULL) this->offset = NULL_OFFSET;
+		else this->offset = (ptrdiff_t)((intptr_t)ptr - (intptr_t)this);
+	}
+
+	/** Type used for arithmetic and references. void pointers behave like char pointers */
+	typedef typename std::conditional<std::is_void<T>::value, char, T>::type object_type;
+
+	/** Byte distance for pointer arithmetic */
+	static ptrdiff_t scale(ptrdiff_t n) {
+		return n * (ptrdiff_t)sizeof(object_type);
+	}
+
+public:
+	typedef T element_type;
+	typedef typename std::conditional<std::is_void<T>::value, char, typename std::remove_cv<T>::type>::type value_type;
+	typedef ptrdiff_t difference_type;
+	typedef T *raw_pointer;
+	typedef typename std::add_lvalue_reference<T>::type reference;
+	typedef ShmOffsetPtr<T> pointer;
+	typedef std::random_access_iterator_tag iterator_category;
+	template<typename U> using rebind = ShmOffsetPtr<U>;
+
+	ShmOffsetPtr() : offset(NULL_OFFSET) {}
+	ShmOffsetPtr(std::nullptr_t) : offset(NULL_OFFSET) {}
+	ShmOffsetPtr(T *ptr) { this->set(ptr); }
+	ShmOffsetPtr(const ShmOffsetPtr &ref) { this->set(ref.get()); }
+	template<typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	ShmOffsetPtr(const ShmOffsetPtr<U> &ref) { this->set(ref.get()); }
+
+	ShmOffsetPtr &operator=(const ShmOffsetPtr &ref) { this->set(ref.get()); return *this; }
+	ShmOffsetPtr &operator=(T *ptr) { this->set(ptr); return *this; }
+
+	/** @returns the absolute address of the target in this process */
+	T *get(void) const {
+		if(this->offset == NULL_OFFSET) return NULL;
+		return (T*)((intptr_t)this + this->offset);
+	}
+
+	reference operator*(void) const { return *this->get(); }
+	T *operator->(void) const { return this->get(); }
+	reference operator[](ptrdiff_t n) const { return *(*this + n); }
+	explicit operator bool(void) const { return this->offset != NULL_OFFSET; }
+	bool operator!(void) const { return this->offset == NULL_OFFSET; }
+
+	/** Required by std::pointer_traits for fancy pointers */
+	static ShmOffsetPtr pointer_to(object_type &ref) { return ShmOffsetPtr(&ref); }
+
+	ShmOffsetPtr &operator+=(ptrdiff_t n) { this->set((char*)this->get() + scale(n)); return *this; }
+	ShmOffsetPtr &operator-=(ptrdiff_t n) { this->set((char*)this->get() - scale(n)); return *this; }
+	ShmOffsetPtr &operator++(void) { return *this += 1; }
+	ShmOffsetPtr &operator--(void) { return *this -= 1; }
+	ShmOffsetPtr operator++(int) { ShmOffsetPtr ret(*this); *this += 1; return ret; }
+	ShmOffsetPtr operator--(int) { ShmOffsetPtr ret(*this); *this -= 1; return ret; }
+	ShmOffsetPtr operator+(ptrdiff_t n) const { ShmOffsetPtr ret(*this); ret += n; return ret; }
+	ShmOffsetPtr operator-(ptrdiff_t n) const { ShmOffsetPtr ret(*this); ret -= n; return ret; }
+	friend ShmOffsetPtr operator+(ptrdiff_t n, const ShmOffsetPtr &ptr) { return ptr + n; }
+	ptrdiff_t operator-(const ShmOffsetPtr &ref) const { return ((char*)this->get() - (char*)ref.get()) / scale(1); }
+
+	bool operator==(const ShmOffsetPtr &ref) const { return this->get() == ref.get(); }
+	bool operator!=(const ShmOffsetPtr &ref) const { return this->get() != ref.get(); }
+	bool operator<(const ShmOffsetPtr &ref) const { return this->get() < ref.get(); }
+	bool operator<=(const ShmOffsetPtr &ref) const { return this->get() <= ref.get(); }
+	bool operator>(const ShmOffsetPtr &ref) const { return this->get() > ref.get(); }
+	bool operator>=(const ShmOffsetPtr &ref) const { return this->get() >= ref.get(); }
+	friend bool operator==(const ShmOffsetPtr &ptr, std::nullptr_t) { return !ptr; }
+	friend bool operator!=(const ShmOffsetPtr &ptr, std::nullptr_t) { return (bool)ptr; }
+};
+
+/**
+ * Heap allocator managing a shared memory segment.
+ * Small blocks are served from power-of-two size class free lists, large blocks from a
+ * first-fit list. All bookkeeping uses offsets relative to the segment and is protected
+ * by a process-shared mutex, so every attached process can allocate and free. If a process
+ * dies while holding it, the next locker truncates damaged free lists and recomputes used().
+ * Large blocks (above 64 KiB) are neither split nor coalesced: a freed large block is reused
+ * whole by any later large request that fits, so workloads mixing many large sizes fragment
+ * the arena. Such data is better kept in segments of its own.
+ * Combined with ShmOffsetPtr and ShmAllocator, STL containers can be placed in the segment
+ * and used by all processes without serialization.
+ */
+class ShmArena {
+public:
+	/** Number of small size classes: 16 bytes up to 64 KiB */
+	static const int SIZE_CLASSES = 13;
+
+	/** Arena bookkeeping at the beginning of the segment */
+	struct Header {
+		/** Protects all bookkeeping */
+		ShmMutex mutex;
+		/** Set to a magic value by the creator once the header is initialized */
+		std::atomic<uint32_t> ready;
+		/** Size of the arena in bytes, including this header */
+		uint64_t size;
+		/** Offset of the first never allocated byte */
+		uint64_t top;
+		/** Number of bytes currently handed out, including block headers */
+		uint64_t used;
+		/** Offset of the first free block per size class, 0 if empty */
+		uint64_t freeLists[SIZE_CLASSES];
+		/** Offset of the first free large block, 0 if empty */
+		uint64_t largeFree;
+		/** Offset of the user-defined root object, 0 if not set */
+		std::atomic<uint64_t> root;
+	};
+
+	/** Allocate the given number of bytes from the arena (16 byte aligned)
+	 * @throws std::bad_alloc if the arena is exhausted */
+	static void *allocate(Header *header, size_t bytes);
+	/** Return a block to the arena */
+	static void deallocate(Header *header, void *ptr);
+
+private:
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	/** Arena header */
+	Header *header;
+
+	ShmArena(const ShmArena &ref) = delete;
+	ShmArena &operator=(const ShmArena &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the arena with the given key
+	 * @param key Shared memory key of the arena
+	 * @param size Size of the arena in bytes
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException on an error
+	 */
+	ShmArena(int key, size_t size, int attr = 0600);
+
+	virtual ~ShmArena();
+
+	/** Allocate the given number of bytes (16 byte aligned)
+	 * @throws std::bad_alloc if the arena is exhausted */
+	void *allocate(size_t bytes);
+	/** Return a block to the arena */
+	void deallocate(void *ptr);
+
+	/** Allocate and construct an object in the arena */
+	template<typename T, typename... Args>
+	T *construct(Args&&... args) {
+		void *mem = this->allocate(sizeof(T));
+		try {
+			return new (mem) T(std::forward<Args>(args)...);
+		} catch (...) {
+			this->deallocate(mem);
+			throw;
+		}
+	}
+
+	/** Destruct an object and return its memory to the arena */
+	template<typename T>
+	void destroy(T *obj) {
+		if(obj == NULL) return;
+		obj->~T();
+		this->deallocate(obj);
+	}
+
+	/** @returns an STL allocator for this arena */
+	template<typename T>
+	ShmAllocator<T> allocator(void) { return ShmAllocator<T>(this->header); }
+
+	/** Set the root object, to make a data structure in the arena findable by other processes */
+	void setRoot(void *ptr);
+	/** @returns the root object, or NULL if not set */
+	void *root(void) const;
+
+	/** @returns size of the arena in bytes */
+	size_t capacity(void) const;
+	/** @returns number of bytes currently allocated, including bookkeeping */
+	size_t used(void) const;
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void);
+};
+
+/**
+ * C++11 allocator for STL containers that live in a ShmArena.
+ * Uses ShmOffsetPtr as pointer type, so a container placed in the arena can be used by
+ * all processes regardless of where they mapped the segment.
+ */
+template<typename T>
+class ShmAllocator {
+private:
+	template<typename U> friend class ShmAllocator;
+
+	/** Arena the memory comes from */
+	ShmOffsetPtr<ShmArena::Header> arena;
+
+public:
+	typedef T value_type;
+	typedef ShmOffsetPtr<T> pointer;
+	typedef ShmOffsetPtr<const T> const_pointer;
+	typedef ShmOffsetPtr<void> void_pointer;
+	typedef ShmOffsetPtr<const void> const_void_pointer;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	template<typename U> struct rebind { typedef ShmAllocator<U> other; };
+
+	explicit ShmAllocator(ShmArena::Header *header) : arena(header) {}
+	ShmAllocator(const ShmAllocator &ref) : arena(ref.arena) {}
+	template<typename U>
+	ShmAllocator(const ShmAllocator<U> &ref) : arena(ref.arena) {}
+	ShmAllocator &operator=(const ShmAllocator &ref) { this->arena = ref.arena; return *this; }
+
+	/** @returns the largest number of elements that could fit into the arena */
+	size_type max_size(void) const { return (size_type)(this->arena->size / sizeof(T)); }
+
+	/** @throws std::bad_alloc if n elements exceed max_size() or the arena is exhausted */
+	pointer allocate(size_t n) {
+		if(n > this->max_size()) throw std::bad_alloc();
+		return pointer((T*)ShmArena::allocate(this->arena.get(), n * sizeof(T)));
+	}
+
+	void deallocate(pointer ptr, size_t) {
+		ShmArena::deallocate(this->arena.get(), ptr.get());
+	}
+
+	template<typename U>
+	bool operator==(const ShmAllocator<U> &ref) const { return this->arena.get() == ref.arena.get(); }
+	template<typename U>
+	bool operator!=(const ShmAllocator<U> &ref) const { return this->arena.get() != ref.arena.get(); }
+};
+
+
+/**
+ * Sequence-locked value for a single writer and any number of readers.
+ * The writer makes the sequence odd while it updates the value. Readers copy the value
+ * optimistically and retry if the sequence was odd or changed, so they never write to
+ * shared memory and never block the writer. Zero-initialized memory is a valid slot.
+ */
+template<typename T>
+struct ShmSeqlockSlot {
+	static_assert(std::is_trivially_copyable<T>::value, "ShmSeqlockSlot requires a trivially copyable type");
+
+	/** Sequence counter. Odd while a write is in progress */
+	alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> sequence;
+	/** Protected value */
+	T value;
+
+	/** Publish a new value. Must only be called by the single writer */
+	void write(const T &item) {
+		const uint64_t seq = this->sequence.load(std::memory_order_relaxed);
+		this->sequence.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		::memcpy((void*)&this->value, &item, sizeof(T));
+		this->sequence.store(seq + 2, std::memory_order_release);
+	}
+
+	/**
+	 * Try to read a consistent copy of the value once
+	 * @returns true if the copy is consistent, false if it was torn by a concurrent write
+	 */
+	bool try_read(T &item) const {
+		const uint64_t seq = this->sequence.load(std::memory_order_acquire);
+		if(seq & 1) return false;
+		::memcpy(&item, (const void*)&this->value, sizeof(T));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return this->sequence.load(std::memory_order_relaxed) == seq;
+	}
+
+	/** Read a consistent copy of the value, retrying as long as it is torn */
+	void read(T &item) const {
+		while(!this->try_read(item))
+			ipc_cpu_relax();
+	}
+};
+
+/**
+ * Single-writer snapshot publisher in a shared memory segment.
+ * One process publishes snapshots with write(), any number of processes read them
+ * with read(). Readers never write shared cache lines and never block the writer,
+ * a reader only retries if a write happened during its copy.
+ */
+template<typename T>
+class ShmSeqlock {
+	static_assert(std::is_trivially_copyable<T>::value, "ShmSeqlock requires a trivially copyable type");
+private:
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	/** Sequence-locked value */
+	ShmSeqlockSlot<T> *slot;
+
+	ShmSeqlock(const ShmSeqlock &ref) = delete;
+	ShmSeqlock &operator=(const ShmSeqlock &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the snapshot with the given key. The initial value is zero-filled
+	 * @param key Shared memory key
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created
+	 */
+	ShmSeqlock(int key, int attr = 0600) : shm(key, sizeof(ShmSeqlockSlot<T>), attr) {
+		this->slot = (ShmSeqlockSlot<T>*)this->shm.get();
+		if(this->slot == NULL) throw IPCException("Attaching seqlock failed");
+	}
+
+	virtual ~ShmSeqlock() {}
+
+	/** Publish a new snapshot. Must only be called by the single writer process */
+	void write(const T &value) { this->slot->write(value); }
+
+	/** @returns a consistent copy of the current snapshot */
+	T read(void) const {
+		T ret;
+		this->slot->read(ret);
+		return ret;
+	}
+
+	/** Read a consistent copy of the current snapshot into the given value */
+	void read(T &value) const { this->slot->read(value); }
+
+	/**
+	 * Try to read the current snapshot once, without retrying
+	 * @returns true if the copy is consistent
+	 */
+	bool try_read(T &value) const { return this->slot->try_read(value); }
+
+	/** @returns the sequence number of the current snapshot. Increases by 2 per write */
+	uint64_t sequence(void) const { return this->slot->sequence.load(std::memory_order_acquire); }
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void) { return this->shm; }
+};
+
+/**
+ * Double-buffered variant of ShmSeqlock for large snapshots.
+ * The writer fills the inactive buffer and then flips the active index, so a reader
+ * copying the active buffer is only disturbed if the writer laps it with two writes.
+ * This keeps the retry rate low even if copying the snapshot takes long.
+ */
+template<typename T>
+class ShmDoubleBuffer {
+	static_assert(std::is_trivially_copyable<T>::value, "ShmDoubleBuffer requires a trivially copyable type");
+private:
+	/** Layout of the segment */
+	struct Layout {
+		/** Index of the buffer holding the latest snapshot */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint32_t> active;
+		/** The two buffers */
+		ShmSeqlockSlot<T> buffers[2];
+	};
+
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	/** Segment layout */
+	Layout *layout;
+
+	ShmDoubleBuffer(const ShmDoubleBuffer &ref) = delete;
+	ShmDoubleBuffer &operator=(const ShmDoubleBuffer &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the snapshot with the given key. The initial value is zero-filled
+	 * @param key Shared memory key
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created
+	 */
+	ShmDoubleBuffer(int key, int attr = 0600) : shm(key, sizeof(Layout), attr) {
+		this->layout = (Layout*)this->shm.get();
+		if(this->layout == NULL) throw IPCException("Attaching double buffer failed");
+	}
+
+	virtual ~ShmDoubleBuffer() {}
+
+	/** Publish a new snapshot. Must only be called by the single writer process */
+	void write(const T &value) {
+		const uint32_t next = this->layout->active.load(std::memory_order_relaxed) ^ 1;
+		this->layout->buffers[next].write(value);
+		this->layout->active.store(next, std::memory_order_release);
+	}
+
+	/** Read a consistent copy of the current snapshot into the given value */
+	void read(T &value) const {
+		for(;;) {
+			const uint32_t current = this->layout->active.load(std::memory_order_acquire);
+			if(this->layout->buffers[current].try_read(value)) return;
+			ipc_cpu_relax();
+		}
+	}
+
+	/** @returns a consistent copy of the current snapshot */
+	T read(void) const {
+		T ret;
+		this->read(ret);
+		return ret;
+	}
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void) { return this->shm; }
+};
+
+
+/** Behaviour of a ShmBroadcast channel when the producer catches up with the slowest consumer */
+enum ShmBroadcastMode {
+	/** The producer waits until all consumers have released the oldest records */
+	SHM_BROADCAST_BACKPRESSURE,
+	/** The producer overwrites the oldest records, consumers that fall behind skip ahead */
+	SHM_BROADCAST_OVERWRITE
+};
+
+/**
+ * Broadcast channel of variable-length records from one producer to many consumers.
+ * The producer claims space directly in the segment, writes the record in place and
+ * commits it. Each consumer subscribes to a cursor slot in the segment header and reads
+ * records in place at its own pace, so a record is written once no matter how many
+ * consumers read it.
+ *
+ * In overwrite mode a record can be overwritten while a consumer looks at it. release()
+ * then returns false and the data obtained from peek() must be discarded.
+ */
+class ShmBroadcast {
+private:
+	/** Channel header at the beginning of the segment */
+	struct Header {
+		/** End of the last claimed record. Written by the producer before writing into the buffer */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> claimPos;
+		/** End of the last committed record. Consumers read up to this position */
+		std::atomic<uint64_t> writePos;
+		/** Rung by the producer on every commit */
+		alignas(IPC_CACHELINE_SIZE) Doorbell dataBell;
+		/** Rung by consumers when the producer waits for space */
+		Doorbell spaceBell;
+		/** Set while the producer waits for space */
+		std::atomic<uint32_t> producerBlocked;
+		/** Size of the record buffer in bytes, always a power of two */
+		alignas(IPC_CACHELINE_SIZE) uint64_t capacity;
+		/** Number of consumer slots */
+		uint32_t maxConsumers;
+		/** ShmBroadcastMode of the channel */
+		uint32_t mode;
+		/** Set to a magic value by the creator once the header is initialized */
+		std::atomic<uint32_t> ready;
+	};
+
+	/** Cursor slot of a consumer, one cache line each */
+	struct Consumer {
+		/** Position of the next record to be read */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> cursor;
+		/** Number of times the consumer has been overrun (overwrite mode) */
+		std::atomic<uint64_t> overruns;
+		/** 0 if the slot is free, 2 while subscribing (blocks the producer), 1 if in use */
+		std::atomic<uint32_t> active;
+	};
+
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	/** Channel header */
+	Header *header;
+	/** Consumer slots, directly following the header */
+	Consumer *slots;
+	/** Record buffer, directly following the consumer slots */
+	char *buffer;
+
+	uint64_t _capacity;
+	uint64_t mask;
+	bool overwrite;
+
+	/** Producer-local lower bound of all consumer cursors */
+	uint64_t cachedMin;
+	/** Producer-local end of the pending claim, 0 if there is none */
+	uint64_t pendingEnd;
+
+	/** @returns the slot of the given consumer
+	  * @throws IPCException if the consumer id is invalid */
+	Consumer &consumer(int id) const;
+	/** @returns the smallest cursor of all active consumers, or pos if there are none */
+	uint64_t minCursor(uint64_t pos) const;
+	/** @returns true if the record at the given position may have been overwritten */
+	bool lapped(uint64_t pos) const;
+	/** Skip an overrun consumer to the newest committed position */
+	uint64_t resync(Consumer &c) const;
+
+	ShmBroadcast(const ShmBroadcast &ref) = delete;
+	ShmBroadcast &operator=(const ShmBroadcast &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the channel with the given key
+	 * @param key Shared memory key of the channel
+	 * @param capacity Size of the record buffer in bytes. Will be rounded up to the next power of two
+	 * @param maxConsumers Maximum number of simultaneously subscribed consumers
+	 * @param mode Behaviour when the buffer is full
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created or its layout does not match
+	 */
+	ShmBroadcast(int key, size_t capacity, int maxConsumers, ShmBroadcastMode mode = SHM_BROADCAST_BACKPRESSURE, int attr = 0600);
+
+	virtual ~ShmBroadcast();
+
+	/**
+	 * Claim space for a record without blocking. Must only be called by the producer
+	 * @param length Length of the record in bytes
+	 * @returns pointer to write the record to, or NULL if the buffer is full (back-pressure mode)
+	 * @throws IPCException if the record is larger than maxRecordSize() or a claim is already pending
+	 */
+	void *try_claim(size_t length);
+
+	/**
+	 * Claim space for a record, waiting for consumers if the buffer is full. Must only be called by the producer
+	 * @param length Length of the record in bytes
+	 * @returns pointer to write the record to
+	 * @throws IPCException if the record is larger than maxRecordSize() or a claim is already pending
+	 */
+	void *claim(size_t length);
+
+	/** Publish the claimed record to the consumers */
+	void commit(void);
+
+	/**
+	 * Copy a record into the channel without blocking
+	 * @returns true if the record has been published, false if the buffer is full
+	 */
+	bool try_publish(const void *data, size_t length);
+
+	/** Copy a record into the channel, waiting for consumers if the buffer is full */
+	void publish(const void *data, size_t length);
+
+	/**
+	 * Subscribe as consumer. The consumer starts reading at the next record published
+	 * @returns consumer id for peek() and release()
+	 * @throws IPCException if all consumer slots are taken
+	 */
+	int subscribe(void);
+
+	/** Free the slot of the given consumer, so that it no longer holds back the producer */
+	void unsubscribe(int consumer);
+
+	/**
+	 * Get the next record of the consumer without consuming it
+	 * @param consumer Consumer id returned by subscribe()
+	 * @param length Set to the length of the record
+	 * @returns pointer to the record in the segment, or NULL if there is no new record
+	 */
+	const void *peek(int consumer, size_t &length);
+
+	/**
+	 * Consume the record returned by the last successful peek()
+	 * @returns true if the record has been consumed, false if it has been overwritten while
+	 *          it was read (overwrite mode). The consumer then continues with the newest records
+	 */
+	bool release(int consumer);
+
+	/**
+	 * Wait until there is a new record for the given consumer
+	 * @param timeout_us Timeout in microseconds, negative to wait forever
+	 * @returns true if a record is available, false if the timeout expired
+	 */
+	bool wait(int consumer, long timeout_us = -1);
+
+	/** @returns number of bytes the consumer is behind the producer */
+	size_t lag(int consumer) const;
+	/** @returns number of times the consumer has been overrun and skipped records */
+	uint64_t overruns(int consumer) const;
+
+	/** @returns size of the record buffer in bytes */
+	size_t capacity(void) const;
+	/** @returns maximum length of a single record */
+	size_t maxRecordSize(void) const;
+	/** @returns number of consumer slots */
+	int maxConsumers(void) const;
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void);
+};
+
+
+/**
+ * Pool of forked worker processes executing parallel loops over index ranges.
+ * Each process owns a Chase-Lev work-stealing deque in a private shared memory segment.
+ * Ranges are split lazily: a process keeps the lower half of its range and pushes the upper
+ * half to its deque, idle processes steal the oldest (largest) ranges of others. The calling
+ * process takes part in every loop as worker 0.
+ *
+ * Loop bodies are passed as plain function pointers, which stay valid in the workers because
+ * they are forked from the caller. For the same reason arguments must point to memory that
+ * existed when the pool was created: private memory is read-only for the loop (copy-on-write),
+ * results must go to shared memory attached before the pool was created. Loops must not be nested.
+ */
+class ShmProcessPool {
+public:
+	/** Loop body of parallel_for, called for the index range [begin, end) */
+	typedef void (*ForFunction)(size_t begin, size_t end, void *arg);
+
+	/** Number of ranges a deque can hold. Ranges that don't fit are not split any further */
+	static const int DEQUE_CAPACITY = 256;
+	/** Maximum size of a parallel_reduce value */
+	static const size_t MAX_VALUE_SIZE = 48;
+
+private:
+	/** A range of indices of the job with the given epoch */
+	struct Item {
+		std::atomic<uint64_t> begin;
+		std::atomic<uint64_t> end;
+		std::atomic<uint64_t> epoch;
+	};
+
+	/** Plain copy of an Item */
+	struct Range {
+		uint64_t begin;
+		uint64_t end;
+		uint64_t epoch;
+	};
+
+	struct Job;
+	/** Type-erased loop body: executes the range and accumulates into the partial result */
+	typedef void (*RunFunction)(const Job &job, size_t begin, size_t end, void *partial);
+
+	/** Description of the current loop, written by the caller before publishing the epoch */
+	struct Job {
+		RunFunction run;
+		void (*fn)(void);
+		void (*combine)(void);
+		void *arg;
+		uint64_t grain;
+	};
+
+	/** Deque of a worker. Top and bottom on separate cache lines */
+	struct Worker {
+		/** Steal end, advanced by thieves */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<int64_t> top;
+		/** Owner end */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<int64_t> bottom;
+		/** Partial result of parallel_reduce, written by the owner only */
+		alignas(IPC_CACHELINE_SIZE) unsigned char partial[MAX_VALUE_SIZE];
+	};
+
+	/** Pool header at the beginning of the segment */
+	struct Header {
+		/** Epoch of the current job */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> epoch;
+		/** Set to stop the workers */
+		std::atomic<uint32_t> shutdown;
+		/** Set if a loop body has thrown an exception */
+		std::atomic<uint32_t> failed;
+		/** Number of indices of the current job that have not been executed yet */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> remaining;
+		/** Rung when new ranges are available to sleeping processes and when a job completes */
+		alignas(IPC_CACHELINE_SIZE) Doorbell bell;
+		/** Number of processes sleeping on the bell */
+		std::atomic<uint32_t> sleepers;
+		/** Current job */
+		alignas(IPC_CACHELINE_SIZE) Job job;
+	};
+
+	/** Underlying private shared memory segment, inherited by the workers */
+	SharedMemory shm;
+
+	Header *header;
+	Worker *workers;
+	/** Deque storage, DEQUE_CAPACITY items per worker */
+	Item *items;
+
+	int _processes;
+	/** Process ids of the forked workers */
+	std::vector<pid_t> children;
+	/** Process-local state of the random victim selection */
+	uint64_t seed;
+	/** Set once a worker died, the pool cannot be used any more */
+	bool broken;
+
+	/** Push a range to the deque of the given worker. Owner only */
+	bool push(int self, const Range &range);
+	/** Pop the newest range of the given worker. Owner only */
+	bool pop(int self, Range &range);
+	/** Steal the oldest range of the given worker */
+	bool steal(int victim, Range &range);
+	/** @returns true if any deque holds a range */
+	bool hasWork(void) const;
+	/** Split and execute a range */
+	void execute(int self, Range range);
+	/** Worker loop. Worker 0 returns when the current job is done, the others on shutdown */
+	void work(int self);
+	/** Publish a job and take part in it until it is done */
+	void run(size_t begin, size_t end, size_t grain);
+	/** Throw if a worker process has died */
+	void checkWorkers(void);
+
+	template<typename T>
+	static void runReduce(const Job &job, size_t begin, size_t end, void *partial) {
+		T (*fn)(size_t, size_t, void*) = (T (*)(size_t, size_t, void*))job.fn;
+		T (*combine)(T, T) = (T (*)(T, T))job.combine;
+		const T value = fn(begin, end, job.arg);
+		T acc;
+		::memcpy(&acc, partial, sizeof(T));
+		acc = combine(acc, value);
+		::memcpy(partial, &acc, sizeof(T));
+	}
+
+	ShmProcessPool(const ShmProcessPool &ref) = delete;
+	ShmProcessPool &operator=(const ShmProcessPool &ref) = delete;
+
+public:
+	/**
+	 * Create the pool and fork the worker processes
+	 * @param processes Number of processes including the calling one. 0 uses one process per online CPU
+	 * @throws IPCException if the segment cannot be created or forking fails
+	 */
+	explicit ShmProcessPool(int processes = 0);
+
+	/** Shuts the pool down */
+	virtual ~ShmProcessPool();
+
+	/**
+	 * Execute fn for all indices in [begin, end), in ranges of at least grain indices
+	 * @throws IPCException if a loop body has thrown or a worker process died
+	 */
+	void parallel_for(size_t begin, size_t end, size_t grain, ForFunction fn, void *arg = NULL);
+
+	/**
+	 * Reduce over all indices in [begin, end). fn computes the value of a range, combine merges two values.
+	 * combine must be associative and commutative, identity must be its neutral element: ranges are
+	 * stolen in any order, so each process folds the ranges it ran in no particular index order.
+	 * Floating-point sums may therefore differ in the last bits from run to run
+	 * @throws IPCException if a loop body has thrown or a worker process died
+	 */
+	template<typename T>
+	T parallel_reduce(size_t begin, size_t end, size_t grain, T identity, T (*fn)(size_t begin, size_t end, void *arg), T (*combine)(T a, T b), void *arg = NULL) {
+		static_assert(std::is_trivially_copyable<T>::value, "parallel_reduce requires a trivially copyable type");
+		static_assert(sizeof(T) <= MAX_VALUE_SIZE, "parallel_reduce value exceeds MAX_VALUE_SIZE");
+		for(int i = 0; i < this->_processes; i++)
+			::memcpy(this->workers[i].partial, &identity, sizeof(T));
+		this->header->job.run = &ShmProcessPool::runReduce<T>;
+		this->header->job.fn = (void (*)(void))fn;
+		this->header->job.combine = (void (*)(void))combine;
+		this->header->job.arg = arg;
+		this->run(begin, end, grain);
+		T ret = identity;
+		for(int i = 0; i < this->_processes; i++) {
+			T value;
+			::memcpy(&value, this->workers[i].partial, sizeof(T));
+			ret = combine(ret, value);
+		}
+		return ret;
+	}
+
+	/** Stop and reap the worker processes. Called by the destructor */
+	void shutdown(void);
+
+	/** @returns number of processes including the calling one */
+	int processes(void) const;
+};
+
+
+/**
+ * Reusable barrier for a fixed number of processes in a shared memory segment.
+ * Arrivals are combined in a tree with fan-in FANIN, so each arrival touches only the
+ * cache line of its tree node and contention stays constant with the number of processes.
+ * The last process to arrive at the root flips the global sense, which releases everybody.
+ * Waiters spin for a while on the sense and then sleep on it as futex.
+ */
+class ShmBarrier {
+public:
+	/** Number of children per tree node */
+	static const int FANIN = 4;
+
+private:
+	/** Barrier header at the beginning of the segment */
+	struct Header {
+		/** Set to a magic value by the creator once the tree is initialized */
+		std::atomic<uint32_t> ready;
+		/** Number of participating processes */
+		uint32_t participants;
+		/** Number of tree nodes */
+		uint32_t nodes;
+		/** Source of automatically assigned participant ids */
+		std::atomic<uint32_t> joined;
+		/** Global sense, flipped once per round. Also the futex word waiters sleep on */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint32_t> sense;
+		/** Number of processes sleeping on the sense */
+		std::atomic<uint32_t> waiters;
+	};
+
+	/** Tree node, one cache line each */
+	struct Node {
+		/** Number of children that arrived in the current round */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint32_t> count;
+		/** Number of children of the node */
+		uint32_t expected;
+		/** Index of the parent node, or -1 for the root */
+		int32_t parent;
+	};
+
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	Header *header;
+	Node *nodes;
+
+	/** Participant id of this process */
+	int _id;
+	/** Sense of the round this process waits for */
+	uint32_t localSense;
+
+	ShmBarrier(const ShmBarrier &ref) = delete;
+	ShmBarrier &operator=(const ShmBarrier &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the barrier with the given key
+	 * @param key Shared memory key of the barrier
+	 * @param participants Number of processes that wait on the barrier
+	 * @param id Participant id in [0, participants), or -1 to assign ids in the order processes attach
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created or its layout does not match
+	 */
+	ShmBarrier(int key, int participants, int id = -1, int attr = 0600);
+
+	virtual ~ShmBarrier();
+
+	/** Arrive at the barrier and wait until all participants have arrived */
+	void wait(void);
+
+	/** @returns participant id of this process */
+	int id(void) const;
+	/** @returns number of participating processes */
+	int participants(void) const;
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void);
+};
+
+
+/**
+ * Reader-writer lock in a shared memory segment, optimized for rare writes.
+ * Readers register in one of several cache-line-padded counters, chosen per thread by the
+ * CPU it first ran on, so concurrent readers do not write to a common cache line. A writer
+ * first takes the writer word, which turns new readers away (writer priority), and then
+ * waits for all reader counters to drain. Blocked readers and writers sleep on futexes.
+ * The lock is not recursive: a reader locking again while a writer waits deadlocks.
+ *
+ * The writer word holds the pid of the writer, like ShmMutex. Sleeping readers and writers
+ * check whether it is still alive; if it died, a waiting writer takes the lock over and
+ * lock() returns EOWNERDEAD, a waiting reader frees it. The data is marked as possibly
+ * inconsistent until the next writer unlocks, lock_shared() returns EOWNERDEAD meanwhile.
+ * The reader counters are anonymous and not covered: a process dying while holding a
+ * shared lock makes writers wait for good.
+ */
+class ShmRWLock {
+private:
+	/** Lock header at the beginning of the segment */
+	struct Header {
+		/** Set to a magic value by the creator once the header is initialized */
+		std::atomic<uint32_t> ready;
+		/** Number of reader slots */
+		uint32_t slots;
+		/** Writer state: 0 free, otherwise pid of the writer holding or draining the lock, with SHM_MUTEX_WAITERS if there may be sleepers. Futex word */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint32_t> writer;
+		/** Set if a writer died while holding the lock, until the next writer unlocks */
+		std::atomic<uint32_t> died;
+		/** Start time of the writer process (clock ticks since boot), 0 if unknown */
+		std::atomic<uint64_t> ownerStart;
+		/** Rung by readers leaving while a writer drains the reader slots */
+		alignas(IPC_CACHELINE_SIZE) Doorbell drained;
+	};
+
+	/** Reader counter, one cache line each */
+	struct Slot {
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint32_t> readers;
+	};
+
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	Header *header;
+	Slot *slots;
+
+	/** @returns the reader slot of the calling thread */
+	Slot &slot(void) const;
+	/** Wait until no writer holds or waits for the lock */
+	void waitWriter(void);
+	/**
+	 * Sleep until the writer word is free and take it if exclusive is set. Frees or, if
+	 * exclusive is set, takes over the word if its owner died
+	 */
+	void wait(bool exclusive);
+	/** Free the writer word and wake up all sleepers, without resetting the dead-owner state */
+	void release(void);
+	/** Wait until all reader slots are empty */
+	void drain(void);
+
+	ShmRWLock(const ShmRWLock &ref) = delete;
+	ShmRWLock &operator=(const ShmRWLock &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the lock with the given key
+	 * @param key Shared memory key of the lock
+	 * @param slots Number of reader slots. 0 uses one slot per online CPU
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created or its layout does not match
+	 */
+	ShmRWLock(int key, int slots = 0, int attr = 0600);
+
+	virtual ~ShmRWLock();
+
+	/**
+	 * Lock exclusively. Blocks new readers and waits until the current readers have left
+	 * @returns 0, or EOWNERDEAD if a previous writer died while holding the lock
+	 */
+	int lock(void);
+	/**
+	 * Tries to lock exclusively without blocking. Check ownerDied() after success
+	 * @returns true if the lock has been acquired
+	 */
+	bool try_lock(void);
+	/** Unlock the exclusive lock, clear the dead-owner state and wake up all blocked readers and writers */
+	void unlock(void);
+
+	/**
+	 * Lock shared. Blocks while a writer holds or waits for the lock
+	 * @returns 0, or EOWNERDEAD if a writer died while holding the lock and no writer has unlocked since
+	 */
+	int lock_shared(void);
+	/**
+	 * Tries to lock shared without blocking
+	 * @returns true if the lock has been acquired
+	 */
+	bool try_lock_shared(void);
+	/** Unlock a shared lock */
+	void unlock_shared(void);
+
+	/**
+	 * @returns true if a writer died while holding the lock and no writer has unlocked since,
+	 * i.e. the protected state may be inconsistent
+	 */
+	bool ownerDied(void) const;
+
+	/** @returns number of reader slots */
+	int slotCount(void) const;
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void);
+};
+
+
+/**
+ * Set of counters and gauges in a shared memory segment, sharded per CPU.
+ * Each shard holds all values of the set on cache lines of its own, and updates are
+ * relaxed atomic adds to the shard of the CPU the caller runs on, so processes counting
+ * in parallel do not share cache lines and the hot path scales with the number of CPUs.
+ * Readers sum up the shards. Counters only grow and can be reset, gauges are signed
+ * levels (e.g. requests in flight) that are adjusted up and down and never reset.
+ */
+class ShmCounterSet {
+public:
+	/** Summed up values of all shards */
+	struct Snapshot {
+		std::vector<uint64_t> counters;
+		std::vector<int64_t> gauges;
+	};
+
+private:
+	/** Set header at the beginning of the segment */
+	struct Header {
+		/** Set to a magic value by the creator once the header is initialized */
+		std::atomic<uint32_t> ready;
+		uint32_t counters;
+		uint32_t gauges;
+		uint32_t shards;
+	};
+
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	Header *header;
+	/** Values of shard s start at values + s * stride. Counters first, then gauges */
+	std::atomic<uint64_t> *values;
+	size_t stride;
+
+	int _counters;
+	int _gauges;
+	int _shards;
+
+	/** @returns values of the shard of the CPU the caller runs on */
+	std::atomic<uint64_t> *shard(void) const;
+
+	ShmCounterSet(const ShmCounterSet &ref) = delete;
+	ShmCounterSet &operator=(const ShmCounterSet &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the set with the given key
+	 * @param key Shared memory key of the set
+	 * @param counters Number of counters
+	 * @param gauges Number of gauges
+	 * @param shards Number of shards. 0 uses one shard per CPU
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created or its layout does not match
+	 */
+	ShmCounterSet(int key, int counters, int gauges = 0, int shards = 0, int attr = 0600);
+
+	virtual ~ShmCounterSet();
+
+	/** Add n to a counter */
+	void count(int counter, uint64_t n = 1);
+
+	/** Add delta to a gauge, which may be negative */
+	void adjust(int gauge, int64_t delta);
+
+	/** @returns current value of a counter, summed over all shards */
+	uint64_t counter(int counter) const;
+
+	/** @returns current value of a gauge, summed over all shards */
+	int64_t gauge(int gauge) const;
+
+	/**
+	 * Read all counters and gauges. The shards are read one after the other, so values
+	 * updated meanwhile may be included or not, but none is lost or counted twice
+	 * @param reset If true, the counters are set to zero in the same pass (gauges are kept)
+	 */
+	void snapshot(Snapshot &snapshot, bool reset = false);
+
+	/** @returns all counters and gauges, see snapshot(Snapshot&, bool) */
+	Snapshot snapshot(void);
+
+	/** Set all counters to zero. Gauges are kept */
+	void reset(void);
+
+	int counters(void) const;
+	int gauges(void) const;
+	int shards(void) const;
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void);
+};
+
+
+/**
+ * Growable vector in chained shared memory segments.
+ * The segment with the given key holds a directory of chunk segments (IPC_PRIVATE), each
+ * holding a fixed power-of-two number of elements. Growing appends chunks to the directory,
+ * so existing elements are never copied or moved and the vector can exceed maxSize().
+ * Indexing is O(1): the chunk is looked up in a per-instance table, and chunks published by
+ * other processes are attached on first access.
+ * Growth is serialized by the mutex of the directory segment, readers never lock. An instance
+ * must not be used by several threads at once.
+ * The directory counts the attached instances. The last one to be destroyed deletes all chunks
+ * and the directory, no matter which process created them. A process that dies without
+ * destroying its instance keeps its count, so the segments then stay until destroy() is called.
+ * The element type must be trivially copyable, new elements are zero-initialised.
+ */
+template<typename T>
+class ShmVector {
+	static_assert(std::is_trivially_copyable<T>::value, "ShmVector requires a trivially copyable type");
+	static_assert(alignof(T) <= IPC_SHM_HEADER_SIZE, "ShmVector type alignment exceeds the segment data alignment");
+	static_assert(sizeof(T) > 0, "ShmVector requires a complete type");
+private:
+	/** Magic value marking an initialized directory */
+	static const uint32_t READY_MAGIC = 0x53564543;
+
+	/** Default chunk size in bytes, if no number of elements per chunk is given */
+	static const size_t DEFAULT_CHUNK_BYTES = 1 << 20;
+
+	/** Directory header at the beginning of the segment, followed by maxChunks chunk ids */
+	struct Header {
+		/** Set to READY_MAGIC by the creator once the header is initialized */
+		std::atomic<uint32_t> ready;
+		/** Size of a single element, to detect mismatching peers */
+		uint32_t elementSize;
+		/** Number of elements per chunk, always a power of two */
+		uint64_t chunkElements;
+		/** Maximum number of chunks in the directory */
+		uint64_t maxChunks;
+		/** Number of attached instances. Changed under the directory lock */
+		uint32_t users;
+		/** Set once the chunks are deleted, attaching fails afterwards */
+		uint32_t destroyed;
+		/** Number of elements. Written with release after the elements */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> size;
+		/** Number of published chunks. Written with release after the chunk id */
+		std::atomic<uint64_t> chunks;
+	};
+
+	/** Directory segment */
+	SharedMemory shm;
+
+	Header *header;
+	std::atomic<int32_t> *ids;
+
+	/** log2 of the elements per chunk and the index mask within a chunk */
+	unsigned shift;
+	uint64_t mask;
+	uint64_t _maxChunks;
+	/** Attributes for new chunk segments */
+	int _attr;
+
+	/** Data pointer per chunk, NULL until the chunk is attached by this instance */
+	std::vector<T*> chunkData;
+	/** Chunk segments attached or created by this instance */
+	std::vector<SharedMemory*> segments;
+
+	static uint64_t roundChunk(size_t elements) {
+		if(elements == 0) {
+			elements = DEFAULT_CHUNK_BYTES / sizeof(T);
+			if(elements == 0) elements = 1;
+		}
+		uint64_t ret = 1;
+		while(ret < elements) ret <<= 1;
+		if(ret > (uint64_t)(((size_t)-1) / sizeof(T))) throw IPCException("ShmVector chunk size overflow");
+		return ret;
+	}
+
+	static size_t directorySize(size_t maxChunks) {
+		if(maxChunks == 0) throw IPCException("ShmVector needs at least one chunk");
+		return sizeof(Header) + maxChunks * sizeof(std::atomic<int32_t>);
+	}
+
+	size_t chunkBytes(void) const { return (size_t)(this->mask + 1) * sizeof(T); }
+
+	/** Attach chunk c, which must have been published. Slow path of element access */
+	T *attachChunk(uint64_t c) {
+		if(c >= this->header->chunks.load(std::memory_order_acquire))
+			throw IPCException("ShmVector index out of range");
+		const int id = this->ids[c].load(std::memory_order_acquire);
+		SharedMemory *chunk = SharedMemory::attachNew(id, this->chunkBytes());
+		if(!chunk->isAttached()) {
+			delete chunk;
+			throw IPCException("Attaching ShmVector chunk failed");
+		}
+		this->segments.push_back(chunk);
+		this->chunkData[c] = (T*)chunk->get();
+		return this->chunkData[c];
+	}
+
+	/** Append chunks until n elements fit. Must be called with the directory lock held */
+	void grow(size_t n) {
+		uint64_t chunks = this->header->chunks.load(std::memory_order_relaxed);
+		while((chunks << this->shift) < n) {
+			if(chunks >= this->_maxChunks) throw IPCException("ShmVector capacity exceeded");
+			SharedMemory *chunk = new SharedMemory(IPC_PRIVATE, this->chunkBytes(), this->_attr);
+			// Chunks outlive the process that created them, the last user deletes them
+			chunk->setDeleteOnDispose(false);
+			this->segments.push_back(chunk);
+			this->chunkData[chunks] = (T*)chunk->get();
+			this->ids[chunks].store(chunk->id(), std::memory_order_release);
+			this->header->chunks.store(++chunks, std::memory_order_release);
+		}
+	}
+
+	/** Detach all chunks of this instance. With remove, all published chunks are deleted */
+	void release(bool remove) {
+		if(remove) {
+			// Attach the chunks this instance has not seen yet, so that all of them are deleted
+			const uint64_t chunks = this->header->chunks.load(std::memory_order_acquire);
+			for(uint64_t c = 0; c < chunks; c++) {
+				try {
+					this->chunk(c);
+				} catch (...) {
+					// Already removed by someone else
+				}
+			}
+		}
+		for(size_t i = 0; i < this->segments.size(); i++) {
+			if(remove) this->segments[i]->setDeleteOnDispose(true);
+			delete this->segments[i];
+		}
+		this->segments.clear();
+		this->chunkData.assign(this->chunkData.size(), (T*)NULL);
+	}
+
+	/** Zero elements [from, to), which may hold stale values after shrinking */
+	void zero(uint64_t from, uint64_t to) {
+		while(from < to) {
+			const uint64_t offset = from & this->mask;
+			uint64_t n = this->mask + 1 - offset;
+			if(n > to - from) n = to - from;
+			::memset((void*)(this->chunk(from >> this->shift) + offset), 0, (size_t)n * sizeof(T));
+			from += n;
+		}
+	}
+
+	/** @returns data of chunk c, attaching it if necessary */
+	T *chunk(uint64_t c) {
+		T *data = this->chunkData[c];
+		if(data == NULL) data = this->attachChunk(c);
+		return data;
+	}
+
+	ShmVector(const ShmVector &ref) = delete;
+	ShmVector &operator=(const ShmVector &ref) = delete;
+
+public:
+	typedef T value_type;
+
+	/**
+	 * Create or attach to the vector with the given key
+	 * @param key Shared memory key of the directory
+	 * @param chunkElements Number of elements per chunk, rounded up to a power of two. 0 uses chunks of about 1 MiB
+	 * @param maxChunks Maximum number of chunks, which bounds the capacity to maxChunks * chunkElements
+	 * @param attr Attributes of the shared memory segments. Default value is 0600
+	 * @throws IPCException if the segment cannot be created or its layout does not match
+	 */
+	ShmVector(int key, size_t chunkElements = 0, size_t maxChunks = 4096, int attr = 0600) :
+			shm(key, directorySize(maxChunks), attr) {
+		static_assert(sizeof(Header) % alignof(std::atomic<int32_t>) == 0, "ShmVector directory misaligned");
+		this->header = (Header*)this->shm.get();
+		if(this->header == NULL) throw IPCException("Attaching vector directory failed");
+		this->ids = (std::atomic<int32_t>*)((char*)this->header + sizeof(Header));
+		const uint64_t elements = roundChunk(chunkElements);
+		if(elements * sizeof(T) + IPC_SHM_HEADER_SIZE > SharedMemory::maxSize())
+			throw IPCException("ShmVector chunk exceeds the maximum segment size");
+		this->mask = elements - 1;
+		this->shift = 0;
+		while(((uint64_t)1 << this->shift) < elements) this->shift++;
+		this->_maxChunks = maxChunks;
+		this->_attr = attr;
+
+		if(this->shm.isCreated()) {
+			this->header->elementSize = sizeof(T);
+			this->header->chunkElements = elements;
+			this->header->maxChunks = maxChunks;
+			this->header->ready.store(READY_MAGIC, std::memory_order_release);
+		} else {
+			// Wait for the creator to initialize the header
+			this->shm.waitReady(this->header->ready, READY_MAGIC);
+			if(this->header->elementSize != sizeof(T) || this->header->chunkElements != elements || this->header->maxChunks != maxChunks)
+				throw IPCException("Vector layout mismatch");
+		}
+		this->chunkData.assign(maxChunks, (T*)NULL);
+
+		// The last user removes the directory, not necessarily its creator
+		this->shm.setDeleteOnDispose(false);
+		this->shm.lock();
+		if(this->header->destroyed) {
+			this->shm.unlock();
+			throw IPCException("ShmVector has been destroyed");
+		}
+		this->header->users++;
+		this->shm.unlock();
+	}
+
+	virtual ~ShmVector() {
+		if(this->header == NULL) return;
+		this->shm.lock();
+		const bool last = (--this->header->users == 0) && !this->header->destroyed;
+		if(last) this->header->destroyed = 1;
+		this->release(last);
+		this->shm.unlock();
+		if(last) {
+			try {
+				this->shm.destroy();
+			} catch (...) {
+				// Swallow exception in destructor
+			}
+		}
+	}
+
+	/**
+	 * Delete all chunks and the directory now, regardless of other users. Instances in other
+	 * processes must not access the vector afterwards, this instance is unusable
+	 * @throws IPCException if the vector has already been destroyed by this instance or removing fails
+	 */
+	void destroy(void) {
+		if(this->header == NULL) throw IPCException("ShmVector has been destroyed");
+		this->shm.lock();
+		this->header->destroyed = 1;
+		this->release(true);
+		this->shm.unlock();
+		this->header = NULL;
+		this->ids = NULL;
+		this->shm.destroy();
+	}
+
+	/** Element access. Elements at or beyond size() are not checked */
+	T &operator[](size_t i) {
+		return this->chunk((uint64_t)i >> this->shift)[i & this->mask];
+	}
+
+	/** Bounds-checked element access
+	  * @throws IPCException if the index is out of range */
+	T &at(size_t i) {
+		if(i >= this->size()) throw IPCException("ShmVector index out of range");
+		return (*this)[i];
+	}
+
+	/**
+	 * Append an element
+	 * @returns index of the new element
+	 * @throws IPCException if the capacity is exhausted
+	 */
+	size_t push_back(const T &value) {
+		this->shm.lock();
+		size_t i = 0;
+		try {
+			i = (size_t)this->header->size.load(std::memory_order_relaxed);
+			this->grow(i + 1);
+			(*this)[i] = value;
+			this->header->size.store(i + 1, std::memory_order_release);
+		} catch (...) {
+			this->shm.unlock();
+			throw;
+		}
+		this->shm.unlock();
+		return i;
+	}
+
+	/**
+	 * Resize to n elements. New elements are zero-initialised
+	 * @throws IPCException if the capacity is exhausted
+	 */
+	void resize(size_t n) {
+		this->shm.lock();
+		try {
+			const uint64_t size = this->header->size.load(std::memory_order_relaxed);
+			this->grow(n);
+			if(n > size) this->zero(size, n);
+			this->header->size.store(n, std::memory_order_release);
+		} catch (...) {
+			this->shm.unlock();
+			throw;
+		}
+		this->shm.unlock();
+	}
+
+	/**
+	 * Make sure that n elements fit without adding chunks
+	 * @throws IPCException if the capacity is exhausted
+	 */
+	void reserve(size_t n) {
+		this->shm.lock();
+		try {
+			this->grow(n);
+		} catch (...) {
+			this->shm.unlock();
+			throw;
+		}
+		this->shm.unlock();
+	}
+
+	/** @returns number of elements */
+	size_t size(void) const { return (size_t)this->header->size.load(std::memory_order_acquire); }
+
+	/** @returns true if the vector is empty */
+	bool empty(void) const { return this->size() == 0; }
+
+	/** @returns number of elements that fit into the published chunks */
+	size_t capacity(void) const { return (size_t)(this->header->chunks.load(std::memory_order_acquire) << this->shift); }
+
+	/** @returns number of elements per chunk */
+	size_t chunkElements(void) const { return (size_t)(this->mask + 1); }
+
+	/** @returns number of published chunks */
+	size_t chunkCount(void) const { return (size_t)this->header->chunks.load(std::memory_order_acquire); }
+
+	/** @returns maximum number of chunks */
+	size_t maxChunks(void) const { return (size_t)this->_maxChunks; }
+
+	/** @returns the directory segment */
+	SharedMemory &memory(void) { return this->shm; }
+};
+
+
+/**
+ * Hash map for fixed-size keys and values in a shared memory segment.
+ * The table is split into stripes, each an open-addressing table with linear probing, its own
+ * ShmMutex for writers and a sequence counter for readers. Lookups are optimistic: they copy
+ * the entry and retry if a writer changed the stripe meanwhile, so they never take a lock or
+ * enter the kernel. Deletion shifts entries back instead of leaving tombstones.
+ * In eviction mode, inserting into a full stripe evicts an entry chosen by the CLOCK algorithm,
+ * so the map can serve as capacity-bounded cache. Otherwise put() fails on a full stripe.
+ * Keys are hashed and compared bytewise, so they must not contain uninitialised padding.
+ * If a writer dies inside a stripe, the next writer or blocked reader clears that stripe: all
+ * of its entries are dropped, since a half-done insert or backward shift cannot be undone.
+ */
+template<typename K, typename V>
+class ShmHashMap {
+	static_assert(std::is_trivially_copyable<K>::value, "ShmHashMap requires a trivially copyable key type");
+	static_assert(std::is_trivially_copyable<V>::value, "ShmHashMap requires a trivially copyable value type");
+	static_assert(alignof(K) <= IPC_CACHELINE_SIZE && alignof(V) <= IPC_CACHELINE_SIZE, "ShmHashMap type alignment exceeds cache line size");
+public:
+	/** Default number of stripes */
+	static const int DEFAULT_STRIPES = 64;
+
+private:
+	/** Magic value marking an initialized map header */
+	static const uint32_t READY_MAGIC = 0x484d4150;
+
+	/** Optimistic read attempts before a reader falls back to the stripe lock */
+	static const int READ_RETRIES = 1024;
+
+	/** Map header at the beginning of the segment */
+	struct Header {
+		/** Set to READY_MAGIC by the creator once the header is initialized */
+		std::atomic<uint32_t> ready;
+		/** Sizes of key and value, to detect mismatching peers */
+		uint32_t keySize;
+		uint32_t valueSize;
+		/** Number of stripes, always a power of two */
+		uint32_t stripes;
+		/** Number of slots per stripe, always a power of two */
+		uint64_t slots;
+		/** Maximum number of entries per stripe, always less than slots */
+		uint64_t limit;
+		/** 1 in eviction mode */
+		uint32_t evict;
+		/** Number of entries evicted so far */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> evictions;
+	};
+
+	/** Lock and sequence counter of a stripe, one cache line each */
+	struct Stripe {
+		/** Held by writers */
+		alignas(IPC_CACHELINE_SIZE) ShmMutex mutex;
+		/** Odd while a writer modifies the stripe */
+		std::atomic<uint64_t> version;
+		/** Number of entries. Written under the lock only */
+		std::atomic<uint64_t> count;
+		/** CLOCK hand for eviction */
+		uint64_t hand;
+	};
+
+	struct Slot {
+		/** Low 32 bits of the hash of the key */
+		uint32_t hash;
+		/** 1 if the slot holds an entry */
+		uint8_t used;
+		/** CLOCK reference bit, set by lookups in eviction mode */
+		std::atomic<uint8_t> referenced;
+		K key;
+		V value;
+	};
+
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	Header *header;
+	Stripe *stripes;
+	Slot *slots;
+
+	uint64_t stripeMask;
+	uint64_t slotMask;
+	uint64_t limit;
+	bool evict;
+
+	static uint64_t roundPow2(uint64_t n) {
+		uint64_t ret = 1;
+		while(ret < n) ret <<= 1;
+		return ret;
+	}
+
+	static uint64_t roundStripes(int stripes) {
+		if(stripes <= 0) throw IPCException("ShmHashMap needs at least one stripe");
+		return roundPow2((uint64_t)stripes);
+	}
+
+	/** @returns number of slots per stripe for a maximum load of 3/4 */
+	static uint64_t slotCount(size_t capacity, int stripes) {
+		if(capacity == 0) throw IPCException("ShmHashMap capacity must be greater than zero");
+		const uint64_t n = roundStripes(stripes);
+		const uint64_t perStripe = ((uint64_t)capacity + n - 1) / n;
+		const uint64_t ret = roundPow2((perStripe * 4 + 2) / 3);
+		return (ret < 2) ? 2 : ret;
+	}
+
+	static size_t segmentSize(size_t capacity, int stripes) {
+		return sizeof(Header) + roundStripes(stripes) * (sizeof(Stripe) + slotCount(capacity, stripes) * sizeof(Slot));
+	}
+
+	/** Bytewise hash (FNV-1a with a final avalanche) */
+	static uint64_t hash(const K &key) {
+		const unsigned char *bytes = (const unsigned char*)&key;
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for(size_t i = 0; i < sizeof(K); i++) {
+			h ^= bytes[i];
+			h *= 0x100000001b3ULL;
+		}
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	uint64_t stripeOf(uint64_t h) const { return (h >> 32) & this->stripeMask; }
+	Slot *slotsOf(uint64_t stripe) const { return this->slots + stripe * (this->slotMask + 1); }
+
+	/** Lock a stripe for writing. Clears the stripe if its previous writer died, so all
+	 * entries of that stripe are lost, not only the one being written */
+	void lockStripe(uint64_t stripe) {
+		Stripe &st = this->stripes[stripe];
+		if(st.mutex.lock() == EOWNERDEAD) {
+			// The stripe may be half-modified, start over with an empty stripe. The version stays
+			// odd while clearing, so optimistic readers do not copy from a partly cleared stripe.
+			// It already is odd if the writer died between beginWrite() and endWrite()
+			if(!(st.version.load(std::memory_order_relaxed) & 1)) this->beginWrite(st);
+			::memset((void*)this->slotsOf(stripe), 0, (size_t)(this->slotMask + 1) * sizeof(Slot));
+			st.count.store(0, std::memory_order_relaxed);
+			st.hand = 0;
+			this->endWrite(st);
+		}
+	}
+
+	/** Start modifying a locked stripe. Makes the version odd */
+	void beginWrite(Stripe &st) {
+		st.version.store(st.version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	/** Finish modifying a locked stripe. Makes the version even */
+	void endWrite(Stripe &st) {
+		st.version.store(st.version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	/**
+	 * Probe a stripe for the given key. Used by writers under the lock and by optimistic readers
+	 * @returns slot index of the key, or the index of the empty slot ending the probe as ~index
+	 */
+	uint64_t probe(const Slot *table, uint32_t tag, const K &key) const {
+		uint64_t i = tag & this->slotMask;
+		for(uint64_t n = 0; n <= this->slotMask; n++) {
+			const Slot &slot = table[i];
+			if(!slot.used) return ~i;
+			if(slot.hash == tag && ::memcmp((const void*)&slot.key, &key, sizeof(K)) == 0) return i;
+			i = (i + 1) & this->slotMask;
+		}
+		// Only reachable by a reader seeing a torn stripe
+		return ~(uint64_t)0;
+	}
+
+	/** Copy the entry of slot src to slot dst */
+	static void move(Slot &dst, const Slot &src) {
+		dst.hash = src.hash;
+		dst.used = src.used;
+		dst.referenced.store(src.referenced.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		::memcpy((void*)&dst.key, (const void*)&src.key, sizeof(K));
+		::memcpy((void*)&dst.value, (const void*)&src.value, sizeof(V));
+	}
+
+	/** Remove the entry at index i of a locked stripe, shifting the following entries back */
+	void removeAt(uint64_t stripe, uint64_t i) {
+		Slot *table = this->slotsOf(stripe);
+		uint64_t j = i;
+		for(;;) {
+			j = (j + 1) & this->slotMask;
+			if(!table[j].used) break;
+			const uint64_t home = table[j].hash & this->slotMask;
+			// Move the entry back, unless its home lies in (i, j]
+			if(((j - home) & this->slotMask) >= ((j - i) & this->slotMask)) {
+				ShmHashMap::move(table[i], table[j]);
+				i = j;
+			}
+		}
+		table[i].used = 0;
+		table[i].referenced.store(0, std::memory_order_relaxed);
+		this->stripes[stripe].count.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	/** Evict one entry of a locked, full stripe using the CLOCK algorithm */
+	void evictOne(uint64_t stripe) {
+		Stripe &st = this->stripes[stripe];
+		Slot *table = this->slotsOf(stripe);
+		for(;;) {
+			const uint64_t i = st.hand & this->slotMask;
+			st.hand = i + 1;
+			if(!table[i].used) continue;
+			if(table[i].referenced.load(std::memory_order_relaxed)) {
+				table[i].referenced.store(0, std::memory_order_relaxed);
+				continue;
+			}
+			this->removeAt(stripe, i);
+			this->header->evictions.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+
+	/** Look the key up under the stripe lock */
+	bool lockedGet(uint64_t stripe, uint32_t tag, const K &key, V &value) {
+		this->lockStripe(stripe);
+		const Slot *table = this->slotsOf(stripe);
+		const uint64_t i = this->probe(table, tag, key);
+		const bool found = (i <= this->slotMask);
+		if(found) ::memcpy(&value, (const void*)&table[i].value, sizeof(V));
+		this->stripes[stripe].mutex.unlock();
+		return found;
+	}
+
+	ShmHashMap(const ShmHashMap &ref) = delete;
+	ShmHashMap &operator=(const ShmHashMap &ref) = delete;
+
+public:
+	typedef K key_type;
+	typedef V mapped_type;
+
+	/**
+	 * Create or attach to the map with the given key
+	 * @param key Shared memory key of the map
+	 * @param capacity Number of entries the map is sized for. Stripes hold at most 3/4 of their slots
+	 * @param evict If true, inserting into a full stripe evicts an entry instead of failing
+	 * @param stripes Number of stripes, rounded up to a power of two
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created or its layout does not match
+	 */
+	ShmHashMap(int key, size_t capacity, bool evict = false, int stripes = DEFAULT_STRIPES, int attr = 0600) :
+			shm(key, segmentSize(capacity, stripes), attr) {
+		static_assert(sizeof(Header) % IPC_CACHELINE_SIZE == 0, "ShmHashMap header misaligned");
+		static_assert(sizeof(Stripe) == IPC_CACHELINE_SIZE, "ShmHashMap stripe exceeds a cache line");
+		this->header = (Header*)this->shm.get();
+		if(this->header == NULL) throw IPCException("Attaching hash map failed");
+		const uint64_t nStripes = roundStripes(stripes);
+		const uint64_t nSlots = slotCount(capacity, stripes);
+		this->stripes = (Stripe*)((char*)this->header + sizeof(Header));
+		this->slots = (Slot*)((char*)this->stripes + nStripes * sizeof(Stripe));
+		this->stripeMask = nStripes - 1;
+		this->slotMask = nSlots - 1;
+		this->limit = nSlots - nSlots / 4;
+		if(this->limit >= nSlots) this->limit = nSlots - 1;
+		this->evict = evict;
+
+		if(this->shm.isCreated()) {
+			this->header->keySize = sizeof(K);
+			this->header->valueSize = sizeof(V);
+			this->header->stripes = (uint32_t)nStripes;
+			this->header->slots = nSlots;
+			this->header->limit = this->limit;
+			this->header->evict = evict ? 1 : 0;
+			this->header->ready.store(READY_MAGIC, std::memory_order_release);
+		} else {
+			// Wait for the creator to initialize the header
+			this->shm.waitReady(this->header->ready, READY_MAGIC);
+			if(this->header->keySize != sizeof(K) || this->header->valueSize != sizeof(V) || this->header->stripes != nStripes ||
+					this->header->slots != nSlots || this->header->evict != (evict ? 1U : 0U))
+				throw IPCException("Hash map layout mismatch");
+		}
+	}
+
+	virtual ~ShmHashMap() {}
+
+	/**
+	 * Look up a key without locking
+	 * @param key Key to look up
+	 * @param value Receives a copy of the value if the key is present
+	 * @returns true if the key is present
+	 */
+	bool get(const K &key, V &value) {
+		const uint64_t h = ShmHashMap::hash(key);
+		const uint32_t tag = (uint32_t)h;
+		const uint64_t stripe = this->stripeOf(h);
+		const Stripe &st = this->stripes[stripe];
+		const Slot *table = this->slotsOf(stripe);
+		for(int retry = 0; retry < READ_RETRIES; retry++) {
+			const uint64_t version = st.version.load(std::memory_order_acquire);
+			if(version & 1) {
+				ipc_cpu_relax();
+				continue;
+			}
+			const uint64_t i = this->probe(table, tag, key);
+			const bool found = (i <= this->slotMask);
+			if(found) ::memcpy(&value, (const void*)&table[i].value, sizeof(V));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(st.version.load(std::memory_order_relaxed) != version) continue;
+			if(found && this->evict && !table[i].referenced.load(std::memory_order_relaxed))
+				const_cast<Slot&>(table[i]).referenced.store(1, std::memory_order_relaxed);
+			return found;
+		}
+		// The stripe is busy or its writer died, wait for the lock
+		return this->lockedGet(stripe, tag, key, value);
+	}
+
+	/** @returns true if the key is present */
+	bool contains(const K &key) {
+		V value;
+		return this->get(key, value);
+	}
+
+	/**
+	 * Insert a key or replace its value
+	 * @returns true if the entry has been stored, false if the stripe is full and eviction is disabled
+	 */
+	bool put(const K &key, const V &value) {
+		const uint64_t h = ShmHashMap::hash(key);
+		const uint32_t tag = (uint32_t)h;
+		const uint64_t stripe = this->stripeOf(h);
+		Stripe &st = this->stripes[stripe];
+		Slot *table = this->slotsOf(stripe);
+		this->lockStripe(stripe);
+		uint64_t i = this->probe(table, tag, key);
+		if(i > this->slotMask && !this->evict && st.count.load(std::memory_order_relaxed) >= this->limit) {
+			st.mutex.unlock();
+			return false;
+		}
+		this->beginWrite(st);
+		if(i <= this->slotMask) {
+			::memcpy((void*)&table[i].value, &value, sizeof(V));
+		} else {
+			if(st.count.load(std::memory_order_relaxed) >= this->limit) {
+				this->evictOne(stripe);
+				i = this->probe(table, tag, key);
+			}
+			i = ~i;
+			table[i].hash = tag;
+			::memcpy((void*)&table[i].key, &key, sizeof(K));
+			::memcpy((void*)&table[i].value, &value, sizeof(V));
+			table[i].referenced.store(0, std::memory_order_relaxed);
+			table[i].used = 1;
+			st.count.fetch_add(1, std::memory_order_relaxed);
+		}
+		this->endWrite(st);
+		st.mutex.unlock();
+		return true;
+	}
+
+	/**
+	 * Remove a key
+	 * @returns true if the key was present
+	 */
+	bool erase(const K &key) {
+		const uint64_t h = ShmHashMap::hash(key);
+		const uint64_t stripe = this->stripeOf(h);
+		Stripe &st = this->stripes[stripe];
+		this->lockStripe(stripe);
+		const uint64_t i = this->probe(this->slotsOf(stripe), (uint32_t)h, key);
+		const bool found = (i <= this->slotMask);
+		if(found) {
+			this->beginWrite(st);
+			this->removeAt(stripe, i);
+			this->endWrite(st);
+		}
+		st.mutex.unlock();
+		return found;
+	}
+
+	/** Remove all entries */
+	void clear(void) {
+		for(uint64_t stripe = 0; stripe <= this->stripeMask; stripe++) {
+			Stripe &st = this->stripes[stripe];
+			this->lockStripe(stripe);
+			this->beginWrite(st);
+			::memset((void*)this->slotsOf(stripe), 0, (size_t)(this->slotMask + 1) * sizeof(Slot));
+			st.count.store(0, std::memory_order_relaxed);
+			st.hand = 0;
+			this->endWrite(st);
+			st.mutex.unlock();
+		}
+	}
+
+	/** @returns number of entries. Not a snapshot while writers are active */
+	size_t size(void) const {
+		uint64_t ret = 0;
+		for(uint64_t stripe = 0; stripe <= this->stripeMask; stripe++)
+			ret += this->stripes[stripe].count.load(std::memory_order_relaxed);
+		return (size_t)ret;
+	}
+
+	/** @returns true if the map is empty */
+	bool empty(void) const { return this->size() == 0; }
+
+	/** @returns maximum number of entries, if the keys were spread evenly over the stripes */
+	size_t capacity(void) const { return (size_t)(this->limit * (this->stripeMask + 1)); }
+
+	/** @returns number of stripes */
+	int stripeCount(void) const { return (int)(this->stripeMask + 1); }
+
+	/** @returns number of entries evicted so far */
+	uint64_t evictions(void) const { return this->header->evictions.load(std::memory_order_relaxed); }
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void) { return this->shm; }
+};
+
+
+/**
+ * Request/response channel between client processes and one server process.
+ * Every client owns a submission ring and a completion ring. Clients submit any number of
+ * requests, tagged with a correlation id, and ring the server once per batch with flush().
+ * The server drains requests of all clients in batches, completes them in any order and
+ * rings each affected client once per flush(). Doorbells only enter the kernel if the other
+ * side sleeps; in polling mode a process spins instead of sleeping, so a polling client and a
+ * polling server exchange requests without any system call.
+ * A client id must only be used by one thread at a time, and there must be a single server.
+ * Request and response types must be trivially copyable.
+ */
+template<typename Request, typename Response>
+class ShmRpc {
+	static_assert(std::is_trivially_copyable<Request>::value, "ShmRpc requires a trivially copyable request type");
+	static_assert(std::is_trivially_copyable<Response>::value, "ShmRpc requires a trivially copyable response type");
+	static_assert(alignof(Request) <= IPC_CACHELINE_SIZE && alignof(Response) <= IPC_CACHELINE_SIZE, "ShmRpc type alignment exceeds cache line size");
+public:
+	/** Request as received by the server */
+	struct Incoming {
+		/** Client that submitted the request, to be passed to complete() */
+		int client;
+		/** Correlation id given by the client */
+		uint64_t id;
+		Request request;
+	};
+
+private:
+	/** Magic value marking an initialized channel header */
+	static const uint32_t READY_MAGIC = 0x52504353;
+
+	/** Channel header at the beginning of the segment */
+	struct Header {
+		/** Set to READY_MAGIC by the creator once the header is initialized */
+		std::atomic<uint32_t> ready;
+		/** Sizes of request and response, to detect mismatching peers */
+		uint32_t requestSize;
+		uint32_t responseSize;
+		/** Number of client slots */
+		uint32_t clients;
+		/** Entries per ring, always a power of two */
+		uint64_t entries;
+		/** Rung by clients after submitting a batch */
+		alignas(IPC_CACHELINE_SIZE) Doorbell requests;
+	};
+
+	/** Ring indices of a client. Client and server side indices are on separate cache lines */
+	struct Channel {
+		/** 0 free, 1 connected */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint32_t> state;
+		/** Next submission to be written and next completion to be read. Written by the client */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> sqTail;
+		std::atomic<uint64_t> cqHead;
+		/** Next submission to be read and next completion to be written. Written by the server */
+		alignas(IPC_CACHELINE_SIZE) std::atomic<uint64_t> sqHead;
+		std::atomic<uint64_t> cqTail;
+		/** Rung by the server after completing a batch */
+		alignas(IPC_CACHELINE_SIZE) Doorbell completions;
+	};
+
+	struct Submission {
+		uint64_t id;
+		Request request;
+	};
+
+	struct Completion {
+		uint64_t id;
+		Response response;
+	};
+
+	/** Underlying shared memory segment */
+	SharedMemory shm;
+
+	Header *header;
+	Channel *channels;
+	Submission *submissions;
+	Completion *completionEntries;
+
+	int _clients;
+	uint64_t entries;
+	uint64_t mask;
+
+	/** Spin instead of sleeping when waiting */
+	bool polling;
+	/** Client requests have been submitted since the last flush() */
+	bool submitted;
+	/** Clients with completions since the last flush() */
+	std::vector<int> completed;
+	std::vector<char> completedFlag;
+	/** Server-local copy of the completion heads, refreshed only when a ring looks full */
+	std::vector<uint64_t> cachedCqHead;
+	/** Client the next receive() starts with */
+	int nextClient;
+
+	static uint64_t roundEntries(size_t entries) {
+		if(entries == 0) throw IPCException("ShmRpc ring size must be greater than zero");
+		uint64_t ret = 1;
+		while(ret < entries) ret <<= 1;
+		return ret;
+	}
+
+	static size_t segmentSize(int clients, size_t entries) {
+		if(clients <= 0) throw IPCException("ShmRpc needs at least one client slot");
+		return sizeof(Header) + (size_t)clients * (sizeof(Channel) + roundEntries(entries) * (sizeof(Submission) + sizeof(Completion)));
+	}
+
+	static int64_t now_us(void) {
+		struct timespec ts;
+		::clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	Channel &channel(int client) const {
+		if(client < 0 || client >= this->_clients) throw IPCException("Illegal ShmRpc client id");
+		return this->channels[client];
+	}
+
+	/** Wait until the predicate holds, spinning in polling mode and sleeping on the doorbell otherwise */
+	template<class Pred>
+	bool waitOn(Doorbell &bell, long timeout_us, Pred pred) {
+		const int64_t deadline = (timeout_us < 0) ? 0 : now_us() + timeout_us;
+		for(;;) {
+			const uint32_t seen = bell.sequence();
+			if(pred()) return true;
+			long remaining = -1;
+			if(timeout_us >= 0) {
+				remaining = (long)(deadline - now_us());
+				if(remaining <= 0) return false;
+			}
+			if(this->polling) ipc_cpu_relax();
+			else bell.wait_for(seen, remaining);
+		}
+	}
+
+	ShmRpc(const ShmRpc &ref) = delete;
+	ShmRpc &operator=(const ShmRpc &ref) = delete;
+
+public:
+	/**
+	 * Create or attach to the channel with the given key
+	 * @param key Shared memory key of the channel
+	 * @param clients Number of client slots
+	 * @param entries Entries per ring, rounded up to a power of two. Limits the requests in flight per client
+	 * @param attr Attributes of the shared memory segment. Default value is 0600
+	 * @throws IPCException if the segment cannot be created or its layout does not match
+	 */
+	ShmRpc(int key, int clients, size_t entries = 256, int attr = 0600) :
+			shm(key, segmentSize(clients, entries), attr) {
+		static_assert(sizeof(Header) % IPC_CACHELINE_SIZE == 0, "ShmRpc header misaligned");
+		static_assert(sizeof(Channel) % IPC_CACHELINE_SIZE == 0, "ShmRpc channel misaligned");
+		this->header = (Header*)this->shm.get();
+		if(this->header == NULL) throw IPCException("Attaching RPC channel failed");
+		this->_clients = clients;
+		this->entries = roundEntries(entries);
+		this->mask = this->entries - 1;
+		this->channels = (Channel*)((char*)this->header + sizeof(Header));
+		this->submissions = (Submission*)((char*)this->channels + (size_t)clients * sizeof(Channel));
+		this->completionEntries = (Completion*)((char*)this->submissions + (size_t)clients * this->entries * sizeof(Submission));
+		this->polling = false;
+		this->submitted = false;
+		this->completedFlag.assign(clients, 0);
+		this->cachedCqHead.assign(clients, 0);
+		this->nextClient = 0;
+
+		if(this->shm.isCreated()) {
+			this->header->requestSize = sizeof(Request);
+			this->header->responseSize = sizeof(Response);
+			this->header->clients = (uint32_t)clients;
+			this->header->entries = this->entries;
+			this->header->ready.store(READY_MAGIC, std::memory_order_release);
+		} else {
+			// Wait for the creator to initialize the header
+			this->shm.waitReady(this->header->ready, READY_MAGIC);
+			if(this->header->requestSize != sizeof(Request) || this->header->responseSize != sizeof(Response) ||
+					this->header->clients != (uint32_t)clients || this->header->entries != this->entries)
+				throw IPCException("RPC channel layout mismatch");
+		}
+	}
+
+	virtual ~ShmRpc() {}
+
+	/**
+	 * Spin instead of sleeping in waitRequests(), waitCompletions() and call().
+	 * Only affects this process; if both sides poll, no system calls are made at all
+	 */
+	void setPolling(bool enabled = true) { this->polling = enabled; }
+
+	/** @returns true if this instance polls instead of sleeping */
+	bool isPolling(void) const { return this->polling; }
+
+	/**
+	 * Claim a free client slot
+	 * @returns client id
+	 * @throws IPCException if all slots are in use
+	 */
+	int connect(void) {
+		for(int i = 0; i < this->_clients; i++) {
+			uint32_t expected = 0;
+			if(this->channels[i].state.compare_exchange_strong(expected, 1, std::memory_order_acq_rel))
+				return i;
+		}
+		throw IPCException("No free RPC client slot");
+	}
+
+	/**
+	 * Release a client slot
+	 * @throws IPCException if requests of the client are still in flight
+	 */
+	void disconnect(int client) {
+		Channel &ch = this->channel(client);
+		if(this->inflight(client) != 0) throw IPCException("ShmRpc client has requests in flight");
+		ch.state.store(0, std::memory_order_release);
+	}
+
+	/**
+	 * Queue a request. The server is notified with the next flush()
+	 * @param client Client id obtained by connect()
+	 * @param id Correlation id, returned with the response
+	 * @param request Request to be sent
+	 * @returns false if the client already has entries requests in flight
+	 */
+	bool submit(int client, uint64_t id, const Request &request) {
+		Channel &ch = this->channel(client);
+		const uint64_t tail = ch.sqTail.load(std::memory_order_relaxed);
+		if(tail - ch.cqHead.load(std::memory_order_relaxed) >= this->entries) return false;
+		Submission &entry = this->submissions[(uint64_t)client * this->entries + (tail & this->mask)];
+		entry.id = id;
+		::memcpy((void*)&entry.request, &request, sizeof(Request));
+		ch.sqTail.store(tail + 1, std::memory_order_release);
+		this->submitted = true;
+		return true;
+	}
+
+	/**
+	 * Take up to n completions of the client without blocking
+	 * @returns number of completions taken
+	 */
+	size_t poll(int client, uint64_t *ids, Response *responses, size_t n) {
+		Channel &ch = this->channel(client);
+		const uint64_t head = ch.cqHead.load(std::memory_order_relaxed);
+		uint64_t avail = ch.cqTail.load(std::memory_order_acquire) - head;
+		if(n > avail) n = (size_t)avail;
+		const Completion *ring = this->completionEntries + (uint64_t)client * this->entries;
+		for(size_t i = 0; i < n; i++) {
+			const Completion &entry = ring[(head + i) & this->mask];
+			ids[i] = entry.id;
+			::memcpy(&responses[i], (const void*)&entry.response, sizeof(Response));
+		}
+		if(n > 0) ch.cqHead.store(head + n, std::memory_order_release);
+		return n;
+	}
+
+	/**
+	 * Take a single completion of the client without blocking
+	 * @returns true if a completion has been taken
+	 */
+	bool poll(int client, uint64_t &id, Response &response) {
+		return this->poll(client, &id, &response, 1) == 1;
+	}
+
+	/**
+	 * Wait until the client has a completion
+	 * @param timeout_us Timeout in microseconds, negative for no timeout
+	 * @returns false if the timeout expired
+	 */
+	bool waitCompletions(int client, long timeout_us = -1) {
+		Channel &ch = this->channel(client);
+		return this->waitOn(ch.completions, timeout_us, [&]() {
+			return ch.cqTail.load(std::memory_order_acquire) != ch.cqHead.load(std::memory_order_relaxed);
+		});
+	}
+
+	/** @returns number of requests of the client that have not been taken as completion yet */
+	size_t inflight(int client) const {
+		const Channel &ch = this->channel(client);
+		return (size_t)(ch.sqTail.load(std::memory_order_relaxed) - ch.cqHead.load(std::memory_order_relaxed));
+	}
+
+	/**
+	 * Synchronous call: submit, flush and wait for the response
+	 * @throws IPCException if other requests of the client are in flight
+	 */
+	Response call(int client, const Request &request) {
+		if(this->inflight(client) != 0) throw IPCException("ShmRpc call with requests in flight");
+		this->submit(client, 0, request);
+		this->flush();
+		uint64_t id;
+		Response ret = Response();
+		while(!this->poll(client, id, ret))
+			this->waitCompletions(client);
+		return ret;
+	}
+
+	/**
+	 * Take up to n requests of all clients without blocking. Must only be called by the server
+	 * @returns number of requests taken
+	 */
+	size_t receive(Incoming *items, size_t n) {
+		size_t got = 0;
+		for(int i = 0; i < this->_clients && got < n; i++) {
+			const int client = (this->nextClient + i) % this->_clients;
+			Channel &ch = this->channels[client];
+			const uint64_t head = ch.sqHead.load(std::memory_order_relaxed);
+			uint64_t avail = ch.sqTail.load(std::memory_order_acquire) - head;
+			if(avail == 0) continue;
+			if(avail > n - got) avail = n - got;
+			const Submission *ring = this->submissions + (uint64_t)client * this->entries;
+			for(uint64_t j = 0; j < avail; j++) {
+				const Submission &entry = ring[(head + j) & this->mask];
+				items[got].client = client;
+				items[got].id = entry.id;
+				::memcpy(&items[got].request, (const void*)&entry.request, sizeof(Request));
+				got++;
+			}
+			ch.sqHead.store(head + avail, std::memory_order_release);
+		}
+		if(this->_clients > 0) this->nextClient = (this->nextClient + 1) % this->_clients;
+		return got;
+	}
+
+	/**
+	 * Wait until any client has submitted a request. Must only be called by the server
+	 * @param timeout_us Timeout in microseconds, negative for no timeout
+	 * @returns false if the timeout expired
+	 */
+	bool waitRequests(long timeout_us = -1) {
+		return this->waitOn(this->header->requests, timeout_us, [&]() {
+			for(int i = 0; i < this->_clients; i++) {
+				const Channel &ch = this->channels[i];
+				if(ch.sqTail.load(std::memory_order_acquire) != ch.sqHead.load(std::memory_order_relaxed)) return true;
+			}
+			return false;
+		});
+	}
+
+	/**
+	 * Complete a received request, in any order. The client is notified with the next flush().
+	 * Must only be called by the server
+	 * @throws IPCException if the completion ring of the client is full
+	 */
+	void complete(int client, uint64_t id, const Response &response) {
+		Channel &ch = this->channel(client);
+		const uint64_t tail = ch.cqTail.load(std::memory_order_relaxed);
+		if(tail - this->cachedCqHead[client] >= this->entries) {
+			this->cachedCqHead[client] = ch.cqHead.load(std::memory_order_acquire);
+			if(tail - this->cachedCqHead[client] >= this->entries) throw IPCException("ShmRpc completion ring overflow");
+		}
+		Completion &entry = this->completionEntries[(uint64_t)client * this->entries + (tail & this->mask)];
+		entry.id = id;
+		::memcpy((void*)&entry.response, &response, sizeof(Response));
+		ch.cqTail.store(tail + 1, std::memory_order_release);
+		if(!this->completedFlag[client]) {
+			this->completedFlag[client] = 1;
+			this->completed.push_back(client);
+		}
+	}
+
+	/** Notify the server of submitted requests and the clients of completed requests since the last flush() */
+	void flush(void) {
+		if(this->submitted) {
+			this->submitted = false;
+			this->header->requests.ring();
+		}
+		for(size_t i = 0; i < this->completed.size(); i++) {
+			const int client = this->completed[i];
+			this->completedFlag[client] = 0;
+			this->channels[client].completions.ring();
+		}
+		this->completed.clear();
+	}
+
+	/** @returns number of client slots */
+	int clients(void) const { return this->_clients; }
+
+	/** @returns entries per ring */
+	size_t ringSize(void) const { return (size_t)this->entries; }
+
+	/** @returns the underlying shared memory segment */
+	SharedMemory &memory(void) { return this->shm; }
 };
 
 #endif
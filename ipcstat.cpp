@@ -0,0 +1,120 @@
+/* =============================================================================
+ *
+ * Title:         Live contention and latency statistics of the IPC modules
+ * Author:        Felix Niederwanger
+ * License:       Copyright (c), 2019 Felix Niederwanger
+ *                MIT license (http://opensource.org/licenses/MIT)
+ *
+ * Attaches to the stats segment published by processes using a library built
+ * with IPC_STATS (make STATS=-DIPC_STATS) and prints the counters and latency
+ * histograms, similar to `ipcs` but with performance data. With an interval,
+ * the values of each period are printed instead of the totals.
+ *
+ * Usage: ipcstat [--key KEY] [--interval SECONDS] [--count N] [--reset]
+ *
+ * =============================================================================
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ipc.hpp"
+
+
+using namespace std;
+
+/** Difference of two snapshots */
+static IPCStats::Snapshot delta(const IPCStats::Snapshot &now, const IPCStats::Snapshot &prev) {
+	IPCStats::Snapshot ret = now;
+	for(int i=0;i<IPC_STATS_COUNTERS;i++) ret.counters[i] -= prev.counters[i];
+	for(int h=0;h<IPC_STATS_HISTOGRAMS;h++) {
+		ret.samples[h] -= prev.samples[h];
+		ret.total_ns[h] -= prev.total_ns[h];
+		for(int b=0;b<IPC_STATS_BUCKETS;b++) ret.buckets[h][b] -= prev.buckets[h][b];
+	}
+	return ret;
+}
+
+static void print(const IPCStats::Snapshot &snapshot, double seconds) {
+	cout << "------ Counters ------" << endl;
+	cout << left << setw(20) << "counter" << right << setw(16) << "value";
+	if(seconds > 0) cout << setw(14) << "per sec";
+	cout << endl;
+	for(int i=0;i<IPC_STATS_COUNTERS;i++) {
+		const IPCStatsCounter counter = (IPCStatsCounter)i;
+		cout << left << setw(20) << IPCStats::name(counter) << right << setw(16) << snapshot.counters[i];
+		if(seconds > 0) cout << setw(14) << fixed << setprecision(1) << snapshot.counters[i] / seconds;
+		cout << endl;
+	}
+	cout << endl << "------ Latency (ns) ------" << endl;
+	cout << left << setw(20) << "histogram" << right << setw(12) << "samples" << setw(12) << "mean"
+		<< setw(12) << "p50" << setw(12) << "p99" << setw(12) << "p999" << endl;
+	for(int h=0;h<IPC_STATS_HISTOGRAMS;h++) {
+		const IPCStatsHistogram histogram = (IPCStatsHistogram)h;
+		const uint64_t samples = snapshot.samples[h];
+		cout << left << setw(20) << IPCStats::name(histogram) << right << setw(12) << samples
+			<< setw(12) << (samples == 0 ? 0 : snapshot.total_ns[h] / samples)
+			<< setw(12) << IPCStats::percentile(snapshot, histogram, 0.5)
+			<< setw(12) << IPCStats::percentile(snapshot, histogram, 0.99)
+			<< setw(12) << IPCStats::percentile(snapshot, histogram, 0.999) << endl;
+	}
+	cout << endl;
+}
+
+static void usage(const char *prog) {
+	cerr << "Usage: " << prog << " [--key KEY] [--interval SECONDS] [--count N] [--reset]" << endl;
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+	int key = IPC_STATS_KEY;
+	int interval = 0;
+	int count = -1;
+	bool reset = false;
+	for(int i=1;i<argc;i++) {
+		const string arg = argv[i];
+		if(arg == "--key" && i + 1 < argc) key = (int)strtol(argv[++i], NULL, 0);
+		else if(arg == "--interval" && i + 1 < argc) interval = atoi(argv[++i]);
+		else if(arg == "--count" && i + 1 < argc) count = atoi(argv[++i]);
+		else if(arg == "--reset") reset = true;
+		else usage(argv[0]);
+	}
+	if(interval < 0) usage(argv[0]);
+
+	try {
+		if(reset) {
+			if(!IPCStats::reset(key)) {
+				cerr << "No stats segment with key 0x" << hex << key << endl;
+				return EXIT_FAILURE;
+			}
+			return EXIT_SUCCESS;
+		}
+
+		IPCStats::Snapshot prev;
+		if(!IPCStats::snapshot(prev, key)) {
+			cerr << "No stats segment with key 0x" << hex << key << " (is the library built with IPC_STATS?)" << endl;
+			return EXIT_FAILURE;
+		}
+		if(interval == 0) {
+			print(prev, 0);
+			return EXIT_SUCCESS;
+		}
+		for(int i=0;count < 0 || i < count;i++) {
+			sleep(interval);
+			IPCStats::Snapshot now;
+			if(!IPCStats::snapshot(now, key)) {
+				cerr << "Stats segment has been removed" << endl;
+				return EXIT_FAILURE;
+			}
+			print(delta(now, prev), interval);
+			prev = now;
+		}
+	} catch (IPCException &e) {
+		cerr << "Error: " << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}